@@ -51,12 +51,39 @@ SOFTWARE.
 /* -------------------------------------------------------------------------- */
 
 /*****************************************************************************
-      CLASS DEFINITION : EzMutex
+      ATOMIC OPERATIONS : EzAtomic
  *****************************************************************************/
 #if defined(_WIN32)
-#   include <windows.h>  /* Sleep() */
+#   include <windows.h>  /* Sleep(), Interlocked*() */
 #else
-#   include <time.h>     /* nanosleep() */
+#   include <time.h>     /* nanosleep(), clock_nanosleep() */
+#   include <errno.h>    /* EINTR */
+#endif
+
+#if defined(__linux__)
+#   include <unistd.h>       /* syscall() */
+#   include <sys/syscall.h>  /* SYS_futex */
+#   include <linux/futex.h>  /* FUTEX_WAIT, FUTEX_WAKE */
+#   ifndef FUTEX_PRIVATE_FLAG
+#      define FUTEX_PRIVATE_FLAG 0
+#   endif
+#endif
+
+/* park()/unpark() : futex on Linux, WaitOnAddress() on Windows 8 and later,  */
+/* a table of mutexes and condition variables on other POSIX systems.         */
+/* EZ_NO_FUTEX selects the table on Linux too.                                */
+#if defined(__linux__) && !defined(EZ_NO_FUTEX)
+#   define EZ_HAVE_FUTEX
+#elif defined(_WIN32) && defined(_MSC_VER) && defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0602)
+#   pragma comment(lib, "Synchronization.lib")  /* WaitOnAddress() */
+#   define EZ_HAVE_WAITONADDRESS__
+#elif !defined(_WIN32)
+#   include <pthread.h>      /* pthread_mutex_t, pthread_cond_t */
+#   include <sys/time.h>     /* gettimeofday() */
+#   define EZ_HAVE_PARK_TABLE__
+#endif
+#if defined(EZ_HAVE_FUTEX) || defined(EZ_HAVE_WAITONADDRESS__) || defined(EZ_HAVE_PARK_TABLE__)
+#   define EZ_PARK_BLOCKS__   /* else park() only calls Wait(): waiters spin */
 #endif
 
 #if defined(__BORLANDC__) && !defined(__CODEGEARC__)  /* bcc55 */
@@ -67,44 +94,564 @@ SOFTWARE.
 #  define INLINE_ inline
 #endif
 
+#if defined(_WIN32) && !defined(__GNUC__)
+#  define EZ_ATOMIC_INTERLOCKED__
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*  eztoken_t : a word which can be waited on by EzMutex::park().             */
+/*              (Interlocked*() requires LONG, futex requires int.)           */
+/* -------------------------------------------------------------------------- */
+#if defined(_WIN32)
+#   define eztoken_t  long
+#else
+#   define eztoken_t  int
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*  ezint64_t : a signed 64-bit integer for nanosecond time values            */
+/* -------------------------------------------------------------------------- */
+#if defined(_MSC_VER) || defined(__BORLANDC__) || defined(__WATCOMC__) || defined(__DMC__)
+#   define ezint64_t  __int64
+#else
+#   define ezint64_t  long long
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*  EZ_CACHE_LINE : padding size to keep hot variables on separate lines      */
+/* -------------------------------------------------------------------------- */
+#ifndef EZ_CACHE_LINE
+#  define EZ_CACHE_LINE     64    /* bytes */
+#endif
+
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+#   include <intrin.h>
+#   define EZ_COMPILER_BARRIER__() _ReadWriteBarrier()
+#else
+#   define EZ_COMPILER_BARRIER__()
+#endif
+
+class EzAtomic {
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   load()      : reads *p with acquire ordering.                            */
+/*   store()     : writes val into *p with release ordering.                  */
+/*   load_relaxed() / store_relaxed() : no ordering, just atomic access.      */
+/* -------------------------------------------------------------------------- */
+/*   cas()       : compare-and-swap. returns the previous value of *p.        */
+/*   exchange()  : stores val into *p. returns the previous value of *p.      */
+/*   fetch_add() : adds val to *p. returns the previous value of *p.          */
+/*   fence()     : a full memory barrier.                                     */
+/*   fence_acquire() : keeps the loads before it ahead of the accesses after. */
+/*   cas(), exchange() and fetch_add() imply a full memory barrier.           */
+/*   GCC-compatible compilers use __atomic builtins if available, and         */
+/*   __sync builtins otherwise. Other Windows compilers use Interlocked*().   */
+/* -------------------------------------------------------------------------- */
+#ifdef EZ_ATOMIC_INTERLOCKED__
+    /* x86 never reorders a load with older loads nor a store with older   */
+    /* accesses, so acquire/release only needs a compiler barrier.         */
+    static inline long load(const VOLATILE_ long *p) {
+        long v = *p;
+        EZ_COMPILER_BARRIER__();
+        return v;
+    };
+    static inline int load(const VOLATILE_ int *p) {
+        int v = *p;
+        EZ_COMPILER_BARRIER__();
+        return v;
+    };
+    template <typename T>
+    static inline T *load(T * const VOLATILE_ *p) {
+        T *v = *p;
+        EZ_COMPILER_BARRIER__();
+        return v;
+    };
+#  if defined(_M_IX86) || defined(_M_X64)
+    static inline void store(VOLATILE_ long *p, long val) {
+        EZ_COMPILER_BARRIER__();
+        *p = val;
+    };
+    static inline void store(VOLATILE_ int *p, int val) {
+        EZ_COMPILER_BARRIER__();
+        *p = val;
+    };
+    template <typename T>
+    static inline void store(T * VOLATILE_ *p, T *val) {
+        EZ_COMPILER_BARRIER__();
+        *p = val;
+    };
+#  else
+    static inline void store(VOLATILE_ long *p, long val) {
+        InterlockedExchange(p, val);
+    };
+    static inline void store(VOLATILE_ int *p, int val) {
+        InterlockedExchange((VOLATILE_ long *)p, (long)val);
+    };
+    template <typename T>
+    static inline void store(T * VOLATILE_ *p, T *val) {
+        InterlockedExchangePointer((PVOID VOLATILE_ *)p, (PVOID)val);
+    };
+#  endif
+    static inline long load_relaxed(const VOLATILE_ long *p) { return *p; };
+    static inline int  load_relaxed(const VOLATILE_ int *p)  { return *p; };
+    static inline void store_relaxed(VOLATILE_ long *p, long val) { *p = val; };
+    static inline void store_relaxed(VOLATILE_ int *p, int val)   { *p = val; };
+    template <typename T>
+    static inline T *load_relaxed(T * const VOLATILE_ *p) { return *p; };
+    template <typename T>
+    static inline void store_relaxed(T * VOLATILE_ *p, T *val) { *p = val; };
+
+    static inline long cas(VOLATILE_ long *p, long oldval, long newval) {
+        return InterlockedCompareExchange(p, newval, oldval);
+    };
+    template <typename T>
+    static inline T *cas(T * VOLATILE_ *p, T *oldval, T *newval) {
+        return (T *)InterlockedCompareExchangePointer((PVOID VOLATILE_ *)p,
+                                                     (PVOID)newval, (PVOID)oldval);
+    };
+    template <typename T>
+    static inline T *exchange(T * VOLATILE_ *p, T *val) {
+        return (T *)InterlockedExchangePointer((PVOID VOLATILE_ *)p, (PVOID)val);
+    };
+    static inline long exchange(VOLATILE_ long *p, long val) {
+        return InterlockedExchange(p, val);
+    };
+    static inline long fetch_add(VOLATILE_ long *p, long val) {
+        return InterlockedExchangeAdd(p, val);
+    };
+    static inline int cas(VOLATILE_ int *p, int oldval, int newval) {
+        return (int)InterlockedCompareExchange((VOLATILE_ long *)p, (long)newval, (long)oldval);
+    };
+    static inline int exchange(VOLATILE_ int *p, int val) {
+        return (int)InterlockedExchange((VOLATILE_ long *)p, (long)val);
+    };
+    static inline int fetch_add(VOLATILE_ int *p, int val) {
+        return (int)InterlockedExchangeAdd((VOLATILE_ long *)p, (long)val);
+    };
+    static inline void fence(void) {
+        LONG barrier = 0;
+        InterlockedExchange(&barrier, 0L);
+    };
+#  if defined(_M_IX86) || defined(_M_X64)
+    static inline void fence_acquire(void) { EZ_COMPILER_BARRIER__(); };
+#  else
+    static inline void fence_acquire(void) { fence(); };
+#  endif
+#elif defined(__ATOMIC_ACQUIRE)
+    template <typename T>
+    static inline T load(const volatile T *p) {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    };
+    template <typename T>
+    static inline void store(volatile T *p, T val) {
+        __atomic_store_n(p, val, __ATOMIC_RELEASE);
+    };
+    template <typename T>
+    static inline T load_relaxed(const volatile T *p) {
+        return __atomic_load_n(p, __ATOMIC_RELAXED);
+    };
+    template <typename T>
+    static inline void store_relaxed(volatile T *p, T val) {
+        __atomic_store_n(p, val, __ATOMIC_RELAXED);
+    };
+    template <typename T>
+    static inline T cas(volatile T *p, T oldval, T newval) {
+        __atomic_compare_exchange_n(p, &oldval, newval, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return oldval;
+    };
+    template <typename T>
+    static inline T exchange(volatile T *p, T val) {
+        return __atomic_exchange_n(p, val, __ATOMIC_SEQ_CST);
+    };
+    template <typename T>
+    static inline T fetch_add(volatile T *p, T val) {
+        return __atomic_fetch_add(p, val, __ATOMIC_SEQ_CST);
+    };
+    static inline void fence(void) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    };
+    static inline void fence_acquire(void) {
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    };
+#else
+    template <typename T>
+    static inline T load(const volatile T *p) {
+        T v = *p;
+        __sync_synchronize();
+        return v;
+    };
+    template <typename T>
+    static inline void store(volatile T *p, T val) {
+        __sync_synchronize();
+        *p = val;
+    };
+    template <typename T>
+    static inline T load_relaxed(const volatile T *p) { return *p; };
+    template <typename T>
+    static inline void store_relaxed(volatile T *p, T val) { *p = val; };
+    template <typename T>
+    static inline T cas(volatile T *p, T oldval, T newval) {
+        return __sync_val_compare_and_swap(p, oldval, newval);
+    };
+    template <typename T>
+    static inline T exchange(volatile T *p, T val) {
+        T old;
+        do {
+            old = *p;
+        } while (!__sync_bool_compare_and_swap(p, old, val));
+        return old;
+    };
+    template <typename T>
+    static inline T fetch_add(volatile T *p, T val) {
+        return __sync_fetch_and_add(p, val);
+    };
+    static inline void fence(void) {
+        __sync_synchronize();
+    };
+    static inline void fence_acquire(void) {
+        __sync_synchronize();
+    };
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   relax() : a hint to the CPU that the caller is in a spin-wait loop.      */
+/* -------------------------------------------------------------------------- */
+    static inline void relax(void) {
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+        __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__GNUC__) && defined(__aarch64__)
+        __asm__ __volatile__("yield" ::: "memory");
+#elif defined(_MSC_VER) && (_MSC_VER >= 1400)
+        YieldProcessor();
+#endif
+    };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzMutex
+ *****************************************************************************/
+
+/* ----------------------------- mutex mode --------------------------------- */
+
+#define EZMTX_SPIN              0x0   /* test-and-set, Wait() between tries */
+#define EZMTX_ADAPTIVE          0x1   /* spin with backoff, then park       */
+
+#ifndef EZMTX_SPIN_COUNT
+#  define EZMTX_SPIN_COUNT      10    /* spin rounds before parking         */
+#endif
+#ifndef EZMTX_BACKOFF_MAX
+#  define EZMTX_BACKOFF_MAX     64    /* max relax() calls in a spin round  */
+#endif
+#ifndef EZ_SLEEP_SPIN_NS              /* nanosleep_until() spins this long  */
+#  if defined(_WIN32)
+#    define EZ_SLEEP_SPIN_NS    2000000   /* Sleep() is coarse on Windows   */
+#  else
+#    define EZ_SLEEP_SPIN_NS    50000
+#  endif
+#endif
+
+/* --------------------------- instrumentation ------------------------------ */
+/*   Compile every translation unit with -DEZMTX_INSTRUMENT to collect the    */
+/*   contention and hold-time statistics below. Without the macro EzMutex    */
+/*   has no extra member and no extra instruction.                            */
+/* -------------------------------------------------------------------------- */
+#ifdef EZMTX_INSTRUMENT
+#  include <stdio.h>    /* FILE, fprintf() */
+
+struct EzMutexStats {
+    ezint64_t acquisitions;   /* successful lock() / try_lock()              */
+    ezint64_t contended;      /* lock() calls which did not get it at once   */
+    ezint64_t spins;          /* spin rounds of the contended lock() calls   */
+    ezint64_t waits;          /* Wait() or park() calls                      */
+    ezint64_t wait_ns;        /* total time spent in contended lock() calls  */
+    ezint64_t max_wait_ns;
+    ezint64_t hold_ns;        /* total time between acquisition and unlock() */
+    ezint64_t max_hold_ns;
+};
+#endif
+
 
 class EzMutex {
   private:
     EzMutex(const EzMutex& obj);
     EzMutex& operator=(const EzMutex& obj);
 
-    VOLATILE_ long m_token;
+    VOLATILE_ eztoken_t m_token;  /* 0:unlocked, 1:locked, 2:locked and contended */
+    int m_mode;                   /* EZMTX_SPIN or EZMTX_ADAPTIVE                 */
+
+#ifdef EZMTX_INSTRUMENT
+    /* statistics are written only by the thread which holds the mutex */
+    EzMutexStats m_stats;
+    ezint64_t m_since;            /* nanotime() of the last acquisition */
+    const char *m_name;
+    EzMutex *m_prev, *m_next;     /* registry links */
+
+    static inline EzMutex*& registry_head(void) {
+        static EzMutex *head = NULL;
+        return head;
+    }
+    static inline VOLATILE_ eztoken_t* registry_lock(void) {
+        static VOLATILE_ eztoken_t token = 0;
+        return &token;
+    }
+    static inline void registry_acquire(void) {
+        while (EzAtomic::cas(registry_lock(), (eztoken_t)0, (eztoken_t)1) != 0) Wait();
+    }
+    static inline void registry_release(void) {
+        EzAtomic::store(registry_lock(), (eztoken_t)0);
+    }
+
+    void init(int mode, const char *name) {
+        m_token = 0; m_mode = mode; m_name = name;
+        reset_stats();
+        registry_acquire();
+        m_prev = NULL;
+        m_next = registry_head();
+        if (m_next) m_next->m_prev = this;
+        registry_head() = this;
+        registry_release();
+    }
+
+    inline void acquired(void) {
+        m_stats.acquisitions++;
+        m_since = nanotime();
+    }
+
+    inline void released(void) {
+        ezint64_t t = nanotime() - m_since;
+        m_stats.hold_ns += t;
+        if (t > m_stats.max_hold_ns) m_stats.max_hold_ns = t;
+    }
+#else
+    void init(int mode, const char *name) {
+        (void)name;
+        m_token = 0; m_mode = mode;
+    }
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  try_acquire()                                                */
+/*       One attempt to take the mutex, without statistics.                   */
+/* -------------------------------------------------------------------------- */
+#if defined(_WIN32)
+    inline bool try_acquire(void) {
+        if (m_mode == EZMTX_ADAPTIVE) {
+            return (EzAtomic::cas(&m_token, 0L, 1L) == 0);
+        }
+        if (InterlockedExchange(&m_token, 1)) return false;
+        return true;
+    };
+#else
+    inline bool try_acquire(void) {
+        if (__sync_val_compare_and_swap(&m_token, 0, 1)) return false;
+        return true;
+    };
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  lock_slow()                                                  */
+/*       The contended path of lock().                                        */
+/*       EZMTX_SPIN    : calls Wait() between tries.                          */
+/*       EZMTX_ADAPTIVE: spins with exponential backoff for a while, then     */
+/*                       marks the mutex as contended (2) and parks until     */
+/*                       unlock() wakes it up.                                */
+/* -------------------------------------------------------------------------- */
+    void lock_slow(void) {
+#ifdef EZMTX_INSTRUMENT
+        ezint64_t t0 = nanotime(), spins = 0, waits = 0;
+#endif
+        if (m_mode == EZMTX_ADAPTIVE) {
+            int backoff = 1;
+            int k;
+            for (k = 0; k < EZMTX_SPIN_COUNT; k++) {
+                for (int i = 0; i < backoff; i++) EzAtomic::relax();
+                if (EzAtomic::load_relaxed(&m_token) == 0 &&
+                    EzAtomic::cas(&m_token, (eztoken_t)0, (eztoken_t)1) == 0) break;
+                if (backoff < EZMTX_BACKOFF_MAX) backoff <<= 1;
+            }
+#ifdef EZMTX_INSTRUMENT
+            spins = (k < EZMTX_SPIN_COUNT) ? k + 1 : k;
+#endif
+            if (k == EZMTX_SPIN_COUNT) {
+                while (EzAtomic::exchange(&m_token, (eztoken_t)2) != 0) {
+                    park(&m_token, 2);
+#ifdef EZMTX_INSTRUMENT
+                    waits++;
+#endif
+                }
+            }
+        } else {
+            while (!try_acquire()) {
+                Wait();
+#ifdef EZMTX_INSTRUMENT
+                waits++;
+#endif
+            }
+        }
+#ifdef EZMTX_INSTRUMENT
+        acquired();
+        t0 = m_since - t0;
+        m_stats.contended++;
+        m_stats.spins += spins;
+        m_stats.waits += waits;
+        m_stats.wait_ns += t0;
+        if (t0 > m_stats.max_wait_ns) m_stats.max_wait_ns = t0;
+#endif
+    };
 
   public:
-    EzMutex() { m_token = 0; };
+    EzMutex() { init(EZMTX_SPIN, NULL); };
+    explicit EzMutex(int mode) { init(mode, NULL); };
+    EzMutex(int mode, const char *name) { init(mode, name); };
+#ifdef EZMTX_INSTRUMENT
+    ~EzMutex() {
+        registry_acquire();
+        if (m_prev) m_prev->m_next = m_next;
+        else        registry_head() = m_next;
+        if (m_next) m_next->m_prev = m_prev;
+        registry_release();
+    };
+#else
     ~EzMutex() {};
+#endif
 
-#if defined(_WIN32)
     INLINE_ void lock(void) {
-        while (InterlockedExchange(&m_token, 1)) Wait();
+        if (try_acquire()) {
+#ifdef EZMTX_INSTRUMENT
+            acquired();
+#endif
+            return;
+        }
+        lock_slow();
     };
 
     inline bool try_lock(void) {
-        if (InterlockedExchange(&m_token, 1)) return false;
+        if (!try_acquire()) return false;
+#ifdef EZMTX_INSTRUMENT
+        acquired();
+#endif
         return true;
     };
 
+#if defined(_WIN32)
     inline void unlock(void) {
-        InterlockedExchange(&m_token, 0);
+#ifdef EZMTX_INSTRUMENT
+        released();
+#endif
+        if (InterlockedExchange(&m_token, 0) == 2) unpark(&m_token, 1);
     };
 #else
-    inline void lock(void) {
-        while (__sync_val_compare_and_swap(&m_token, 0, 1)) Wait();
+    inline void unlock(void) {
+#ifdef EZMTX_INSTRUMENT
+        released();
+#endif
+        if (m_mode == EZMTX_ADAPTIVE) {
+            if (EzAtomic::exchange(&m_token, 0) == 2) unpark(&m_token, 1);
+            return;
+        }
+        __sync_val_compare_and_swap(&m_token, 1, 0);
     };
+#endif
 
-    inline bool try_lock(void) {
-        if (__sync_val_compare_and_swap(&m_token, 0, 1)) return false;
-        return true;
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_name() / name()                                          */
+/*       A name shown in report(). The string is not copied, so it must      */
+/*       outlive the mutex. Without EZMTX_INSTRUMENT the name is ignored.    */
+/* -------------------------------------------------------------------------- */
+#ifdef EZMTX_INSTRUMENT
+    void set_name(const char *name) { m_name = name; };
+    const char *name(void) const { return m_name ? m_name : ""; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  stats() / reset_stats()                                      */
+/*       The values are exact while the mutex is held by the caller, and     */
+/*       approximate otherwise.                                               */
+/* -------------------------------------------------------------------------- */
+    const EzMutexStats& stats(void) const { return m_stats; };
+
+    void reset_stats(void) {
+        m_stats.acquisitions = m_stats.contended = m_stats.spins = 0;
+        m_stats.waits = m_stats.wait_ns = m_stats.max_wait_ns = 0;
+        m_stats.hold_ns = m_stats.max_hold_ns = 0;
+        m_since = 0;
     };
 
-    inline void unlock(void) {
-        __sync_val_compare_and_swap(&m_token, 1, 0);
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  report() / report_csv()                                      */
+/*       Write the statistics of all the living mutexes to fp, sorted by     */
+/*       the total wait time (most contended first). Mutexes which were      */
+/*       never acquired are left out.                                         */
+/* -------------------------------------------------------------------------- */
+    static void report(FILE *fp) {
+        report_impl(fp, false);
+    };
+
+    static void report_csv(FILE *fp) {
+        report_impl(fp, true);
+    };
+
+  private:
+    static void report_impl(FILE *fp, bool csv) {
+        EzMutex **list, *p;
+        int n = 0, i, j;
+
+        registry_acquire();
+        for (p = registry_head(); p; p = p->m_next) {
+            if (p->m_stats.acquisitions) n++;
+        }
+        list = (n > 0) ? new EzMutex*[n] : NULL;
+        n = 0;
+        for (p = registry_head(); p; p = p->m_next) {
+            if (p->m_stats.acquisitions) list[n++] = p;
+        }
+        for (i = 1; i < n; i++) {   /* insertion sort, descending wait_ns */
+            p = list[i];
+            for (j = i; j > 0 && list[j-1]->m_stats.wait_ns < p->m_stats.wait_ns; j--) {
+                list[j] = list[j-1];
+            }
+            list[j] = p;
+        }
+
+        if (csv) {
+            fprintf(fp, "name,address,acquisitions,contended,spins,waits,"
+                        "wait_ns,max_wait_ns,hold_ns,max_hold_ns\n");
+        } else {
+            fprintf(fp, "%-24s %12s %12s %12s %10s %12s %10s %12s %10s\n",
+                    "mutex", "acquired", "contended", "spins", "waits",
+                    "wait(ms)", "maxw(us)", "hold(ms)", "maxh(us)");
+        }
+        for (i = 0; i < n; i++) {
+            const EzMutexStats& s = list[i]->m_stats;
+            if (csv) {
+                fprintf(fp, "\"%s\",%p,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+                        list[i]->name(), (void *)list[i],
+                        (double)s.acquisitions, (double)s.contended,
+                        (double)s.spins, (double)s.waits,
+                        (double)s.wait_ns, (double)s.max_wait_ns,
+                        (double)s.hold_ns, (double)s.max_hold_ns);
+            } else {
+                char label[32];
+                if (list[i]->m_name) sprintf(label, "%.23s", list[i]->m_name);
+                else                 sprintf(label, "%p", (void *)list[i]);
+                fprintf(fp, "%-24s %12.0f %12.0f %12.0f %10.0f %12.3f %10.1f %12.3f %10.1f\n",
+                        label, (double)s.acquisitions, (double)s.contended,
+                        (double)s.spins, (double)s.waits,
+                        (double)s.wait_ns * 1e-6, (double)s.max_wait_ns * 1e-3,
+                        (double)s.hold_ns * 1e-6, (double)s.max_hold_ns * 1e-3);
+            }
+        }
+        registry_release();
+        delete[] list;
     };
+
+  public:
+#else
+    void set_name(const char *name) { (void)name; };
+    const char *name(void) const { return ""; };
 #endif
 
 #if defined(_WIN32)
@@ -135,322 +682,6903 @@ class EzMutex {
     }
 #endif
 
-};
-
-
-/*****************************************************************************
-      MISC DEFINITION
- *****************************************************************************/
-
 /* -------------------------------------------------------------------------- */
-/*  SELECT THREAD MODEL: Determin Windows Thread Model or POSIX Thread model, */
-/*                        and also define memory barrier method.              */
+/*   FUNCTION :  nanotime()                                                   */
+/*       return value: a monotonic clock in nanoseconds (arbitrary origin)    */
 /* -------------------------------------------------------------------------- */
-#if defined(_WIN32) && !defined(__GNUC__)
-#  ifndef USE_WIN_THREAD
-#     define USE_WIN_THREAD
-#  endif
+#ifdef _WIN32
+    static inline ezint64_t nanotime(void) {
+        LARGE_INTEGER freq, now;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+        return (ezint64_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+               (ezint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+    }
+#else
+    static inline ezint64_t nanotime(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (ezint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
 #endif
 
-#ifdef USE_WIN_THREAD
-#   include <windows.h>
-#   include <process.h>
-#   define EZ_MEM_BARRIER() MemoryBarrier()
-#   define threadhandle_t  HANDLE
-//#   define threadid_t unsigned
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  nanosleep_until() / nanosleep_for()                          */
+/*       Sleep until nanotime() reaches deadline (or for ns nanoseconds).     */
+/*       The OS sleep stops EZ_SLEEP_SPIN_NS early, and the rest is spun,     */
+/*       so the wakeup is late by a few microseconds at most. That costs      */
+/*       CPU time in the spin window.                                         */
+/* -------------------------------------------------------------------------- */
+    static void nanosleep_until(ezint64_t deadline) {
+        ezint64_t rest = deadline - nanotime() - EZ_SLEEP_SPIN_NS;
+        if (rest > 0) {
+#if defined(_WIN32)
+            Sleep((DWORD)(rest / 1000000));
+#elif defined(__linux__)
+            struct timespec ts;
+            ezint64_t t = deadline - EZ_SLEEP_SPIN_NS;
+            ts.tv_sec  = (time_t)(t / 1000000000);
+            ts.tv_nsec = (long)(t % 1000000000);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
 #else
-#   include <pthread.h>
-#   define EZ_MEM_BARRIER() __sync_synchronize()
-#   define threadhandle_t  pthread_t
-//#   define threadid_t pthread_t
+            struct timespec ts;
+            ts.tv_sec  = (time_t)(rest / 1000000000);
+            ts.tv_nsec = (long)(rest % 1000000000);
+            nanosleep(&ts, NULL);
 #endif
+        }
+        while (nanotime() < deadline) EzAtomic::relax();
+    }
 
-#ifdef USE_WIN_THREAD
-#  if !defined(_MSC_VER) && !defined(__GNUC__)
-    // static inline void MemoryBarrier(void) { LONG Barrier; asm { xchg Barrier, eax };}
-    static inline void MemoryBarrier(void)
-    {
-        LONG Barrier;
-        InterlockedExchange(&Barrier, 0L);
+    static void nanosleep_for(ezint64_t ns) {
+        nanosleep_until(nanotime() + ns);
     }
-#  endif
-#endif
 
 /* -------------------------------------------------------------------------- */
-/*  Overriding run()/join() method is prohibited.                             */
-/*  c++11 can avoid overriding them with virtual/final keyword.               */
+/*   FUNCTION :  park() / unpark()                                            */
+/*       park() blocks the caller while *addr == expected, until unpark() is  */
+/*       called on the same address, or until timeout_ns nanoseconds pass.   */
+/*       It may return spuriously, so the caller must re-check the condition */
+/*       in a loop.                                                           */
+/*       Linux uses futex, Windows 8 and later WaitOnAddress(), and other     */
+/*       POSIX systems a hashed table of mutexes and condition variables.     */
+/*       Older Windows falls back to Wait(), so waiters spin there.           */
 /* -------------------------------------------------------------------------- */
+#define EZ_UNPARK_ALL  0x7fffffff   /* count for unpark() to wake all waiters */
 
-#ifndef __cplusplus
-#   define DO_NOT_OVERRIDE__
-#   define OVERRIDE_IS_PROHIBITED__
-#elif __cplusplus >= 201103L                /* c++11 is supported     */
-#   define DO_NOT_OVERRIDE__ virtual
-#   define OVERRIDE_IS_PROHIBITED__ final
-#else                                       /* c++11 is not supported */
-#   define DO_NOT_OVERRIDE__
-#   define OVERRIDE_IS_PROHIBITED__
-#endif
+#if defined(EZ_HAVE_FUTEX)
+    static inline void park(volatile eztoken_t *addr, eztoken_t expected) {
+        syscall(SYS_futex, (eztoken_t *)addr, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+                expected, NULL, NULL, 0);
+    }
 
-/* --------------------------- thread status -------------------------------- */
+    static inline void park(volatile eztoken_t *addr, eztoken_t expected,
+                            ezint64_t timeout_ns) {
+        struct timespec ts;
+        if (timeout_ns <= 0) return;
+        ts.tv_sec  = (time_t)(timeout_ns / 1000000000);
+        ts.tv_nsec = (long)(timeout_ns % 1000000000);
+        syscall(SYS_futex, (eztoken_t *)addr, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+                expected, &ts, NULL, 0);
+    }
 
-#define EZTH_UNEXEC             0x0
-#define EZTH_CREATING           0x1
-#define EZTH_RUNNING            0x2
-#define EZTH_FINISHED           0x4
-#define EZTH_JOINED             0x8
+    static inline void unpark(volatile eztoken_t *addr, int count) {
+        syscall(SYS_futex, (eztoken_t *)addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+                count, NULL, NULL, 0);
+    }
+#elif defined(EZ_HAVE_WAITONADDRESS__)
+    static inline void park(volatile eztoken_t *addr, eztoken_t expected) {
+        WaitOnAddress((volatile VOID *)addr, &expected, sizeof(expected), INFINITE);
+    }
 
-/*****************************************************************************
-      CLASS DEFINITION : EzThreadBase
- *****************************************************************************/
+    static inline void park(volatile eztoken_t *addr, eztoken_t expected,
+                            ezint64_t timeout_ns) {
+        if (timeout_ns <= 0) return;
+        WaitOnAddress((volatile VOID *)addr, &expected, sizeof(expected),
+                      (DWORD)((timeout_ns + 999999) / 1000000));
+    }
 
-class EzThreadBase
-{
-/* --------------- force EzThreadBase to be Noncopyable-class --------------- */
+    static inline void unpark(volatile eztoken_t *addr, int count) {
+        if (count == 1) WakeByAddressSingle((PVOID)addr);
+        else WakeByAddressAll((PVOID)addr);
+    }
+#elif defined(EZ_HAVE_PARK_TABLE__)
   private:
+#define EZ_PARK_BUCKETS__  64
+    struct ParkBucket__ {
+        pthread_mutex_t mtx;
+        pthread_cond_t cond;
+    };
+
+    static ParkBucket__ *park_buckets() {
+        static ParkBucket__ buckets[EZ_PARK_BUCKETS__];
+        return buckets;
+    }
+
+    static void park_init() {
+        ParkBucket__ *b = park_buckets();
+        for (int i = 0; i < EZ_PARK_BUCKETS__; i++) {
+            pthread_mutex_init(&b[i].mtx, NULL);
+            pthread_cond_init(&b[i].cond, NULL);
+        }
+    }
+
+    /* addresses share a bucket, so unpark() wakes the whole bucket */
+    static ParkBucket__ *park_bucket(VOLATILE_ eztoken_t *addr) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, &park_init);
+        return &park_buckets()[((unsigned long)addr / sizeof(eztoken_t)) % EZ_PARK_BUCKETS__];
+    }
+
+  public:
+    static inline void park(VOLATILE_ eztoken_t *addr, eztoken_t expected) {
+        ParkBucket__ *b = park_bucket(addr);
+        pthread_mutex_lock(&b->mtx);
+        if (EzAtomic::load(addr) == expected) pthread_cond_wait(&b->cond, &b->mtx);
+        pthread_mutex_unlock(&b->mtx);
+    }
+
+    static inline void park(VOLATILE_ eztoken_t *addr, eztoken_t expected,
+                            ezint64_t timeout_ns) {
+        ParkBucket__ *b;
+        struct timeval now;
+        struct timespec ts;
+        ezint64_t t;
+        if (timeout_ns <= 0) return;
+        gettimeofday(&now, NULL);
+        t = (ezint64_t)now.tv_sec * 1000000000 + (ezint64_t)now.tv_usec * 1000 + timeout_ns;
+        ts.tv_sec  = (time_t)(t / 1000000000);
+        ts.tv_nsec = (long)(t % 1000000000);
+        b = park_bucket(addr);
+        pthread_mutex_lock(&b->mtx);
+        if (EzAtomic::load(addr) == expected) pthread_cond_timedwait(&b->cond, &b->mtx, &ts);
+        pthread_mutex_unlock(&b->mtx);
+    }
+
+    static inline void unpark(VOLATILE_ eztoken_t *addr, int count) {
+        ParkBucket__ *b = park_bucket(addr);
+        (void)count;
+        pthread_mutex_lock(&b->mtx);
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->mtx);
+    }
+#else
+    static inline void park(VOLATILE_ eztoken_t *addr, eztoken_t expected) {
+        if (*addr == expected) Wait();
+    }
+
+    static inline void park(VOLATILE_ eztoken_t *addr, eztoken_t expected,
+                            ezint64_t timeout_ns) {
+        if (timeout_ns > 0 && *addr == expected) Wait();
+    }
+
+    static inline void unpark(VOLATILE_ eztoken_t *addr, int count) {
+        (void)addr; (void)count;
+    }
+#endif
+
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzTicketMutex
+        A FIFO spin lock. lock() takes a ticket and waits until the ticket
+        is served, so the threads acquire the lock in arrival order.
+        Waiters back off in proportion to their distance from the head of
+        the line, then park. All the waiters share one cache line.
+ *****************************************************************************/
+
+class EzTicketMutex {
+  private:
+    EzTicketMutex(const EzTicketMutex& obj);
+    EzTicketMutex& operator=(const EzTicketMutex& obj);
+
+    typedef unsigned eztoken_t index_t;   /* free-running, wraps around */
+
+    VOLATILE_ eztoken_t m_next;     /* next ticket to hand out        */
+    VOLATILE_ eztoken_t m_serving;  /* ticket which holds the lock    */
+    VOLATILE_ eztoken_t m_parked;   /* waiters parked on m_serving    */
+
+  public:
+    EzTicketMutex() { m_next = m_serving = m_parked = 0; };
+    ~EzTicketMutex() {};
+
+    void lock(void) {
+        eztoken_t t = EzAtomic::fetch_add(&m_next, (eztoken_t)1);
+        eztoken_t s;
+        index_t ahead;                  /* tickets before ours */
+        for (int k = 0; ; k++) {
+            if ((s = EzAtomic::load(&m_serving)) == t) return;
+            ahead = (index_t)t - (index_t)s;
+            if (k < EZMTX_SPIN_COUNT) {
+                int n = (int)ahead * EZMTX_BACKOFF_MAX;
+                for (int i = 0; i < n; i++) EzAtomic::relax();
+                continue;
+            }
+            if (ahead > 1) {            /* not next: give the CPU away */
+                EzMutex::Wait();
+                continue;
+            }
+            EzAtomic::fetch_add(&m_parked, (eztoken_t)1);
+            EzAtomic::fence();          /* pairs with the fence in unlock() */
+            if (EzAtomic::load(&m_serving) == s) EzMutex::park(&m_serving, s);
+            EzAtomic::fetch_add(&m_parked, (eztoken_t)-1);
+        }
+    };
+
+    bool try_lock(void) {
+        eztoken_t s = EzAtomic::load(&m_serving);
+        return (EzAtomic::cas(&m_next, s, (eztoken_t)((index_t)s + 1)) == s);
+    };
+
+    /* parked waiters cannot be woken by ticket, so all of them re-check */
+    void unlock(void) {
+        EzAtomic::fetch_add(&m_serving, (eztoken_t)1);
+        EzAtomic::fence();              /* order m_serving before m_parked */
+        if (EzAtomic::load(&m_parked) != 0) EzMutex::unpark(&m_serving, EZ_UNPARK_ALL);
+    };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzMcsMutex
+        A queue lock (MCS, in the K42 variant which keeps the interface of
+        EzMutex). Each waiter links a node on its own stack to the queue and
+        spins on that node only, so a handover touches one cache line of
+        the next waiter. The lock itself serves as the node of a holder
+        which did not have to wait. Waiters park after spinning for a
+        while, and the lock is granted in FIFO order.
+ *****************************************************************************/
+
+class EzMcsMutex {
+  private:
+    EzMcsMutex(const EzMcsMutex& obj);
+    EzMcsMutex& operator=(const EzMcsMutex& obj);
+
+    struct Node {
+        Node * VOLATILE_ next;
+        VOLATILE_ eztoken_t wait;   /* 1:waiting, 2:parked, 0:granted */
+    };
+
+    Node * VOLATILE_ m_tail;    /* NULL:free, &m_head:held with no queue */
+    Node             m_head;    /* m_head.next : the next waiter          */
+
+    /* waits for a field which another thread is about to set */
+    static void pause(int *k) {
+        if (++*k < 1000) {
+            EzAtomic::relax();
+        } else {
+            *k = 0;
+            EzMutex::Wait();
+        }
+    };
+
+    static void wait_grant(Node *me) {
+        int k;
+        for (k = 0; k < EZMTX_SPIN_COUNT * EZMTX_BACKOFF_MAX; k++) {
+            if (EzAtomic::load(&me->wait) == 0) return;
+            EzAtomic::relax();
+        }
+        if (EzAtomic::cas(&me->wait, (eztoken_t)1, (eztoken_t)2) == 0) return;
+        while (EzAtomic::load(&me->wait) != 0) EzMutex::park(&me->wait, 2);
+    };
+
+  public:
+    EzMcsMutex() { m_tail = NULL; m_head.next = NULL; m_head.wait = 0; };
+    ~EzMcsMutex() {};
+
+    void lock(void) {
+        for (;;) {
+            Node *prev = EzAtomic::load(&m_tail);
+            if (prev == NULL) {
+                if (EzAtomic::cas(&m_tail, (Node *)NULL, &m_head) == NULL) return;
+                continue;
+            }
+            Node me;
+            me.next = NULL;
+            me.wait = 1;
+            if (EzAtomic::cas(&m_tail, prev, &me) != prev) continue;
+            EzAtomic::store(&prev->next, &me);
+            wait_grant(&me);
+
+            /* we hold the lock: move our successor to m_head.next */
+            Node *succ = EzAtomic::load(&me.next);
+            if (succ == NULL) {
+                EzAtomic::store(&m_head.next, (Node *)NULL);
+                if (EzAtomic::cas(&m_tail, &me, &m_head) == &me) return;
+                int k = 0;
+                while ((succ = EzAtomic::load(&me.next)) == NULL) pause(&k);
+            }
+            EzAtomic::store(&m_head.next, succ);
+            return;
+        }
+    };
+
+    bool try_lock(void) {
+        return (EzAtomic::cas(&m_tail, (Node *)NULL, &m_head) == NULL);
+    };
+
+    void unlock(void) {
+        Node *succ = EzAtomic::load(&m_head.next);
+        if (succ == NULL) {
+            if (EzAtomic::cas(&m_tail, &m_head, (Node *)NULL) == &m_head) return;
+            int k = 0;
+            while ((succ = EzAtomic::load(&m_head.next)) == NULL) pause(&k);
+        }
+        if (EzAtomic::exchange(&succ->wait, (eztoken_t)0) == 2) EzMutex::unpark(&succ->wait, 1);
+    };
+};
+
+
+/*****************************************************************************
+      MISC DEFINITION
+ *****************************************************************************/
+
+/* -------------------------------------------------------------------------- */
+/*  SELECT THREAD MODEL: Determin Windows Thread Model or POSIX Thread model, */
+/*                        and also define memory barrier method.              */
+/* -------------------------------------------------------------------------- */
+#if defined(_WIN32) && !defined(__GNUC__)
+#  ifndef USE_WIN_THREAD
+#     define USE_WIN_THREAD
+#  endif
+#endif
+
+#ifdef USE_WIN_THREAD
+#   include <windows.h>
+#   include <process.h>
+#   define EZ_MEM_BARRIER() MemoryBarrier()
+#   define threadhandle_t  HANDLE
+//#   define threadid_t unsigned
+#else
+#   include <pthread.h>
+#   include <unistd.h>    /* sysconf() */
+#   define EZ_MEM_BARRIER() __sync_synchronize()
+#   define threadhandle_t  pthread_t
+//#   define threadid_t pthread_t
+#endif
+
+#ifdef USE_WIN_THREAD
+#  if !defined(_MSC_VER) && !defined(__GNUC__)
+    // static inline void MemoryBarrier(void) { LONG Barrier; asm { xchg Barrier, eax };}
+    static inline void MemoryBarrier(void)
+    {
+        LONG Barrier;
+        InterlockedExchange(&Barrier, 0L);
+    }
+#  endif
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*  Overriding run()/join() method is prohibited.                             */
+/*  c++11 can avoid overriding them with virtual/final keyword.               */
+/* -------------------------------------------------------------------------- */
+
+#ifndef __cplusplus
+#   define DO_NOT_OVERRIDE__
+#   define OVERRIDE_IS_PROHIBITED__
+#elif __cplusplus >= 201103L                /* c++11 is supported     */
+#   define DO_NOT_OVERRIDE__ virtual
+#   define OVERRIDE_IS_PROHIBITED__ final
+#else                                       /* c++11 is not supported */
+#   define DO_NOT_OVERRIDE__
+#   define OVERRIDE_IS_PROHIBITED__
+#endif
+
+/*****************************************************************************
+      CLASS DEFINITION : EzRWMutex
+        A reader-writer lock with writer preference: once a writer asks for
+        the lock, new readers wait until every pending writer has finished.
+        Writers are serialized by an adaptive EzMutex, and readers wait with
+        the same spin-then-park scheme.
+        In EZRW_DISTRIBUTED mode the reader count is split into EZRW_STRIPES
+        counters on separate cache lines, selected by a hash of the thread
+        id, so readers on different cores do not share a line. A writer has
+        to scan all the stripes instead. A read lock must be released by
+        the thread which acquired it.
+ *****************************************************************************/
+
+/* ----------------------------- rwlock mode -------------------------------- */
+
+#define EZRW_CENTRAL            0x0   /* one reader counter                  */
+#define EZRW_DISTRIBUTED        0x1   /* striped reader counters             */
+
+#ifndef EZRW_STRIPES
+#  define EZRW_STRIPES          16    /* reader counters in distributed mode */
+#endif
+
+
+class EzRWMutex {
+  private:
+    EzRWMutex(const EzRWMutex& obj);
+    EzRWMutex& operator=(const EzRWMutex& obj);
+
+    struct Counter {
+        VOLATILE_ eztoken_t n;
+        char pad[EZ_CACHE_LINE - sizeof(eztoken_t)];
+    };
+
+    char      m_pad0[EZ_CACHE_LINE];
+    Counter   m_central;            /* reader count in EZRW_CENTRAL mode      */
+    Counter  *m_readers;            /* &m_central, or EZRW_STRIPES counters   */
+    int       m_nstripes;
+    VOLATILE_ eztoken_t m_writers;  /* writers holding or waiting for the lock */
+    VOLATILE_ eztoken_t m_rwaiters; /* readers parked on m_writers            */
+    VOLATILE_ eztoken_t m_drain;    /* bumped when a reader leaves for a writer */
+    EzMutex   mtx_writer;           /* serializes the writers                 */
+    char      m_pad1[EZ_CACHE_LINE];
+
+    static unsigned long thread_hash() {
+#ifdef _WIN32
+        unsigned long h = (unsigned long)GetCurrentThreadId();
+#else
+        unsigned long h = (unsigned long)pthread_self();
+#endif
+        h ^= h >> 16;
+        h *= 0x45d9f3bUL;
+        h ^= h >> 16;
+        return h;
+    };
+
+    VOLATILE_ eztoken_t *reader_slot() {
+        if (m_nstripes == 1) return &m_readers[0].n;
+        return &m_readers[thread_hash() % (unsigned long)m_nstripes].n;
+    };
+
+    bool readers_gone() {
+        for (int i = 0; i < m_nstripes; i++) {
+            if (EzAtomic::load(&m_readers[i].n) != 0) return false;
+        }
+        return true;
+    };
+
+    /* leave the reader count, waking a writer waiting for the readers */
+    void reader_leave(VOLATILE_ eztoken_t *slot) {
+        EzAtomic::fetch_add(slot, (eztoken_t)-1);
+        EzAtomic::fence();          /* order the slot before m_writers */
+        if (EzAtomic::load(&m_writers) != 0) {
+            EzAtomic::fetch_add(&m_drain, (eztoken_t)1);
+            EzMutex::unpark(&m_drain, 1);
+        }
+    };
+
+  public:
+    explicit EzRWMutex(int mode = EZRW_CENTRAL) : mtx_writer(EZMTX_ADAPTIVE, "EzRWMutex.writer") {
+        m_central.n = 0;
+        m_readers = &m_central;
+        m_nstripes = 1;
+        if (mode == EZRW_DISTRIBUTED) {
+            m_readers = new Counter[EZRW_STRIPES];
+            m_nstripes = EZRW_STRIPES;
+            for (int i = 0; i < m_nstripes; i++) m_readers[i].n = 0;
+        }
+        m_writers = m_rwaiters = m_drain = 0;
+    };
+    ~EzRWMutex() {
+        if (m_readers != &m_central) delete [] m_readers;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  lock_shared() / unlock_shared()                              */
+/*       Acquires/releases the lock for reading. Readers wait while a writer  */
+/*       holds or waits for the lock.                                         */
+/* -------------------------------------------------------------------------- */
+    void lock_shared(void) {
+        VOLATILE_ eztoken_t *slot = reader_slot();
+        int backoff = 1, k = 0;
+        eztoken_t w;
+
+        for (;;) {
+            if (EzAtomic::load(&m_writers) == 0) {
+                EzAtomic::fetch_add(slot, (eztoken_t)1);
+                EzAtomic::fence();  /* pairs with the fence in lock() */
+                if (EzAtomic::load(&m_writers) == 0) return;
+                reader_leave(slot);        /* a writer came in: back off */
+            }
+            if (k < EZMTX_SPIN_COUNT) {
+                for (int i = 0; i < backoff; i++) EzAtomic::relax();
+                if (backoff < EZMTX_BACKOFF_MAX) backoff <<= 1;
+                k++;
+                continue;
+            }
+            EzAtomic::fetch_add(&m_rwaiters, (eztoken_t)1);
+            EzAtomic::fence();      /* pairs with the fence in unlock() */
+            if ((w = EzAtomic::load(&m_writers)) != 0) EzMutex::park(&m_writers, w);
+            EzAtomic::fetch_add(&m_rwaiters, (eztoken_t)-1);
+        }
+    };
+
+    void unlock_shared(void) {
+        reader_leave(reader_slot());
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  lock() / unlock()                                            */
+/*       Acquires/releases the lock for writing.                              */
+/* -------------------------------------------------------------------------- */
+    void lock(void) {
+        int backoff = 1;
+        eztoken_t d;
+
+        EzAtomic::fetch_add(&m_writers, (eztoken_t)1);   /* stops new readers */
+        EzAtomic::fence();          /* order m_writers before the slots */
+        mtx_writer.lock();
+        for (int k = 0; k < EZMTX_SPIN_COUNT; k++) {
+            if (readers_gone()) return;
+            for (int i = 0; i < backoff; i++) EzAtomic::relax();
+            if (backoff < EZMTX_BACKOFF_MAX) backoff <<= 1;
+        }
+        for (;;) {
+            d = EzAtomic::load(&m_drain);
+            if (readers_gone()) return;
+            EzMutex::park(&m_drain, d);
+        }
+    };
+
+    void unlock(void) {
+        mtx_writer.unlock();
+        if (EzAtomic::fetch_add(&m_writers, (eztoken_t)-1) == 1) {
+            EzAtomic::fence();      /* order m_writers before m_rwaiters */
+            if (EzAtomic::load(&m_rwaiters) != 0) {
+                EzMutex::unpark(&m_writers, EZ_UNPARK_ALL);
+            }
+        }
+    };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzCondVar
+        A condition variable used with an EzMutex. A waiter parks on a
+        sequence number which every notify bumps, so a notify issued after
+        the waiter released the mutex is never lost.
+        Like any condition variable, wait() may return spuriously: check
+        the condition in a loop.
+ *****************************************************************************/
+
+class EzCondVar {
+  private:
+    EzCondVar(const EzCondVar& obj);
+    EzCondVar& operator=(const EzCondVar& obj);
+
+    VOLATILE_ eztoken_t m_seq;      /* bumped by notify_one() / notify_all() */
+    VOLATILE_ eztoken_t m_waiters;  /* threads in wait()                     */
+
+    void notify(int count) {
+        EzAtomic::fetch_add(&m_seq, (eztoken_t)1);
+        EzAtomic::fence();          /* order m_seq before m_waiters */
+        if (EzAtomic::load(&m_waiters) != 0) EzMutex::unpark(&m_seq, count);
+    };
+
+  public:
+    EzCondVar() { m_seq = m_waiters = 0; };
+    ~EzCondVar() {};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  wait() / wait_for()                                          */
+/*       Releases mtx (which must be locked by the caller), blocks until a    */
+/*       notification, and locks mtx again before returning.                 */
+/*       wait_for() gives up after timeout_ms milliseconds.                   */
+/*       wait_for() return value :  0:notified (or spurious)  -1:timeout      */
+/* -------------------------------------------------------------------------- */
+    void wait(EzMutex& mtx) {
+        eztoken_t seq = EzAtomic::load(&m_seq);
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+        mtx.unlock();
+        EzMutex::park(&m_seq, seq);
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        mtx.lock();
+    };
+
+    int wait_for(EzMutex& mtx, long timeout_ms) {
+        ezint64_t deadline = EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000;
+        eztoken_t seq = EzAtomic::load(&m_seq);
+        int ret = 0;
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+        mtx.unlock();
+        EzMutex::park(&m_seq, seq, deadline - EzMutex::nanotime());
+        if (EzAtomic::load(&m_seq) == seq && EzMutex::nanotime() >= deadline) ret = -1;
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        mtx.lock();
+        return ret;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  notify_one() / notify_all()                                  */
+/*       Wakes one / all of the waiting threads. The caller may or may not   */
+/*       hold the mutex.                                                      */
+/* -------------------------------------------------------------------------- */
+    void notify_one(void) { notify(1); };
+    void notify_all(void) { notify(EZ_UNPARK_ALL); };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzEvent
+        A flag which threads can wait for.
+          EZEVT_MANUAL : set() releases every waiter, and the event stays
+                         set until reset().
+          EZEVT_AUTO   : set() releases one waiter, which resets the event.
+ *****************************************************************************/
+
+/* ----------------------------- event mode --------------------------------- */
+
+#define EZEVT_MANUAL            0x0   /* stays set until reset()     */
+#define EZEVT_AUTO              0x1   /* one waiter consumes set()   */
+
+class EzEvent {
+  private:
+    EzEvent(const EzEvent& obj);
+    EzEvent& operator=(const EzEvent& obj);
+
+    VOLATILE_ eztoken_t m_state;    /* 0:not set, 1:set              */
+    VOLATILE_ eztoken_t m_waiters;  /* threads in wait()/wait_for()  */
+    int m_mode;                     /* EZEVT_MANUAL or EZEVT_AUTO    */
+
+    /* consumes the event in EZEVT_AUTO mode */
+    bool try_take(void) {
+        if (m_mode == EZEVT_AUTO) {
+            return (EzAtomic::cas(&m_state, (eztoken_t)1, (eztoken_t)0) == 1);
+        }
+        return (EzAtomic::load(&m_state) == 1);
+    };
+
+  public:
+    explicit EzEvent(int mode = EZEVT_MANUAL, bool initial = false) {
+        m_state = initial ? 1 : 0;
+        m_waiters = 0;
+        m_mode = mode;
+    };
+    ~EzEvent() {};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set() / reset() / is_set()                                   */
+/* -------------------------------------------------------------------------- */
+    void set(void) {
+        EzAtomic::exchange(&m_state, (eztoken_t)1);
+        EzAtomic::fence();          /* order m_state before m_waiters */
+        if (EzAtomic::load(&m_waiters) != 0) {
+            EzMutex::unpark(&m_state, (m_mode == EZEVT_AUTO) ? 1 : EZ_UNPARK_ALL);
+        }
+    };
+
+    void reset(void) { EzAtomic::store(&m_state, (eztoken_t)0); };
+
+    bool is_set(void) { return (EzAtomic::load(&m_state) == 1); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  wait() / wait_for()                                          */
+/*       Blocks until the event is set. wait_for() gives up after             */
+/*       timeout_ms milliseconds.                                             */
+/*       wait_for() return value :  0:success  -1:timeout                     */
+/* -------------------------------------------------------------------------- */
+    void wait(void) {
+        while (!try_take()) {
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            EzMutex::park(&m_state, 0);
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+    };
+
+    int wait_for(long timeout_ms) {
+        ezint64_t deadline = EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000;
+        ezint64_t rest;
+        while (!try_take()) {
+            rest = deadline - EzMutex::nanotime();
+            if (rest <= 0) return -1;
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            EzMutex::park(&m_state, 0, rest);
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+        return 0;
+    };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzBarrier
+        A reusable barrier for a fixed number of threads. Each phase ends
+        when all the threads have called arrive_and_wait(). The last one
+        runs the optional completion function before the others are
+        released. Phases are told apart by a generation counter (sense
+        reversal), so the barrier is reused without a reset.
+        arrive_and_wait() counts the arrivals on one shared word.
+        arrive_and_wait(id) combines them in a tree with EZBAR_FANIN
+        arrivals per node on separate cache lines, which scales better
+        with many threads; each thread passes a distinct id (0..count-1).
+        The waiters spin for a while, then park on the generation.
+ *****************************************************************************/
+
+#ifndef EZBAR_FANIN
+#  define EZBAR_FANIN           4     /* arrivals per node of the tree     */
+#endif
+#ifndef EZBAR_SPIN_COUNT
+#  define EZBAR_SPIN_COUNT      200   /* relax() calls before parking      */
+#endif
+
+class EzBarrier {
+  private:
+    EzBarrier(const EzBarrier& obj);
+    EzBarrier& operator=(const EzBarrier& obj);
+
+    struct Node {
+        VOLATILE_ eztoken_t arrived;
+        int expected;
+        int parent;                   /* -1 : root */
+        char pad[EZ_CACHE_LINE - sizeof(eztoken_t) - 2 * sizeof(int)];
+    };
+
+    char      m_pad0[EZ_CACHE_LINE];
+    VOLATILE_ eztoken_t m_gen;        /* bumped when a phase completes  */
+    VOLATILE_ eztoken_t m_waiters;    /* threads parked on m_gen        */
+    char      m_pad1[EZ_CACHE_LINE];
+    VOLATILE_ eztoken_t m_arrived;    /* arrivals of arrive_and_wait()  */
+    char      m_pad2[EZ_CACHE_LINE];
+    int       m_count;
+    Node     *m_nodes;                /* leaves first, root last        */
+    int       m_nnodes;
+    void    (*m_func)(void *);
+    void     *m_arg;
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  build_tree()                                                 */
+/*       Leaf i takes the ids i*EZBAR_FANIN .. i*EZBAR_FANIN+EZBAR_FANIN-1.   */
+/* -------------------------------------------------------------------------- */
+    void build_tree(void) {
+        int level, width, n, i;
+        n = 0;
+        for (width = m_count; ; width = (width + EZBAR_FANIN - 1) / EZBAR_FANIN) {
+            n += (width + EZBAR_FANIN - 1) / EZBAR_FANIN;
+            if (width <= EZBAR_FANIN) break;
+        }
+        m_nodes = new Node[n];
+        m_nnodes = n;
+        level = 0;   /* first node of the current level */
+        for (width = m_count; ; ) {
+            int nodes = (width + EZBAR_FANIN - 1) / EZBAR_FANIN;
+            for (i = 0; i < nodes; i++) {
+                Node& nd = m_nodes[level + i];
+                nd.arrived = 0;
+                nd.expected = (i < nodes - 1) ? EZBAR_FANIN : width - i * EZBAR_FANIN;
+                nd.parent = (nodes == 1) ? -1 : level + nodes + i / EZBAR_FANIN;
+            }
+            if (nodes == 1) break;
+            level += nodes;
+            width = nodes;
+        }
+    };
+
+    /* the last arriver: run the completion function and open the barrier */
+    void complete(void) {
+        if (m_func) m_func(m_arg);
+        EzAtomic::fetch_add(&m_gen, (eztoken_t)1);
+        EzAtomic::fence();          /* order m_gen before m_waiters */
+        if (EzAtomic::load_relaxed(&m_waiters)) {
+            EzMutex::unpark(&m_gen, EZ_UNPARK_ALL);
+        }
+    };
+
+    void wait_gen(eztoken_t gen) {
+        for (int k = 0; k < EZBAR_SPIN_COUNT; k++) {
+            if (EzAtomic::load(&m_gen) != gen) return;
+            EzAtomic::relax();
+        }
+        while (EzAtomic::load(&m_gen) == gen) {
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            EzMutex::park(&m_gen, gen);
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+    };
+
+  public:
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR                                                              */
+/*       count      : the number of threads in each phase (>= 1)              */
+/*       completion : called as completion(arg) by the last arriver of each   */
+/*                    phase, before the others are released                  */
+/* -------------------------------------------------------------------------- */
+    explicit EzBarrier(int count, void (*completion)(void *) = NULL, void *arg = NULL) {
+        m_count = (count > 0) ? count : 1;
+        m_gen = m_waiters = m_arrived = 0;
+        m_func = completion;
+        m_arg = arg;
+        m_nodes = NULL;
+        m_nnodes = 0;
+        build_tree();
+    };
+    ~EzBarrier() { delete [] m_nodes; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  arrive_and_wait() / arrive_and_wait(id)                      */
+/*       Blocks until count threads have arrived in this phase.               */
+/*       Do not mix the two forms within a phase.                             */
+/*       return value :  1:the caller completed the phase  0:otherwise        */
+/*                       -1:id out of range                                   */
+/* -------------------------------------------------------------------------- */
+    int arrive_and_wait(void) {
+        eztoken_t gen = EzAtomic::load(&m_gen);
+        if (EzAtomic::fetch_add(&m_arrived, (eztoken_t)1) == m_count - 1) {
+            EzAtomic::store_relaxed(&m_arrived, (eztoken_t)0);
+            complete();
+            return 1;
+        }
+        wait_gen(gen);
+        return 0;
+    };
+
+    int arrive_and_wait(int id) {
+        eztoken_t gen;
+        int i;
+        if (id < 0 || id >= m_count) return -1;
+        gen = EzAtomic::load(&m_gen);
+        for (i = id / EZBAR_FANIN; ; i = m_nodes[i].parent) {
+            Node& nd = m_nodes[i];
+            if (EzAtomic::fetch_add(&nd.arrived, (eztoken_t)1) != nd.expected - 1) break;
+            EzAtomic::store_relaxed(&nd.arrived, (eztoken_t)0);
+            if (nd.parent < 0) {
+                complete();
+                return 1;
+            }
+        }
+        wait_gen(gen);
+        return 0;
+    };
+
+    int count(void) const { return m_count; };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzLatch
+        A one-shot countdown. count_down() decrements the counter, and
+        wait() blocks until it reaches zero. It cannot be reset.
+ *****************************************************************************/
+
+class EzLatch {
+  private:
+    EzLatch(const EzLatch& obj);
+    EzLatch& operator=(const EzLatch& obj);
+
+    VOLATILE_ eztoken_t m_count;
+    VOLATILE_ eztoken_t m_waiters;
+
+  public:
+    explicit EzLatch(int count) {
+        m_count = (count > 0) ? count : 0;
+        m_waiters = 0;
+    };
+    ~EzLatch() {};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  count_down()                                                 */
+/*       Decrements the counter by n (not below zero). The call which         */
+/*       reaches zero wakes the waiters.                                      */
+/* -------------------------------------------------------------------------- */
+    void count_down(int n = 1) {
+        eztoken_t c, prev;
+        if (n <= 0) return;
+        c = EzAtomic::load(&m_count);
+        while (c > 0) {
+            eztoken_t next = (c > (eztoken_t)n) ? c - (eztoken_t)n : 0;
+            prev = EzAtomic::cas(&m_count, c, next);
+            if (prev == c) {
+                if (next == 0) {
+                    EzAtomic::fence();  /* order m_count before m_waiters */
+                    if (EzAtomic::load(&m_waiters)) {
+                        EzMutex::unpark(&m_count, EZ_UNPARK_ALL);
+                    }
+                }
+                return;
+            }
+            c = prev;
+        }
+    };
+
+    bool try_wait(void) { return (EzAtomic::load(&m_count) == 0); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  wait() / wait_for() / arrive_and_wait()                      */
+/*       Blocks until the counter reaches zero. wait_for() gives up after     */
+/*       timeout_ms milliseconds. arrive_and_wait() is count_down() + wait(). */
+/*       wait_for() return value :  0:success  -1:timeout                     */
+/* -------------------------------------------------------------------------- */
+    void wait(void) {
+        eztoken_t c;
+        while ((c = EzAtomic::load(&m_count)) != 0) {
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            EzMutex::park(&m_count, c);
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+    };
+
+    int wait_for(long timeout_ms) {
+        ezint64_t deadline = EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000;
+        ezint64_t rest;
+        eztoken_t c;
+        while ((c = EzAtomic::load(&m_count)) != 0) {
+            rest = deadline - EzMutex::nanotime();
+            if (rest <= 0) return -1;
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            EzMutex::park(&m_count, c, rest);
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+        return 0;
+    };
+
+    void arrive_and_wait(int n = 1) {
+        count_down(n);
+        wait();
+    };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzArena
+        A bump allocator for scratch memory owned by one thread.
+        alloc() moves a pointer inside the current chunk; there is no lock
+        and no atomic operation, and no per-object free. Memory is given
+        back all at once by reset(), or back to a mark() by rewind(). The
+        chunks are kept for reuse, so a warmed-up arena does not call the
+        global allocator. Every EzThreadBase thread can have one (see
+        EzThreadBase::arena()).
+ *****************************************************************************/
+
+#include <stddef.h>       /* size_t, ptrdiff_t */
+#include <new>            /* placement new, std::bad_alloc */
+
+#ifndef EZARENA_CHUNK
+#  define EZARENA_CHUNK         (64 * 1024)  /* default chunk size in bytes  */
+#endif
+#ifndef EZARENA_ALIGN
+#  define EZARENA_ALIGN         16           /* default alignment of alloc() */
+#endif
+
+class EzArena {
+  private:
+    EzArena(const EzArena& obj);
+    EzArena& operator=(const EzArena& obj);
+
+    struct Chunk {
+        Chunk *next;
+        size_t size;          /* bytes after the header */
+        char   pad[EZARENA_ALIGN];
+        char  *data() { return (char *)(this + 1); };
+    };
+
+    Chunk  *m_chunks;         /* in use, the current one first   */
+    Chunk  *m_free;           /* kept by reset() / rewind()      */
+    char   *m_ptr;            /* bump pointer in m_chunks        */
+    char   *m_end;
+    size_t  m_chunk_size;
+
+    static char *align_up(char *p, size_t align) {
+        return (char *)(((size_t)p + align - 1) & ~(align - 1));
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  alloc_slow()                                                 */
+/*       Starts a new chunk: a kept one which is large enough, or a new one.  */
+/* -------------------------------------------------------------------------- */
+    void *alloc_slow(size_t size, size_t align) {
+        size_t need = size + align;
+        Chunk *c, **pc;
+        for (pc = &m_free; (c = *pc) != NULL; pc = &c->next) {
+            if (c->size >= need) {
+                *pc = c->next;
+                break;
+            }
+        }
+        if (c == NULL) {
+            size_t n = (need > m_chunk_size) ? need : m_chunk_size;
+            c = (Chunk *)new char[sizeof(Chunk) + n];
+            if (c == NULL) return NULL;
+            c->size = n;
+        }
+        c->next = m_chunks;
+        m_chunks = c;
+        m_ptr = align_up(c->data(), align);
+        m_end = c->data() + c->size;
+        m_ptr += size;
+        return m_ptr - size;
+    };
+
+    static void free_list(Chunk *c) {
+        while (c) {
+            Chunk *next = c->next;
+            delete [] (char *)c;
+            c = next;
+        }
+    };
+
+  public:
+    struct Mark {
+        Chunk *chunk;
+        char  *ptr;
+    };
+
+    explicit EzArena(size_t chunk_size = EZARENA_CHUNK) {
+        m_chunks = m_free = NULL;
+        m_ptr = m_end = NULL;
+        m_chunk_size = (chunk_size > 0) ? chunk_size : EZARENA_CHUNK;
+    };
+    ~EzArena() {
+        free_list(m_chunks);
+        free_list(m_free);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  alloc()                                                      */
+/*       Returns size bytes aligned to align (a power of 2).                  */
+/*       Return value :  the memory,  NULL:allocation failure                 */
+/* -------------------------------------------------------------------------- */
+    inline void *alloc(size_t size, size_t align = EZARENA_ALIGN) {
+        char *p = align_up(m_ptr, align);
+        if (p != NULL && size <= (size_t)(m_end - p)) {
+            m_ptr = p + size;
+            return p;
+        }
+        return alloc_slow(size, align);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  mark() / rewind() / reset()                                  */
+/*       rewind() frees everything allocated after mark(). reset() frees     */
+/*       everything. The chunks are kept for the following allocations.     */
+/* -------------------------------------------------------------------------- */
+    Mark mark(void) const {
+        Mark m;
+        m.chunk = m_chunks;
+        m.ptr = m_ptr;
+        return m;
+    };
+
+    void rewind(const Mark& m) {
+        while (m_chunks != m.chunk) {
+            Chunk *c = m_chunks;
+            m_chunks = c->next;
+            c->next = m_free;
+            m_free = c;
+        }
+        m_ptr = m.ptr;
+        m_end = m_chunks ? m_chunks->data() + m_chunks->size : NULL;
+    };
+
+    void reset(void) {
+        Mark m;
+        m.chunk = NULL;
+        m.ptr = NULL;
+        rewind(m);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  trim() / capacity()                                          */
+/*       trim() gives the kept chunks back to the global allocator.           */
+/*       capacity() is the size of all the chunks in bytes.                   */
+/* -------------------------------------------------------------------------- */
+    void trim(void) {
+        free_list(m_free);
+        m_free = NULL;
+    };
+
+    size_t capacity(void) const {
+        size_t n = 0;
+        for (Chunk *c = m_chunks; c; c = c->next) n += c->size;
+        for (Chunk *c = m_free; c; c = c->next) n += c->size;
+        return n;
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   EzArenaScope : rewinds an arena to where it was at construction.         */
+/* -------------------------------------------------------------------------- */
+class EzArenaScope {
+  private:
+    EzArenaScope(const EzArenaScope& obj);
+    EzArenaScope& operator=(const EzArenaScope& obj);
+
+    EzArena& m_arena;
+    EzArena::Mark m_mark;
+
+  public:
+    explicit EzArenaScope(EzArena& arena) : m_arena(arena), m_mark(arena.mark()) {};
+    ~EzArenaScope() { m_arena.rewind(m_mark); };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   EzArenaAllocator<T> : an STL allocator on an EzArena.                    */
+/*       deallocate() does nothing; the memory comes back with reset().      */
+/*       A container using it must not outlive the arena, nor be used by     */
+/*       another thread than the arena's owner.                              */
+/* -------------------------------------------------------------------------- */
+template <typename T>
+class EzArenaAllocator {
+  public:
+    typedef T         value_type;
+    typedef T        *pointer;
+    typedef const T  *const_pointer;
+    typedef T        &reference;
+    typedef const T  &const_reference;
+    typedef size_t    size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <typename U> struct rebind { typedef EzArenaAllocator<U> other; };
+
+    EzArena *m_arena;
+
+    explicit EzArenaAllocator(EzArena& arena) : m_arena(&arena) {};
+    template <typename U>
+    EzArenaAllocator(const EzArenaAllocator<U>& src) : m_arena(src.m_arena) {};
+
+    pointer address(reference x) const { return &x; };
+    const_pointer address(const_reference x) const { return &x; };
+
+    pointer allocate(size_type n, const void * = 0) {
+        void *p = m_arena->alloc(n * sizeof(T),
+                                 (sizeof(T) < EZARENA_ALIGN) ? sizeof(void *) : EZARENA_ALIGN);
+        if (p == NULL) throw std::bad_alloc();
+        return static_cast<pointer>(p);
+    };
+    void deallocate(pointer, size_type) {};
+
+    size_type max_size() const { return ((size_type)-1) / sizeof(T); };
+
+    void construct(pointer p, const T& v) { new ((void *)p) T(v); };
+    void destroy(pointer p) { p->~T(); };
+};
+
+template <typename T, typename U>
+inline bool operator==(const EzArenaAllocator<T>& a, const EzArenaAllocator<U>& b) {
+    return a.m_arena == b.m_arena;
+}
+template <typename T, typename U>
+inline bool operator!=(const EzArenaAllocator<T>& a, const EzArenaAllocator<U>& b) {
+    return a.m_arena != b.m_arena;
+}
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzFixedPool
+        A pool of fixed-size blocks owned by one thread. The owner allocates
+        and frees through a private free list, and carves new blocks out of
+        slabs, with no atomic operation. Blocks freed by other threads are
+        pushed onto a lock-free list with a CAS, and the owner takes that
+        whole list with one exchange when its private list runs out.
+        The owner is the constructing thread (see set_owner()).
+ *****************************************************************************/
+
+#ifndef EZPOOL_SLAB
+#  define EZPOOL_SLAB           256   /* blocks per slab                     */
+#endif
+
+class EzFixedPool {
+  private:
+    EzFixedPool(const EzFixedPool& obj);
+    EzFixedPool& operator=(const EzFixedPool& obj);
+
+    struct Block { Block *next; };
+    struct Slab {             /* allocated EZARENA_ALIGN bytes larger */
+        Slab *next;
+        char *data() {        /* the first block, aligned to EZARENA_ALIGN */
+            size_t p = (size_t)(this + 1);
+            return (char *)((p + EZARENA_ALIGN - 1) & ~(size_t)(EZARENA_ALIGN - 1));
+        };
+    };
+
+    Block  *m_local;          /* owner's free list               */
+    char   *m_ptr;            /* unused part of the newest slab  */
+    char   *m_end;
+    Slab   *m_slabs;
+    size_t  m_size;           /* block size                      */
+    int     m_per_slab;
+    unsigned long m_owner;
+    char    m_pad0[EZ_CACHE_LINE];
+    Block * VOLATILE_ m_remote;   /* freed by other threads      */
+    char    m_pad1[EZ_CACHE_LINE];
+
+    static unsigned long self_id() {
+#ifdef _WIN32
+        return (unsigned long)GetCurrentThreadId();
+#else
+        return (unsigned long)pthread_self();
+#endif
+    };
+
+    void *alloc_slow(void) {
+        Block *b = EzAtomic::exchange(&m_remote, (Block *)NULL);
+        if (b != NULL) {
+            m_local = b->next;
+            return b;
+        }
+        Slab *s = (Slab *)new char[sizeof(Slab) + EZARENA_ALIGN + m_size * m_per_slab];
+        if (s == NULL) return NULL;
+        s->next = m_slabs;
+        m_slabs = s;
+        m_ptr = s->data() + m_size;
+        m_end = s->data() + m_size * m_per_slab;
+        return s->data();
+    };
+
+  public:
+    explicit EzFixedPool(size_t size, int per_slab = EZPOOL_SLAB) {
+        if (size < sizeof(Block)) size = sizeof(Block);
+        m_size = (size + EZARENA_ALIGN - 1) & ~(size_t)(EZARENA_ALIGN - 1);
+        m_per_slab = (per_slab > 0) ? per_slab : EZPOOL_SLAB;
+        m_local = NULL;
+        m_remote = NULL;
+        m_ptr = m_end = NULL;
+        m_slabs = NULL;
+        m_owner = self_id();
+    };
+    ~EzFixedPool() {
+        while (m_slabs) {
+            Slab *next = m_slabs->next;
+            delete [] (char *)m_slabs;
+            m_slabs = next;
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  alloc()                                                      */
+/*       Called by the owner only.                                            */
+/*       Return value :  a block,  NULL:allocation failure                    */
+/* -------------------------------------------------------------------------- */
+    inline void *alloc(void) {
+        Block *b = m_local;
+        if (b != NULL) {
+            m_local = b->next;
+            return b;
+        }
+        if (m_ptr < m_end) {
+            m_ptr += m_size;
+            return m_ptr - m_size;
+        }
+        return alloc_slow();
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  free()                                                       */
+/*       Any thread can free a block, as long as the pool is alive.           */
+/* -------------------------------------------------------------------------- */
+    inline void free(void *p) {
+        Block *b = static_cast<Block *>(p), *head, *prev;
+        if (b == NULL) return;
+        if (self_id() == m_owner) {
+            b->next = m_local;
+            m_local = b;
+            return;
+        }
+        head = EzAtomic::load(&m_remote);
+        for (;;) {
+            b->next = head;
+            prev = EzAtomic::cas(&m_remote, head, b);
+            if (prev == head) break;
+            head = prev;
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_owner() / block_size()                                   */
+/*       set_owner() makes the calling thread the owner, e.g. when a pool is  */
+/*       created by one thread for a worker. The old owner must not use the   */
+/*       pool any more.                                                       */
+/* -------------------------------------------------------------------------- */
+    void set_owner(void) { m_owner = self_id(); };
+
+    size_t block_size(void) const { return m_size; };
+};
+
+
+/*****************************************************************************
+      CLASS DEFINITION : EzThreadAttr
+        Attributes applied when a thread is created (see
+        EzThreadBase::set_thread_attr()): a set of CPUs to run on, which can
+        be filled from a NUMA node, and a scheduling policy and priority.
+        CPU affinity is supported on Linux and Windows (the first 32
+        processors), NUMA nodes are read from /sys on Linux.
+        The stack size, a caller-provided stack and the guard size can be
+        set as well, and the stack usage can be measured by painting the
+        stack (see EzThreadBase::stack_high_water()).
+        Profiling records the life cycle of the thread (see
+        EzThreadBase::thread_stats()).
+ *****************************************************************************/
+
+#include <stddef.h>       /* size_t */
+
+#ifdef STACK_SIZE_PARAM_IS_A_RESERVATION
+#  define EZ_STACK_RESERVATION__  STACK_SIZE_PARAM_IS_A_RESERVATION
+#else
+#  define EZ_STACK_RESERVATION__  0x00010000
+#endif
+
+#if defined(__linux__)
+#   include <stdio.h>     /* fopen() for /sys/devices/system/node */
+#   include <sched.h>     /* cpu_set_t, SCHED_FIFO */
+#   if defined(CPU_SETSIZE)
+#      define EZ_HAVE_AFFINITY
+#   endif
+#endif
+
+#ifndef EZ_MAX_CPUS
+#  define EZ_MAX_CPUS           256   /* CPUs which EzThreadAttr can handle */
+#endif
+
+/* --------------------------- scheduling policy ---------------------------- */
+
+#define EZSCHED_DEFAULT         (-1)  /* inherit from the creating thread    */
+#define EZSCHED_OTHER           0x0   /* SCHED_OTHER (time sharing)          */
+#define EZSCHED_FIFO            0x1   /* SCHED_FIFO (real time, privileged)  */
+#define EZSCHED_RR              0x2   /* SCHED_RR (real time, privileged)    */
+
+/* --------------------------- worker placement ----------------------------- */
+
+#define EZPLACE_NONE            0x0   /* let the OS schedule the workers     */
+#define EZPLACE_CPU             0x1   /* pin worker i to the i-th usable CPU  */
+#define EZPLACE_NODE            0x2   /* worker i runs on NUMA node i        */
+
+class EzThreadAttr {
+  private:
+    friend class EzThreadBase;
+
+#define EZ_CPU_WORDS__  ((EZ_MAX_CPUS + 8 * (int)sizeof(unsigned long) - 1) / (8 * (int)sizeof(unsigned long)))
+#define EZ_CPU_BITS__   (8 * (int)sizeof(unsigned long))
+
+    unsigned long m_cpus[EZ_CPU_WORDS__];  /* empty : no affinity     */
+    int m_policy;                          /* EZSCHED_*               */
+    int m_priority;
+    size_t m_stack_size;                   /* 0 : default             */
+    void  *m_stack_addr;                   /* NULL : allocated by OS  */
+    size_t m_guard_size;
+    bool   m_has_guard;                    /* false : default guard   */
+    bool   m_watermark;                    /* paint and measure stack */
+    bool   m_profile;                      /* fill EzThreadStats      */
+
+#if defined(__linux__)
+    /* parses "0-3,8-11" from a sysfs cpulist file into the CPU set */
+    int read_cpulist(const char *path) {
+        FILE *fp = fopen(path, "r");
+        int a, b, c, n = 0;
+        if (fp == NULL) return -1;
+        while (fscanf(fp, "%d", &a) == 1) {
+            b = a;
+            c = fgetc(fp);
+            if (c == '-') {
+                if (fscanf(fp, "%d", &b) != 1) break;
+                c = fgetc(fp);
+            }
+            for (; a <= b; a++) {
+                if (set_cpu(a) == 0) n++;
+            }
+            if (c != ',') break;
+        }
+        fclose(fp);
+        return (n > 0) ? 0 : -1;
+    };
+#endif
+
+  public:
+    EzThreadAttr() { clear(); };
+    ~EzThreadAttr() {};
+
+    void clear(void) {
+        clear_cpus();
+        m_policy = EZSCHED_DEFAULT;
+        m_priority = 0;
+        m_stack_size = 0;
+        m_stack_addr = NULL;
+        m_guard_size = 0;
+        m_has_guard = false;
+        m_watermark = false;
+        m_profile = false;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_cpu() / clear_cpus() / has_cpu() / cpu_set_count()       */
+/*       Edit the CPU set. An empty set means no affinity.                    */
+/*       set_cpu() return value :  0:success  -1:out of range                 */
+/* -------------------------------------------------------------------------- */
+    int set_cpu(int cpu) {
+        if (cpu < 0 || cpu >= EZ_MAX_CPUS) return -1;
+        m_cpus[cpu / EZ_CPU_BITS__] |= 1UL << (cpu % EZ_CPU_BITS__);
+        return 0;
+    };
+
+    void clear_cpus(void) {
+        for (int i = 0; i < EZ_CPU_WORDS__; i++) m_cpus[i] = 0;
+    };
+
+    bool has_cpu(int cpu) const {
+        if (cpu < 0 || cpu >= EZ_MAX_CPUS) return false;
+        return ((m_cpus[cpu / EZ_CPU_BITS__] >> (cpu % EZ_CPU_BITS__)) & 1UL) != 0;
+    };
+
+    int cpu_set_count(void) const {
+        int n = 0;
+        for (int i = 0; i < EZ_MAX_CPUS; i++) {
+            if (has_cpu(i)) n++;
+        }
+        return n;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_numa_node()                                              */
+/*       Adds the CPUs of a NUMA node to the CPU set. Memory which a thread   */
+/*       touches first is allocated on its node by the OS (first touch), so   */
+/*       allocate per-thread data on the thread itself.                       */
+/*       Return value :  0:success  -1:no such node                           */
+/* -------------------------------------------------------------------------- */
+    int set_numa_node(int node) {
+#if defined(__linux__)
+        char path[64];
+        if (node < 0) return -1;
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        return read_cpulist(path);
+#else
+        if (node != 0) return -1;
+        for (int i = 0; i < cpu_count(); i++) set_cpu(i);
+        return 0;
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_sched()                                                  */
+/*       policy   : EZSCHED_DEFAULT, EZSCHED_OTHER, EZSCHED_FIFO, EZSCHED_RR  */
+/*       priority : sched_priority on POSIX (1..99 for FIFO/RR), or a         */
+/*                  SetThreadPriority() value on Windows (policy ignored)     */
+/*       Real-time policies usually need privileges; run() fails without.    */
+/* -------------------------------------------------------------------------- */
+    void set_sched(int policy, int priority) {
+        m_policy = policy;
+        m_priority = priority;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_stack_size() / set_stack() / set_guard_size()            */
+/*       set_stack_size : bytes reserved for the stack (0: OS default, which  */
+/*                        is often 8MB on Linux). Too small a size makes      */
+/*                        run() fail (see PTHREAD_STACK_MIN).                 */
+/*       set_stack      : run on a caller-provided buffer, which must stay    */
+/*                        alive until the thread is joined (POSIX only).      */
+/*       set_guard_size : bytes of the inaccessible guard area below the      */
+/*                        stack (POSIX only; ignored with set_stack()).       */
+/* -------------------------------------------------------------------------- */
+    void set_stack_size(size_t size) {
+        m_stack_size = size;
+        m_stack_addr = NULL;
+    };
+
+    void set_stack(void *addr, size_t size) {
+        m_stack_addr = addr;
+        m_stack_size = size;
+    };
+
+    void set_guard_size(size_t size) {
+        m_guard_size = size;
+        m_has_guard = true;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_stack_watermark()                                        */
+/*       true : the thread fills its free stack with a pattern when it        */
+/*              starts and measures how much was overwritten when app()       */
+/*              returns. Painting commits the whole stack, so use it to       */
+/*              size stacks, not in production.                               */
+/* -------------------------------------------------------------------------- */
+    void set_stack_watermark(bool on) { m_watermark = on; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  set_profiling()                                              */
+/*       true : the thread records the timestamps of its life cycle, its      */
+/*              CPU time and its context switches (see                        */
+/*              EzThreadBase::thread_stats()).                                */
+/* -------------------------------------------------------------------------- */
+    void set_profiling(bool on) { m_profile = on; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  place()                                                      */
+/*       Sets the CPU set of the index-th worker of a pool.                   */
+/*       mode : EZPLACE_NONE, EZPLACE_CPU or EZPLACE_NODE                     */
+/*       Only the CPUs the process may run on are used (a container or        */
+/*       taskset may allow CPUs 4-7 only): EZPLACE_CPU takes the index-th     */
+/*       of them, and EZPLACE_NODE keeps the node's CPUs among them.          */
+/* -------------------------------------------------------------------------- */
+    void place(int mode, int index) {
+        unsigned long allowed[EZ_CPU_WORDS__];
+        int i, n = process_cpus(allowed);
+        clear_cpus();
+        if (mode == EZPLACE_CPU) {
+            int k = index % n;
+            for (i = 0; i < EZ_MAX_CPUS; i++) {
+                if (((allowed[i / EZ_CPU_BITS__] >> (i % EZ_CPU_BITS__)) & 1UL) && k-- == 0) {
+                    set_cpu(i);
+                    break;
+                }
+            }
+        } else if (mode == EZPLACE_NODE) {
+            int nodes = numa_node_count();
+            if (nodes > 1) set_numa_node(index % nodes);
+            for (i = 0; i < EZ_CPU_WORDS__; i++) m_cpus[i] &= allowed[i];
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  process_cpus()                                               */
+/*       Gets the CPUs the process may run on (sched_getaffinity() on Linux,  */
+/*       GetProcessAffinityMask() on Windows, else 0..cpu_count()-1).         */
+/*       return value: the number of CPUs in mask (>= 1)                      */
+/* -------------------------------------------------------------------------- */
+    static int process_cpus(unsigned long *mask) {
+        int i, n = 0;
+        for (i = 0; i < EZ_CPU_WORDS__; i++) mask[i] = 0;
+#if defined(EZ_HAVE_AFFINITY)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (i = 0; i < EZ_MAX_CPUS && i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &set)) {
+                    mask[i / EZ_CPU_BITS__] |= 1UL << (i % EZ_CPU_BITS__);
+                    n++;
+                }
+            }
+        }
+#elif defined(_WIN32)
+#  if defined(_WIN64) || (defined(_MSC_VER) && _MSC_VER >= 1300)
+        DWORD_PTR proc, sys;
+#  else
+        DWORD proc, sys;
+#  endif
+        if (GetProcessAffinityMask(GetCurrentProcess(), &proc, &sys)) {
+            for (i = 0; i < EZ_MAX_CPUS && i < 8 * (int)sizeof(proc); i++) {
+                if ((proc >> i) & 1) {
+                    mask[i / EZ_CPU_BITS__] |= 1UL << (i % EZ_CPU_BITS__);
+                    n++;
+                }
+            }
+        }
+#endif
+        if (n == 0) {
+            for (i = 0; i < cpu_count() && i < EZ_MAX_CPUS; i++) {
+                mask[i / EZ_CPU_BITS__] |= 1UL << (i % EZ_CPU_BITS__);
+                n++;
+            }
+        }
+        return n;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  cpu_count() / numa_node_count()                              */
+/*       return value: the number of online processors / NUMA nodes (>= 1)   */
+/* -------------------------------------------------------------------------- */
+    static int cpu_count() {
+        int n;
+#ifdef _WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        n = (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        n = 1;
+#endif
+        return (n > 0 ? n : 1);
+    }
+
+    static int numa_node_count() {
+        int n = 0;
+#if defined(__linux__)
+        char path[64];
+        FILE *fp;
+        for (;;) {
+            sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+            if ((fp = fopen(path, "r")) == NULL) break;
+            fclose(fp);
+            n++;
+        }
+#endif
+        return (n > 0 ? n : 1);
+    }
+};
+
+
+/* --------------------------- thread status -------------------------------- */
+
+#define EZTH_UNEXEC             0x0
+#define EZTH_CREATING           0x1
+#define EZTH_RUNNING            0x2
+#define EZTH_FINISHED           0x4
+#define EZTH_JOINED             0x8
+
+#ifndef EZTH_AT_EXIT
+#  define EZTH_AT_EXIT          8     /* at_exit() calls per thread           */
+#endif
+
+/* --------------------------- thread profiling ----------------------------- */
+/*   Filled when EzThreadAttr::set_profiling(true) is given to the thread.    */
+/*   The timestamps are EzMutex::nanotime() values (0 : not reached yet).     */
+/*   The CPU time and the context switches are read by the thread itself     */
+/*   when app() returns (-1 : not supported on this platform).               */
+/*     start_ns - run_ns         : thread creation latency                   */
+/*     app_end_ns - app_begin_ns : wall clock time of app()                  */
+/*     involuntary_switches      : preemptions (e.g. oversubscription)       */
+/* -------------------------------------------------------------------------- */
+#if defined(__linux__)
+#   include <sys/resource.h>  /* getrusage() */
+#endif
+
+struct EzThreadStats {
+    ezint64_t run_ns;            /* run() was called               */
+    ezint64_t start_ns;          /* the new thread started         */
+    ezint64_t app_begin_ns;      /* app() was called               */
+    ezint64_t app_end_ns;        /* app() returned                 */
+    ezint64_t join_ns;           /* join() completed               */
+    ezint64_t cpu_ns;            /* user + system CPU time         */
+    long voluntary_switches;     /* the thread blocked or yielded  */
+    long involuntary_switches;   /* the thread was preempted       */
+};
+
+/*****************************************************************************
+      CLASS DEFINITION : EzThreadBase
+ *****************************************************************************/
+
+class EzThreadBase
+{
+/* --------------- force EzThreadBase to be Noncopyable-class --------------- */
+  private:
+
+    EzThreadBase(const EzThreadBase& src);
+    EzThreadBase& operator=(const EzThreadBase& src);
+
+/* ----------------------- private member variables ------------------------- */
+
+    // threadid_t     m_ThreadId_;      /* unique ID for each thread             */
+    threadhandle_t m_ThreadHandle_;  /* Win:HANDLE POSIX:pthread_t            */
+    VOLATILE_ eztoken_t m_ThreadState_;  /* 0:unexecuted, 1:creating, 2:running, 4:finished, 8:joined */
+    volatile int m_IsThreadCreated_; /* 0:joined or not created, -1:created   */
+
+    VOLATILE_ eztoken_t m_StateWaiters_; /* threads in wait_until_state()     */
+
+    EzThreadAttr   m_Attr_;          /* applied by run()                      */
+    char          *m_StackLo_;       /* painted area, if stack watermark      */
+    char          *m_StackHi_;
+    size_t         m_StackUsed_;     /* stack high-water mark in bytes        */
+    EzThreadStats  m_Stats_;         /* filled if m_Attr_.m_profile           */
+
+    VOLATILE_ eztoken_t m_StopRequested_;  /* 1 after request_stop()          */
+    void (*m_StopFunc_)(void *);     /* called by request_stop()              */
+    void          *m_StopArg_;
+
+    EzArena       *m_Arena_;         /* scratch memory, created by arena()    */
+
+    struct AtExit {
+        void (*func)(void *);
+        void *arg;
+    };
+    AtExit         m_AtExit_[EZTH_AT_EXIT];  /* called when app() returns     */
+    int            m_NumAtExit_;
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  apply_attr()                                                 */
+/*       Applies m_Attr_ to the thread attributes (POSIX) or to the thread    */
+/*       created suspended (Windows, where a failure is ignored).            */
+/*       Return value :  0:success  -1:error                                  */
+/* -------------------------------------------------------------------------- */
+#ifdef USE_WIN_THREAD
+    bool has_attr() const {
+        return (m_Attr_.cpu_set_count() > 0 || m_Attr_.m_policy != EZSCHED_DEFAULT);
+    };
+
+    int apply_attr(HANDLE h) {
+        if (m_Attr_.cpu_set_count() > 0) {
+            SetThreadAffinityMask(h, (DWORD)(m_Attr_.m_cpus[0] & 0xffffffffUL));
+        }
+        if (m_Attr_.m_policy != EZSCHED_DEFAULT) {
+            SetThreadPriority(h, m_Attr_.m_priority);
+        }
+        return 0;
+    };
+#else
+    int apply_attr(pthread_attr_t *attr) {
+#  if defined(EZ_HAVE_AFFINITY)
+        if (m_Attr_.cpu_set_count() > 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int i = 0; i < EZ_MAX_CPUS && i < CPU_SETSIZE; i++) {
+                if (m_Attr_.has_cpu(i)) CPU_SET(i, &set);
+            }
+            if (pthread_attr_setaffinity_np(attr, sizeof(set), &set)) return -1;
+        }
+#  endif
+        if (m_Attr_.m_stack_addr != NULL) {
+            if (pthread_attr_setstack(attr, m_Attr_.m_stack_addr, m_Attr_.m_stack_size)) return -1;
+        } else if (m_Attr_.m_stack_size != 0) {
+            if (pthread_attr_setstacksize(attr, m_Attr_.m_stack_size)) return -1;
+        }
+        if (m_Attr_.m_has_guard && m_Attr_.m_stack_addr == NULL) {
+            if (pthread_attr_setguardsize(attr, m_Attr_.m_guard_size)) return -1;
+        }
+        if (m_Attr_.m_policy != EZSCHED_DEFAULT) {
+            struct sched_param sp;
+            int policy = SCHED_OTHER;
+            if (m_Attr_.m_policy == EZSCHED_FIFO) policy = SCHED_FIFO;
+            if (m_Attr_.m_policy == EZSCHED_RR)   policy = SCHED_RR;
+            sp.sched_priority = m_Attr_.m_priority;
+            if (pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) ||
+                pthread_attr_setschedpolicy(attr, policy) ||
+                pthread_attr_setschedparam(attr, &sp)) return -1;
+        }
+        return 0;
+    };
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  setThreadState()                                             */
+/*       This function is used to set a member variable "m_ThreadState_"      */
+/*       with release ordering, and wakes threads in wait_until_state().      */
+/*       The fence orders the store before the read of m_StateWaiters_ (the   */
+/*       waiter increments it, then parks only if the state is unchanged).    */
+/*       exchange() alone does not order a later relaxed load.                */
+/* -------------------------------------------------------------------------- */
+    void setThreadState(int state) {
+        EzAtomic::exchange(&m_ThreadState_, (eztoken_t)state);
+        EzAtomic::fence();
+        if (EzAtomic::load_relaxed(&m_StateWaiters_)) {
+            EzMutex::unpark(&m_ThreadState_, EZ_UNPARK_ALL);
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  stack_paint() / stack_measure()                              */
+/*       Called on the new thread around app() when the stack watermark is    */
+/*       enabled. The free part of the stack (below the current frame) is     */
+/*       filled with a pattern, and the high-water mark is the distance from  */
+/*       the top of the stack to the lowest overwritten byte.                 */
+/*       Windows reports the committed part of the stack instead, which the   */
+/*       OS grows page by page as the stack is touched.                       */
+/* -------------------------------------------------------------------------- */
+#define EZ_STACK_PAINT__   0xa5
+#define EZ_STACK_MARGIN__  512     /* bytes kept below the painting frame */
+
+    void stack_paint() {
+        volatile char here = 0;
+        volatile char *p;
+        char *lo = NULL, *hi = NULL, *end;
+        m_StackLo_ = m_StackHi_ = NULL;
+        m_StackUsed_ = 0;
+#if !defined(USE_WIN_THREAD)
+        if (m_Attr_.m_stack_addr != NULL) {
+            lo = (char *)m_Attr_.m_stack_addr;
+            hi = lo + m_Attr_.m_stack_size;
+        } else {
+#  if defined(__GLIBC__)
+            pthread_attr_t attr;
+            void *addr;
+            size_t size;
+            if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+                if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                    lo = (char *)addr;
+                    hi = lo + size;
+                }
+                pthread_attr_destroy(&attr);
+            }
+#  endif
+        }
+#endif
+        end = (char *)((size_t)&here - EZ_STACK_MARGIN__);
+        if (lo == NULL || end <= lo) return;
+        for (p = lo; p < end; p++) *p = (char)EZ_STACK_PAINT__;
+        m_StackLo_ = lo;
+        m_StackHi_ = hi;
+    };
+
+    void stack_measure() {
+#ifdef USE_WIN_THREAD
+        MEMORY_BASIC_INFORMATION mbi;
+        volatile char here = 0;
+        if (VirtualQuery((const void *)&here, &mbi, sizeof(mbi)) != 0) {
+            m_StackUsed_ = (size_t)((char *)mbi.BaseAddress + mbi.RegionSize
+                                    - (char *)mbi.AllocationBase);
+            /* subtract the reserved (uncommitted) part below the region */
+            if (VirtualQuery(mbi.AllocationBase, &mbi, sizeof(mbi)) != 0 &&
+                mbi.State == MEM_RESERVE) {
+                m_StackUsed_ -= (size_t)mbi.RegionSize;
+            }
+        }
+#else
+        const volatile char *p = m_StackLo_;
+        if (p == NULL) return;
+        while (p < m_StackHi_ && *p == (char)EZ_STACK_PAINT__) p++;
+        m_StackUsed_ = (size_t)(m_StackHi_ - (const char *)p);
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  clear_stats() / collect_usage()                              */
+/*       collect_usage() is called on the thread itself when app() returns.  */
+/* -------------------------------------------------------------------------- */
+    void call_at_exit() {
+        void (*hook)(void);
+        while (m_NumAtExit_ > 0) {
+            AtExit& e = m_AtExit_[--m_NumAtExit_];
+            e.func(e.arg);
+        }
+        hook = EzAtomic::load(exit_hook());
+        if (hook) hook();
+    }
+
+    void free_arena() {
+        delete m_Arena_;
+        m_Arena_ = NULL;
+    }
+
+    void clear_stats() {
+        m_Stats_.run_ns = m_Stats_.start_ns = 0;
+        m_Stats_.app_begin_ns = m_Stats_.app_end_ns = m_Stats_.join_ns = 0;
+        m_Stats_.cpu_ns = -1;
+        m_Stats_.voluntary_switches = m_Stats_.involuntary_switches = -1;
+    };
+
+    void collect_usage() {
+#if defined(_WIN32)
+        FILETIME t_create, t_exit, t_kernel, t_user;
+        if (GetThreadTimes(GetCurrentThread(), &t_create, &t_exit, &t_kernel, &t_user)) {
+            ezint64_t k = ((ezint64_t)t_kernel.dwHighDateTime << 32) | t_kernel.dwLowDateTime;
+            ezint64_t u = ((ezint64_t)t_user.dwHighDateTime << 32) | t_user.dwLowDateTime;
+            m_Stats_.cpu_ns = (k + u) * 100;   /* 100ns units */
+        }
+#else
+#  if defined(_POSIX_THREAD_CPUTIME) && (_POSIX_THREAD_CPUTIME >= 0)
+        clockid_t cid;
+        struct timespec ts;
+        if (pthread_getcpuclockid(pthread_self(), &cid) == 0 &&
+            clock_gettime(cid, &ts) == 0) {
+            m_Stats_.cpu_ns = (ezint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+#  endif
+#  if defined(RUSAGE_THREAD)
+        struct rusage ru;
+        if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+            m_Stats_.voluntary_switches = (long)ru.ru_nvcsw;
+            m_Stats_.involuntary_switches = (long)ru.ru_nivcsw;
+        }
+#  endif
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  tls_key()                                                    */
+/*       A thread local slot which holds the EzThreadBase object running on   */
+/*       the calling thread. It is allocated at the first use.                */
+/* -------------------------------------------------------------------------- */
+#ifdef USE_WIN_THREAD
+    static DWORD tls_key() {
+        static VOLATILE_ long state = 0;   /* 0:none, 1:allocating, 2:ready */
+        static DWORD key = TLS_OUT_OF_INDEXES;
+        if (state != 2) {
+            if (EzAtomic::cas(&state, 0L, 1L) == 0) {
+                key = TlsAlloc();
+                EZ_MEM_BARRIER();
+                state = 2;
+            } else {
+                while (state != 2) EzMutex::Wait();
+            }
+        }
+        return key;
+    };
+#else
+    static pthread_key_t& tls_key_storage() {
+        static pthread_key_t key;
+        return key;
+    };
+    static void tls_key_create() {
+        pthread_key_create(&tls_key_storage(), NULL);
+    };
+    static pthread_key_t tls_key() {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, &tls_key_create);
+        return tls_key_storage();
+    };
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  m_ThreadFuncWrapper()                                        */
+/*       m_ThreadFuncWrapper() is a static member function                    */
+/*       which invokes app() method in a thread.                              */
+/* -------------------------------------------------------------------------- */
+
+#ifdef USE_WIN_THREAD
+    static unsigned __stdcall m_ThreadFuncWrapper(void* arg) {
+        TlsSetValue(tls_key(), arg);
+        EzThreadBase *self = static_cast<EzThreadBase *>(arg);
+        bool profile = self->m_Attr_.m_profile;
+        if (profile) self->m_Stats_.start_ns = EzMutex::nanotime();
+        if (self->m_Attr_.m_watermark) self->stack_paint();
+        self->setThreadState(EZTH_RUNNING);
+        if (profile) self->m_Stats_.app_begin_ns = EzMutex::nanotime();
+        self->app();
+        if (profile) {
+            self->m_Stats_.app_end_ns = EzMutex::nanotime();
+            self->collect_usage();
+        }
+        if (self->m_Attr_.m_watermark) self->stack_measure();
+        self->call_at_exit();
+        self->free_arena();
+        self->setThreadState(EZTH_FINISHED);
+        return 0;
+    };
+#else
+    static void* m_ThreadFuncWrapper(void *arg) {
+        pthread_setspecific(tls_key(), arg);
+        EzThreadBase *self = static_cast<EzThreadBase *>(arg);
+        bool profile = self->m_Attr_.m_profile;
+        if (profile) self->m_Stats_.start_ns = EzMutex::nanotime();
+        if (self->m_Attr_.m_watermark) self->stack_paint();
+        self->setThreadState(EZTH_RUNNING);
+        if (profile) self->m_Stats_.app_begin_ns = EzMutex::nanotime();
+        self->app();
+        if (profile) {
+            self->m_Stats_.app_end_ns = EzMutex::nanotime();
+            self->collect_usage();
+        }
+        if (self->m_Attr_.m_watermark) self->stack_measure();
+        self->call_at_exit();
+        self->free_arena();
+        self->setThreadState(EZTH_FINISHED);
+        return NULL;
+    };
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: app                                                            */
+/*   A user routine to be executed on a thread.                               */
+/*   It should be a pure virtual function to force the user to implement it.  */
+/* -------------------------------------------------------------------------- */
+
+  protected:
+
+    virtual void app() = 0;
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR                                                              */
+/* -------------------------------------------------------------------------- */
+
+    EzThreadBase() {
+        m_IsThreadCreated_ = m_ThreadState_ = 0;
+        m_StateWaiters_ = 0;
+        m_StackLo_ = m_StackHi_ = NULL;
+        m_StackUsed_ = 0;
+        clear_stats();
+        m_StopRequested_ = 0;
+        m_StopFunc_ = NULL;
+        m_StopArg_ = NULL;
+        m_Arena_ = NULL;
+        m_NumAtExit_ = 0;
+#ifdef USE_WIN_THREAD
+        m_ThreadHandle_ = NULL;
+        // m_ThreadId_ = 0;
+#else
+        m_ThreadHandle_ = pthread_self();
+        // m_ThreadId_ = m_ThreadHandle_;
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   DESTRUCTOR                                                               */
+/*       This destructor must be a virtual function in order that             */
+/*       a destructor in the derived class never fail to be called.           */
+/* -------------------------------------------------------------------------- */
+
+  public:
+
+    virtual ~EzThreadBase() {
+        free_arena();
+#ifdef USE_WIN_THREAD
+        if (m_ThreadHandle_) {
+            CloseHandle(m_ThreadHandle_);
+            // m_ThreadHandle_ = NULL;
+        }
+#else
+        if (!pthread_equal(m_ThreadHandle_, pthread_self())) {
+            pthread_detach(m_ThreadHandle_);
+            // m_ThreadHandle_ = pthread_self();
+        }
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: get_thread_id                                                  */
+/* -------------------------------------------------------------------------- */
+
+    // threadid_t get_thread_id() const { return m_ThreadId_; }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: get_[win|posix]_thread_handle                                  */
+/* -------------------------------------------------------------------------- */
+
+#ifdef USE_WIN_THREAD
+    HANDLE get_win_thread_handle() const { return m_ThreadHandle_; }
+#else
+    pthread_t get_posix_thread_handle() const { return m_ThreadHandle_; }
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: current                                                        */
+/*      return value: the EzThreadBase object whose app() is running on the   */
+/*                    calling thread, or NULL if the thread is not created by */
+/*                    EzThreadBase (e.g. main thread)                         */
+/* -------------------------------------------------------------------------- */
+
+    static EzThreadBase *current() {
+#ifdef USE_WIN_THREAD
+        return static_cast<EzThreadBase *>(TlsGetValue(tls_key()));
+#else
+        return static_cast<EzThreadBase *>(pthread_getspecific(tls_key()));
+#endif
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: cpu_count                                                      */
+/*      return value: the number of online processors (at least 1)            */
+/* -------------------------------------------------------------------------- */
+
+    static int cpu_count() {
+        return EzThreadAttr::cpu_count();
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: status                                                         */
+/*      get the status of this thread                                         */
+/*   return value:                                                            */
+/*      0:unexecuted, 1:creating, 2:created and running, 4:finished, 8:joined */
+/* -------------------------------------------------------------------------- */
+
+    int status() {
+        return (int)EzAtomic::load(&m_ThreadState_);
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait_until_state                                               */
+/*      Blocks until status() has any of the bits in mask (e.g.               */
+/*      EZTH_RUNNING|EZTH_FINISHED), at most timeout_ms milliseconds.         */
+/*      timeout_ms < 0 : wait forever                                         */
+/*   return value:                                                            */
+/*      0:success  -1:timeout                                                 */
+/* -------------------------------------------------------------------------- */
+
+    int wait_until_state(int mask, long timeout_ms = -1) {
+        eztoken_t st;
+        ezint64_t deadline = 0, rest = 0;
+        if (timeout_ms >= 0) {
+            deadline = EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000;
+        }
+        while (((st = EzAtomic::load(&m_ThreadState_)) & mask) == 0) {
+            if (timeout_ms >= 0) {
+                rest = deadline - EzMutex::nanotime();
+                if (rest <= 0) return -1;
+            }
+            EzAtomic::fetch_add(&m_StateWaiters_, (eztoken_t)1);
+            if (timeout_ms >= 0) {
+                EzMutex::park(&m_ThreadState_, st, rest);
+            } else {
+                EzMutex::park(&m_ThreadState_, st);
+            }
+            EzAtomic::fetch_add(&m_StateWaiters_, (eztoken_t)-1);
+        }
+        return 0;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: set_thread_attr / thread_attr                                  */
+/*      Sets the attributes (CPU set, scheduling) used by the next run().     */
+/*      Return value :  0:success  -1:error (the thread is running)           */
+/* -------------------------------------------------------------------------- */
+
+    int set_thread_attr(const EzThreadAttr& attr) {
+        if (m_IsThreadCreated_) return -1;
+        m_Attr_ = attr;
+        return 0;
+    }
+
+    const EzThreadAttr& thread_attr() const { return m_Attr_; }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: stack_high_water                                               */
+/*      return value: the most stack the thread has used in bytes, measured   */
+/*                    when app() returned, or 0 if it was not measured        */
+/*                    (see EzThreadAttr::set_stack_watermark()).              */
+/* -------------------------------------------------------------------------- */
+
+    size_t stack_high_water() const { return m_StackUsed_; }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: thread_stats                                                   */
+/*      return value: the profile of the last run (see EzThreadStats and      */
+/*                    EzThreadAttr::set_profiling()). Read it after join(),   */
+/*                    or after status() reports EZTH_FINISHED.                */
+/* -------------------------------------------------------------------------- */
+
+    const EzThreadStats& thread_stats() const { return m_Stats_; }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: arena / reset_arena / current_arena                            */
+/*      arena() is the thread's scratch EzArena, created at the first call.   */
+/*      Use it on the thread itself only; it is freed when app() returns.     */
+/*      reset_arena() frees all of its allocations at once (EzThreadPool      */
+/*      does it after every job). current_arena() is the arena of the         */
+/*      calling thread, or NULL if the thread is not an EzThreadBase.         */
+/* -------------------------------------------------------------------------- */
+
+    EzArena& arena() {
+        if (m_Arena_ == NULL) m_Arena_ = new EzArena();
+        return *m_Arena_;
+    }
+
+    void reset_arena() {
+        if (m_Arena_) m_Arena_->reset();
+    }
+
+    static EzArena *current_arena() {
+        EzThreadBase *self = current();
+        return self ? &self->arena() : NULL;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: at_exit                                                        */
+/*      Registers func(arg) to be called on the thread when app() returns,    */
+/*      in the reverse order of registration, e.g. to release per-thread      */
+/*      resources. Call it on the thread itself. Up to EZTH_AT_EXIT calls.    */
+/*      Return value :  0:success  -1:error (too many)                        */
+/* -------------------------------------------------------------------------- */
+
+    int at_exit(void (*func)(void *), void *arg) {
+        if (func == NULL || m_NumAtExit_ >= EZTH_AT_EXIT) return -1;
+        m_AtExit_[m_NumAtExit_].func = func;
+        m_AtExit_[m_NumAtExit_].arg = arg;
+        m_NumAtExit_++;
+        return 0;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: exit_hook                                                      */
+/*      A function called on every EzThreadBase thread after the at_exit()    */
+/*      functions. EzEpoch and EzHazardPtr use it to give back the thread's   */
+/*      records. Not for applications: use at_exit().                         */
+/* -------------------------------------------------------------------------- */
+
+    typedef void (*ExitHook)(void);
+    static ExitHook VOLATILE_ *exit_hook() {
+        static ExitHook VOLATILE_ hook = NULL;
+        return &hook;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: request_stop / stop_requested                                  */
+/*      Cooperative cancellation: request_stop() only sets a flag, which      */
+/*      app() checks with stop_requested() or waits for with wait_stop().     */
+/*      The first request_stop() calls the stop callback on the calling       */
+/*      thread, e.g. to set an EzEvent or close a queue the thread waits on.  */
+/*      run() clears the request.                                             */
+/*      request_stop() return value : true if this call made the request      */
+/* -------------------------------------------------------------------------- */
+
+    bool request_stop() {
+        if (EzAtomic::cas(&m_StopRequested_, (eztoken_t)0, (eztoken_t)1) != 0) {
+            return false;
+        }
+        EzMutex::unpark(&m_StopRequested_, EZ_UNPARK_ALL);
+        if (m_StopFunc_) m_StopFunc_(m_StopArg_);
+        return true;
+    }
+
+    bool stop_requested() const {
+        return (EzAtomic::load(&m_StopRequested_) != 0);
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: set_stop_callback                                              */
+/*      Sets func(arg) to be called by request_stop(). Set it before run().   */
+/*      If the stop is already requested, func(arg) is called at once.        */
+/* -------------------------------------------------------------------------- */
+
+    void set_stop_callback(void (*func)(void *), void *arg) {
+        m_StopFunc_ = func;
+        m_StopArg_ = arg;
+        if (func && stop_requested()) func(arg);
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait_stop                                                      */
+/*      Blocks until request_stop(), at most timeout_ms milliseconds          */
+/*      (< 0 : forever). A stop-aware replacement of millisleep().            */
+/*   return value:                                                            */
+/*      0:stop requested  -1:timeout                                          */
+/* -------------------------------------------------------------------------- */
+
+    int wait_stop(long timeout_ms = -1) {
+        ezint64_t deadline = 0, rest = 0;
+        if (timeout_ms >= 0) {
+            deadline = EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000;
+        }
+        while (!stop_requested()) {
+            if (timeout_ms >= 0) {
+                rest = deadline - EzMutex::nanotime();
+                if (rest <= 0) return -1;
+                EzMutex::park(&m_StopRequested_, 0, rest);
+            } else {
+                EzMutex::park(&m_StopRequested_, 0);
+            }
+        }
+        return 0;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: current_stop_requested / current_wait_stop                     */
+/*      stop_requested() / wait_stop() of the thread calling them, for        */
+/*      thread functions which have no object (EzThread, pool jobs).          */
+/*      On a thread not created by EzThreadBase there is no stop request:     */
+/*      current_wait_stop() sleeps timeout_ms and returns -1.                 */
+/* -------------------------------------------------------------------------- */
+
+    static bool current_stop_requested() {
+        EzThreadBase *self = current();
+        return (self != NULL && self->stop_requested());
+    }
+
+    static int current_wait_stop(long timeout_ms) {
+        EzThreadBase *self = current();
+        if (self != NULL) return self->wait_stop(timeout_ms);
+        if (timeout_ms > 0) EzMutex::millisleep((unsigned long)timeout_ms);
+        return -1;
+    }
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: run                                                            */
+/*      This function creates and starts a thread.                            */
+/*      > Invokes app() method on a thread via m_ThreadFuncWrapper()          */
+/*      Return value :  0:success  -1:error                                   */
+/* -------------------------------------------------------------------------- */
+
+    DO_NOT_OVERRIDE__  int run()  OVERRIDE_IS_PROHIBITED__
+    {
+        if(!m_IsThreadCreated_) {
+            if (m_Attr_.m_profile) {
+                clear_stats();
+                m_Stats_.run_ns = EzMutex::nanotime();
+            }
+            m_StopRequested_ = 0;
+            setThreadState(EZTH_CREATING);
+#ifdef USE_WIN_THREAD
+            unsigned dummy;  /* Digital Mars requires the 6th arg of _beginthreadex. */
+                             /* Other compilers do not require it (allow NULL).      */
+            unsigned flags = has_attr() ? CREATE_SUSPENDED : 0;
+            if (m_Attr_.m_stack_addr != NULL) {   /* not supported on Windows */
+                setThreadState(EZTH_UNEXEC);
+                return -1;
+            }
+            if (m_Attr_.m_stack_size != 0) flags |= EZ_STACK_RESERVATION__;
+            m_ThreadHandle_ = (HANDLE)_beginthreadex(NULL, (unsigned)m_Attr_.m_stack_size,
+                                                  &m_ThreadFuncWrapper,
+                                                  this, flags, &dummy);
+            if (m_ThreadHandle_ == (HANDLE)0L)    /* Fail */
+            {
+                m_ThreadHandle_ = NULL;
+                setThreadState(EZTH_UNEXEC);
+            } else {                              /* Success */
+                if (flags) {
+                    apply_attr(m_ThreadHandle_);
+                    ResumeThread(m_ThreadHandle_);
+                }
+                m_IsThreadCreated_ = -1;
+            }
+#else
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if( apply_attr(&attr) ||
+                pthread_create(&m_ThreadHandle_, &attr,
+                               &m_ThreadFuncWrapper,
+                               this) /* !=0 */ )  /* Fail */
+            {
+                m_ThreadHandle_ = pthread_self();
+                setThreadState(EZTH_UNEXEC);
+            } else {                              /* Success */
+                m_IsThreadCreated_ = -1;
+                // m_ThreadId_ = m_ThreadHandle_;
+            }
+            pthread_attr_destroy(&attr);
+#endif
+        }
+        return (m_IsThreadCreated_ ? 0 : -1);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: join                                                           */
+/*      This function waits until the thread finishes.                        */
+/*      Return value :  0:success  -1:error                                   */
+/* -------------------------------------------------------------------------- */
+
+    DO_NOT_OVERRIDE__  int join()  OVERRIDE_IS_PROHIBITED__
+    {
+        if(m_IsThreadCreated_) {
+#ifdef USE_WIN_THREAD
+            if (m_ThreadHandle_) {
+                if (WaitForSingleObject(m_ThreadHandle_, INFINITE) == WAIT_OBJECT_0) {
+                    CloseHandle(m_ThreadHandle_);
+                    m_ThreadHandle_ = NULL;
+                    m_IsThreadCreated_ = 0;
+                    if (m_Attr_.m_profile) m_Stats_.join_ns = EzMutex::nanotime();
+                    setThreadState(EZTH_JOINED);
+                }
+            }
+#else
+            if (!pthread_equal(m_ThreadHandle_, pthread_self())) {
+                if (pthread_join(m_ThreadHandle_, NULL) == 0) {
+                    m_ThreadHandle_ = pthread_self();
+                    m_IsThreadCreated_ = 0;
+                    if (m_Attr_.m_profile) m_Stats_.join_ns = EzMutex::nanotime();
+                    setThreadState(EZTH_JOINED);
+                }
+            }
+#endif
+        }
+        return (m_IsThreadCreated_ ? -1 : 0);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: join_for                                                       */
+/*      join() with a time limit. On timeout the thread keeps running and    */
+/*      can be joined later.                                                  */
+/*      Return value :  0:success  -1:timeout or error                        */
+/* -------------------------------------------------------------------------- */
+
+    DO_NOT_OVERRIDE__  int join_for(long timeout_ms)  OVERRIDE_IS_PROHIBITED__
+    {
+        if (m_IsThreadCreated_ &&
+            wait_until_state(EZTH_FINISHED | EZTH_JOINED, timeout_ms)) return -1;
+        return join();
+    };
+
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzPromise / EzFuture
+        EzPromise<R> sets a value once, and the EzFuture<R> objects obtained
+        from it wait for the value. They share a reference-counted state.
+ *****************************************************************************/
+
+#define EZFUT_PENDING           0x0
+#define EZFUT_SETTING           0x1
+#define EZFUT_READY             0x2
+#define EZFUT_BROKEN            0x3   /* the promise was deleted without a value */
+
+template <typename R>
+class EzFutureState
+{
+  private:
+    EzFutureState(const EzFutureState& src);
+    EzFutureState& operator=(const EzFutureState& src);
+
+  public:
+    VOLATILE_ eztoken_t m_state;     /* EZFUT_xxx                    */
+    VOLATILE_ eztoken_t m_refs;      /* number of promises/futures   */
+    VOLATILE_ eztoken_t m_waiters;   /* threads parked in wait()     */
+    R m_value;
+
+    EzFutureState() { m_state = EZFUT_PENDING; m_refs = 1; m_waiters = 0; };
+
+    void acquire() { EzAtomic::fetch_add(&m_refs, (eztoken_t)1); };
+    void release() {
+        if (EzAtomic::fetch_add(&m_refs, (eztoken_t)-1) == 1) delete this;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  finish()                                                     */
+/*       Publishes EZFUT_READY or EZFUT_BROKEN and wakes the waiters.         */
+/*       The caller must have moved m_state from EZFUT_PENDING to SETTING.    */
+/* -------------------------------------------------------------------------- */
+    void finish(eztoken_t state) {
+        EzAtomic::exchange(&m_state, state);
+        EzAtomic::fence();          /* order m_state before m_waiters */
+        if (EzAtomic::load_relaxed(&m_waiters)) EzMutex::unpark(&m_state, EZ_UNPARK_ALL);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  wait_until()                                                 */
+/*       deadline < 0 : wait forever                                          */
+/*       Return value :  0:ready or broken  -1:timeout                        */
+/* -------------------------------------------------------------------------- */
+    int wait_until(ezint64_t deadline) {
+        eztoken_t st;
+        ezint64_t rest = 0;
+        while ((st = EzAtomic::load(&m_state)) < EZFUT_READY) {
+            if (deadline >= 0) {
+                rest = deadline - EzMutex::nanotime();
+                if (rest <= 0) return -1;
+            }
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            if (deadline >= 0) {
+                EzMutex::park(&m_state, st, rest);
+            } else {
+                EzMutex::park(&m_state, st);
+            }
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+        return 0;
+    };
+};
+
+
+template <typename R>
+class EzFuture
+{
+  private:
+    EzFutureState<R> *m_st;
+
+  public:
+    EzFuture() { m_st = NULL; };
+    explicit EzFuture(EzFutureState<R> *st) { m_st = st; if (m_st) m_st->acquire(); };
+    EzFuture(const EzFuture& src) { m_st = src.m_st; if (m_st) m_st->acquire(); };
+    EzFuture& operator=(const EzFuture& src) {
+        if (src.m_st) src.m_st->acquire();
+        if (m_st) m_st->release();
+        m_st = src.m_st;
+        return *this;
+    };
+    ~EzFuture() { if (m_st) m_st->release(); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: valid                                                          */
+/*      false for an empty future (e.g. async() failed to start a thread)     */
+/* -------------------------------------------------------------------------- */
+    bool valid() const { return (m_st != NULL); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: is_ready                                                       */
+/*      true if get() returns without blocking                                */
+/* -------------------------------------------------------------------------- */
+    bool is_ready() const {
+        return (m_st == NULL || EzAtomic::load(&m_st->m_state) >= EZFUT_READY);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait / wait_for                                                */
+/*      Blocks until the value is set (at most timeout_ms milliseconds).      */
+/*      Return value :  0:ready  -1:timeout                                   */
+/* -------------------------------------------------------------------------- */
+    void wait() const { if (m_st) m_st->wait_until(-1); };
+    int wait_for(long timeout_ms) const {
+        if (m_st == NULL) return 0;
+        return m_st->wait_until(EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: get                                                            */
+/*      Waits for the value and returns it. R() is returned for an empty      */
+/*      future, or if the promise was deleted without a value.               */
+/* -------------------------------------------------------------------------- */
+    R get() const {
+        if (m_st == NULL) return R();
+        m_st->wait_until(-1);
+        return (EzAtomic::load(&m_st->m_state) == EZFUT_READY) ? m_st->m_value : R();
+    };
+};
+
+
+template <typename R>
+class EzPromise
+{
+  private:
+    EzPromise(const EzPromise& src);
+    EzPromise& operator=(const EzPromise& src);
+
+    EzFutureState<R> *m_st;
+
+  public:
+    EzPromise() { m_st = new EzFutureState<R>; };
+    ~EzPromise() {
+        if (EzAtomic::cas(&m_st->m_state, (eztoken_t)EZFUT_PENDING,
+                          (eztoken_t)EZFUT_SETTING) == EZFUT_PENDING) {
+            m_st->finish(EZFUT_BROKEN);
+        }
+        m_st->release();
+    };
+
+    EzFuture<R> get_future() { return EzFuture<R>(m_st); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: set_value                                                      */
+/*      Stores the value and wakes the waiting futures.                       */
+/*      Return value :  0:success  -1:error (already set)                     */
+/* -------------------------------------------------------------------------- */
+    int set_value(const R& value) {
+        if (EzAtomic::cas(&m_st->m_state, (eztoken_t)EZFUT_PENDING,
+                          (eztoken_t)EZFUT_SETTING) != EZFUT_PENDING) return -1;
+        m_st->m_value = value;
+        m_st->finish(EZFUT_READY);
+        return 0;
+    };
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------- */
+/*  EZ_HAVE_CXX11 : defined if the compiler supports C++11 (variadic          */
+/*                  templates, rvalue references). EzThread then accepts any  */
+/*                  callable with any number of arguments.                    */
+/* -------------------------------------------------------------------------- */
+#if defined(__cplusplus) && (__cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900))
+#  define EZ_HAVE_CXX11
+#endif
+
+#ifdef EZ_HAVE_CXX11
+#include <utility>        /* std::forward(), std::move() */
+#include <tuple>          /* std::tuple, std::get()      */
+#include <type_traits>    /* std::decay, std::enable_if  */
+
+#ifndef EZTHREAD_INPLACE_SIZE
+#  define EZTHREAD_INPLACE_SIZE   64   /* bytes for a callable and its arguments */
+#endif
+#ifndef EZTHREAD_INPLACE_ALIGN
+#  define EZTHREAD_INPLACE_ALIGN  16
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   EzLegacyRun__ : true when (func, arg) binds to the C++98 overloads       */
+/*       EzThread(void(*)(TYPE), TYPE) and run(void(*)(TYPE), TYPE). The      */
+/*       variadic ones then step aside, so the same call picks the same       */
+/*       overload (and keeps rerun()) whatever the language standard. The     */
+/*       argument type is not checked: NULL for a pointer TYPE is a long.     */
+/* -------------------------------------------------------------------------- */
+template <typename TYPE, typename F, typename... Args>
+struct EzLegacyRun__ : std::false_type {};
+template <typename TYPE, typename F, typename A>
+struct EzLegacyRun__<TYPE, F, A>
+    : std::integral_constant<bool, std::is_convertible<F, void (*)(TYPE)>::value> {};
+
+template <std::size_t... I> struct EzIndexSeq__ {};
+template <std::size_t N, std::size_t... I>
+struct EzMakeIndexSeq__ : EzMakeIndexSeq__<N - 1, N - 1, I...> {};
+template <std::size_t... I>
+struct EzMakeIndexSeq__<0, I...> { typedef EzIndexSeq__<I...> type; };
+
+/* -------------------------------------------------------------------------- */
+/*   EzInplaceCall__ : a callable and its arguments, constructed in the       */
+/*       buffer of an EzThread. run() calls it once with the arguments moved  */
+/*       out (as std::thread does) and destroys it on the new thread.         */
+/* -------------------------------------------------------------------------- */
+template <typename F, typename... Args>
+struct EzInplaceCall__ {
+    F m_func;
+    std::tuple<Args...> m_args;
+
+    template <typename G, typename... A>
+    explicit EzInplaceCall__(G&& func, A&&... args)
+        : m_func(std::forward<G>(func)), m_args(std::forward<A>(args)...) {}
+
+    template <std::size_t... I>
+    void call(EzIndexSeq__<I...>) {
+        std::move(m_func)(std::move(std::get<I>(m_args))...);
+    }
+
+    static void run(void *p) {
+        EzInplaceCall__ *self = static_cast<EzInplaceCall__ *>(p);
+        self->call(typename EzMakeIndexSeq__<sizeof...(Args)>::type());
+        self->~EzInplaceCall__();
+    }
+};
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*  EzNoArg : the default TYPE of EzThread<>, for threads started with the    */
+/*            C++11 run(callable, args...) only.                              */
+/* -------------------------------------------------------------------------- */
+struct EzNoArg {};
+
+/*****************************************************************************
+      CLASS DEFINITION : EzThread
+ *****************************************************************************/
+
+template <typename TYPE = EzNoArg>
+class EzThread : private EzThreadBase
+{
+  private:
+    void (*m_func)(TYPE);
+    TYPE m_arg;
+
+#ifdef EZ_HAVE_CXX11
+    /* run(callable, args...) : stored in place, no heap allocation     */
+    alignas(EZTHREAD_INPLACE_ALIGN) unsigned char m_inplace[EZTHREAD_INPLACE_SIZE];
+    void (*m_inplace_run)(void *);
+#endif
+
+    /* async(): R(*)(TYPE) is stored as a generic function pointer and  */
+    /*          called back through m_invoke with the promise.          */
+    void (*m_invoke)(EzThread *self);
+    void (*m_rfunc)();
+    void *m_promise;
+
+    void app() {
+#ifdef EZ_HAVE_CXX11
+        if (m_inplace_run) {
+            void (*inplace_run)(void *) = m_inplace_run;
+            m_inplace_run = NULL;
+            inplace_run(m_inplace);
+            return;
+        }
+#endif
+        if (m_invoke) {
+            m_invoke(this);
+        } else {
+            m_func(m_arg);
+        }
+    };
+
+    template <typename R>
+    static void invoke_async(EzThread *self) {
+        R (*func)(TYPE) = reinterpret_cast<R (*)(TYPE)>(self->m_rfunc);
+        EzPromise<R> *promise = static_cast<EzPromise<R> *>(self->m_promise);
+        self->m_promise = NULL;
+        promise->set_value(func(self->m_arg));
+        delete promise;
+    };
+
+  public:
+
+    virtual ~EzThread() {
+        EzThreadBase::request_stop();
+        wait();
+    };
+    EzThread() {
+        m_func = NULL;
+        m_invoke = NULL;
+        m_rfunc = NULL;
+        m_promise = NULL;
+#ifdef EZ_HAVE_CXX11
+        m_inplace_run = NULL;
+#endif
+    };
+    EzThread(void(*func)(TYPE), TYPE arg) {
+        m_func = NULL;
+        m_invoke = NULL;
+        m_rfunc = NULL;
+        m_promise = NULL;
+#ifdef EZ_HAVE_CXX11
+        m_inplace_run = NULL;
+#endif
+        EZ_MEM_BARRIER();
+        EzThread<TYPE>::run(func, arg);
+    };
+    virtual int run(void(*func)(TYPE), TYPE arg) {
+        if ( (func != NULL) && ((EzThreadBase::status() & 0x7) == 0) ) {
+            m_func = func;
+            m_invoke = NULL;
+            m_arg = arg;
+            EZ_MEM_BARRIER();
+            return EzThreadBase::run();
+        }
+        return -1;
+    };
+
+#ifdef EZ_HAVE_CXX11
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: run (C++11)                                                    */
+/*      Starts func(args...) for any callable func (function, lambda,         */
+/*      function object). func and args are moved (or copied if they are      */
+/*      lvalues) into a buffer of EZTHREAD_INPLACE_SIZE bytes inside the      */
+/*      object, and moved out again into the call. A compile error tells     */
+/*      if they do not fit. rerun() is not available after this run().        */
+/*      A call that fits run(void(*)(TYPE), TYPE) goes there instead.         */
+/*      Return value :  0:success  -1:error                                   */
+/* -------------------------------------------------------------------------- */
+    template <typename F, typename... Args,
+              typename = typename std::enable_if<
+                  !std::is_same<typename std::decay<F>::type, EzThread>::value &&
+                  !EzLegacyRun__<TYPE, F, Args...>::value>::type>
+    explicit EzThread(F&& func, Args&&... args) {
+        m_func = NULL;
+        m_invoke = NULL;
+        m_rfunc = NULL;
+        m_promise = NULL;
+        m_inplace_run = NULL;
+        run(std::forward<F>(func), std::forward<Args>(args)...);
+    };
+
+    template <typename F, typename... Args,
+              typename = typename std::enable_if<
+                  !EzLegacyRun__<TYPE, F, Args...>::value>::type>
+    int run(F&& func, Args&&... args) {
+        typedef EzInplaceCall__<typename std::decay<F>::type,
+                                typename std::decay<Args>::type...> Call;
+        static_assert(sizeof(Call) <= EZTHREAD_INPLACE_SIZE,
+                      "EzThread::run(): the callable and its arguments are larger than "
+                      "EZTHREAD_INPLACE_SIZE; define it larger, or pass a pointer");
+        static_assert(alignof(Call) <= EZTHREAD_INPLACE_ALIGN,
+                      "EzThread::run(): an argument needs more than EZTHREAD_INPLACE_ALIGN alignment");
+        if ((EzThreadBase::status() & 0x7) != 0) return -1;
+        new (static_cast<void *>(m_inplace)) Call(std::forward<F>(func), std::forward<Args>(args)...);
+        m_func = NULL;
+        m_invoke = NULL;
+        m_inplace_run = &Call::run;
+        EZ_MEM_BARRIER();
+        if (EzThreadBase::run() == 0) return 0;
+        m_inplace_run = NULL;
+        reinterpret_cast<Call *>(m_inplace)->~Call();
+        return -1;
+    };
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: async                                                          */
+/*      Starts R func(TYPE arg) on a thread, and returns a future which       */
+/*      receives the return value. An empty future is returned on error.      */
+/*      rerun() is not available after async().                               */
+/* -------------------------------------------------------------------------- */
+    template <typename R>
+    EzFuture<R> async(R(*func)(TYPE), TYPE arg) {
+        if ( (func != NULL) && ((EzThreadBase::status() & 0x7) == 0) ) {
+            EzPromise<R> *promise = new EzPromise<R>;
+            EzFuture<R> future = promise->get_future();
+            m_func = NULL;
+            m_invoke = &EzThread<TYPE>::template invoke_async<R>;
+            m_rfunc = reinterpret_cast<void (*)()>(func);
+            m_promise = promise;
+            m_arg = arg;
+            EZ_MEM_BARRIER();
+            if (EzThreadBase::run() == 0) return future;
+            m_invoke = NULL;
+            m_promise = NULL;
+            delete promise;
+        }
+        return EzFuture<R>();
+    };
+    virtual int rerun() {
+        if ( (m_func != NULL) && ((EzThreadBase::status() & 0x7) == 0) ) {
+            return EzThreadBase::run();
+        }
+        return -1;
+    };
+    virtual int status() { return EzThreadBase::status(); };
+    virtual int wait_until_state(int mask, long timeout_ms = -1) {
+        return EzThreadBase::wait_until_state(mask, timeout_ms);
+    };
+    virtual int set_thread_attr(const EzThreadAttr& attr) {
+        return EzThreadBase::set_thread_attr(attr);
+    };
+    virtual size_t stack_high_water() const { return EzThreadBase::stack_high_water(); };
+    virtual const EzThreadStats& thread_stats() const { return EzThreadBase::thread_stats(); };
+    virtual int wait() { return EzThreadBase::join(); };
+    virtual int wait_for(long timeout_ms) { return EzThreadBase::join_for(timeout_ms); };
+    virtual bool request_stop() { return EzThreadBase::request_stop(); };
+    virtual bool stop_requested() const { return EzThreadBase::stop_requested(); };
+    virtual void set_stop_callback(void (*func)(void *), void *arg) {
+        EzThreadBase::set_stop_callback(func, arg);
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzRing
+        A growable FIFO ring buffer. It is NOT thread-safe by itself;
+        the owner guards it with a mutex.
+ *****************************************************************************/
+
+template <typename T>
+class EzRing
+{
+  private:
+    EzRing(const EzRing& src);
+    EzRing& operator=(const EzRing& src);
+
+    T   *m_buf;
+    int  m_capacity;
+    int  m_head;
+    int  m_count;
+
+  public:
+    explicit EzRing(int capacity = 64) {
+        m_capacity = (capacity > 0 ? capacity : 1);
+        m_buf = new T[m_capacity];
+        m_head = m_count = 0;
+    };
+    ~EzRing() { delete [] m_buf; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: push                                                           */
+/*      Appends v at the tail. The buffer is doubled when it is full.         */
+/*      Return value :  true:success  false:allocation failure                */
+/* -------------------------------------------------------------------------- */
+    bool push(const T& v) {
+        if (m_count == m_capacity) {
+            T *buf = new T[m_capacity * 2];
+            if (buf == NULL) return false;
+            for (int i = 0; i < m_count; i++) {
+                buf[i] = m_buf[(m_head + i) % m_capacity];
+            }
+            delete [] m_buf;
+            m_buf = buf;
+            m_head = 0;
+            m_capacity *= 2;
+        }
+        m_buf[(m_head + m_count) % m_capacity] = v;
+        m_count++;
+        return true;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: pop                                                            */
+/*      Removes the head into v.                                              */
+/*      Return value :  true:success  false:empty                             */
+/* -------------------------------------------------------------------------- */
+    bool pop(T& v) {
+        if (m_count == 0) return false;
+        v = m_buf[m_head];
+        m_head = (m_head + 1) % m_capacity;
+        m_count--;
+        return true;
+    };
+
+    int  size() const { return m_count; };
+    bool empty() const { return (m_count == 0); };
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzThreadPool
+ *****************************************************************************/
+
+template <typename TYPE>
+class EzThreadPool
+{
+/* -------------- force EzThreadPool to be Noncopyable-class ---------------- */
+  private:
+
+    EzThreadPool(const EzThreadPool& src);
+    EzThreadPool& operator=(const EzThreadPool& src);
+
+/* ------------------------------ job queue --------------------------------- */
+
+    struct Job {
+        void (*func)(TYPE);
+        TYPE arg;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   Worker : a long-lived thread which runs jobs until shutdown().           */
+/* -------------------------------------------------------------------------- */
+
+    class Worker : public EzThreadBase {
+      public:
+        EzThreadPool *m_pool;
+        Worker() { m_pool = NULL; };
+        ~Worker() { join(); };
+      private:
+        void app() { m_pool->worker_main(this); };
+    };
+    friend class Worker;
+
+    Worker    *m_workers;
+    int        m_nworkers;
+
+    EzRing<Job> m_queue;     /* guarded by mtx_queue                   */
+    int        m_shutdown;   /* 1:shutdown() 2:shutdown_for() (guarded) */
+    EzMutex    mtx_queue;
+
+    VOLATILE_ eztoken_t m_signal;   /* bumped on submit()/shutdown() (guarded) */
+    VOLATILE_ eztoken_t m_idle;     /* number of parked workers               */
+    VOLATILE_ eztoken_t m_pending;  /* jobs submitted but not finished        */
+    VOLATILE_ eztoken_t m_waiters;  /* threads blocked in wait_all()          */
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  worker_main()                                                */
+/*       Pops a job and runs it. If the queue is empty, the worker parks on   */
+/*       m_signal. Remaining jobs are drained before the worker exits,        */
+/*       or discarded after shutdown_for(). The worker's arena is reset      */
+/*       after every job.                                                     */
+/* -------------------------------------------------------------------------- */
+    void worker_main(Worker *me) {
+        Job job;
+        eztoken_t sig;
+        int discard;
+
+        for (;;) {
+            mtx_queue.lock();
+            if (m_queue.pop(job)) {
+                discard = (m_shutdown == 2);
+                mtx_queue.unlock();
+
+                if (!discard) {
+                    job.func(job.arg);
+                    me->reset_arena();
+                }
+
+                if (EzAtomic::fetch_add(&m_pending, (eztoken_t)-1) == 1) {
+                    EzAtomic::fence();      /* see setThreadState() */
+                    if (EzAtomic::load_relaxed(&m_waiters)) EzMutex::unpark(&m_pending, EZ_UNPARK_ALL);
+                }
+                continue;
+            }
+            if (m_shutdown) {
+                mtx_queue.unlock();
+                break;
+            }
+            sig = m_signal;
+            EzAtomic::fetch_add(&m_idle, (eztoken_t)1);
+            mtx_queue.unlock();
+
+            EzMutex::park(&m_signal, sig);
+            EzAtomic::fetch_add(&m_idle, (eztoken_t)-1);
+        }
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR                                                              */
+/*       nthreads <= 0 : one worker per processor                             */
+/*       placement     : EZPLACE_NONE, EZPLACE_CPU or EZPLACE_NODE            */
+/*       attr          : attributes given to every worker (stack size,        */
+/*                       profiling...). The placement overrides its CPU set. */
+/* -------------------------------------------------------------------------- */
+
+    explicit EzThreadPool(int nthreads = 0, int placement = EZPLACE_NONE,
+                          const EzThreadAttr& worker_attr = EzThreadAttr())
+        : mtx_queue(EZMTX_ADAPTIVE, "EzThreadPool.queue") {
+        EzThreadAttr attr(worker_attr);
+        if (nthreads <= 0) nthreads = EzThreadBase::cpu_count();
+        m_shutdown = 0;
+        m_signal = m_idle = m_pending = m_waiters = 0;
+        m_nworkers = 0;
+        m_workers = new Worker[nthreads];
+        EZ_MEM_BARRIER();
+        for (int i = 0; i < nthreads; i++) {
+            m_workers[i].m_pool = this;
+            if (placement != EZPLACE_NONE) attr.place(placement, i);
+            m_workers[i].set_thread_attr(attr);
+            if (m_workers[i].run()) break;   /* thread creation failure */
+            m_nworkers++;
+        }
+    };
+
+    virtual ~EzThreadPool() {
+        shutdown();
+        delete [] m_workers;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: submit                                                         */
+/*      Queues func(arg) to be run on one of the workers.                     */
+/*      Return value :  0:success  -1:error (shut down or no worker)          */
+/* -------------------------------------------------------------------------- */
+
+    int submit(void(*func)(TYPE), TYPE arg) {
+        Job job;
+        int idle;
+        if (func == NULL) return -1;
+        job.func = func;
+        job.arg = arg;
+        mtx_queue.lock();
+        if (m_shutdown || m_nworkers == 0 || !m_queue.push(job)) {
+            mtx_queue.unlock();
+            return -1;
+        }
+        EzAtomic::fetch_add(&m_pending, (eztoken_t)1);
+        m_signal++;
+        idle = EzAtomic::load_relaxed(&m_idle);
+        mtx_queue.unlock();
+        if (idle) EzMutex::unpark(&m_signal, 1);
+        return 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait_all                                                       */
+/*      Blocks until every submitted job has finished.                        */
+/*      Do not call it from a job, or it waits for itself.                    */
+/* -------------------------------------------------------------------------- */
+
+    void wait_all() {
+        eztoken_t n;
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+        while ((n = EzAtomic::load(&m_pending)) != 0) {
+            EzMutex::park(&m_pending, n);
+        }
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: shutdown                                                       */
+/*      Stops accepting jobs, lets the workers finish the queued jobs and     */
+/*      joins them. It is called automatically at the object deletion.        */
+/* -------------------------------------------------------------------------- */
+
+    void shutdown() {
+        mtx_queue.lock();
+        if (m_shutdown == 0) m_shutdown = 1;
+        m_signal++;
+        mtx_queue.unlock();
+        EzMutex::unpark(&m_signal, EZ_UNPARK_ALL);
+        for (int i = 0; i < m_nworkers; i++) m_workers[i].join();
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: shutdown_for                                                   */
+/*      Stops accepting jobs, discards the queued jobs which have not         */
+/*      started, requests a stop of every worker (running jobs can see it    */
+/*      with EzThreadBase::current_stop_requested()), and joins the workers  */
+/*      within timeout_ms milliseconds in total.                              */
+/*      Return value :  0:success  -1:timeout (some workers still running;    */
+/*                      the destructor joins them)                            */
+/* -------------------------------------------------------------------------- */
+
+    int shutdown_for(long timeout_ms) {
+        ezint64_t deadline = EzMutex::nanotime() + (ezint64_t)timeout_ms * 1000000;
+        ezint64_t rest;
+        int ret = 0;
+        mtx_queue.lock();
+        m_shutdown = 2;
+        m_signal++;
+        mtx_queue.unlock();
+        EzMutex::unpark(&m_signal, EZ_UNPARK_ALL);
+        for (int i = 0; i < m_nworkers; i++) m_workers[i].request_stop();
+        for (int i = 0; i < m_nworkers; i++) {
+            rest = deadline - EzMutex::nanotime();
+            if (m_workers[i].join_for(rest > 0 ? (long)((rest + 999999) / 1000000) : 0)) ret = -1;
+        }
+        return ret;
+    };
+
+    int size() const { return m_nworkers; };
+    int pending() const { return (int)EzAtomic::load(&m_pending); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: worker_stats                                                   */
+/*      The profile of the i-th worker (see EzThreadAttr::set_profiling()).   */
+/*      The CPU time and the context switches are filled after shutdown().    */
+/* -------------------------------------------------------------------------- */
+
+    const EzThreadStats& worker_stats(int i) const {
+        return m_workers[i].thread_stats();
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzTaskGroup
+        Counts the unfinished tasks spawned with it.
+        See EzWorkStealPool::spawn() and EzWorkStealPool::wait().
+ *****************************************************************************/
+
+class EzTaskGroup
+{
+  private:
+    EzTaskGroup(const EzTaskGroup& src);
+    EzTaskGroup& operator=(const EzTaskGroup& src);
+
+    VOLATILE_ eztoken_t m_count;    /* unfinished tasks          */
+    VOLATILE_ eztoken_t m_waiters;  /* threads parked in park()  */
+
+  public:
+    EzTaskGroup() { m_count = m_waiters = 0; };
+    ~EzTaskGroup() {};
+
+    void add() { EzAtomic::fetch_add(&m_count, (eztoken_t)1); };
+
+    void done() {
+        if (EzAtomic::fetch_add(&m_count, (eztoken_t)-1) == 1) {
+            EzAtomic::fence();      /* order the count before the waiters */
+            if (EzAtomic::load_relaxed(&m_waiters)) EzMutex::unpark(&m_count, EZ_UNPARK_ALL);
+        }
+    };
+
+    int pending() const { return (int)EzAtomic::load(&m_count); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: park                                                           */
+/*      Blocks until pending() changes from n (or returns spuriously).        */
+/* -------------------------------------------------------------------------- */
+    void park(int n) {
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+        if (EzAtomic::load(&m_count) == (eztoken_t)n) EzMutex::park(&m_count, (eztoken_t)n);
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+    };
+};
+
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzWorkStealPool
+        Each worker owns a Chase-Lev deque. Tasks spawned from a running
+        task go to the local deque, and idle workers steal from the other
+        end of a random victim's deque.
+        TYPE should be a plain value such as a pointer or an integer,
+        because a thief copies a task while its owner may overwrite it.
+ *****************************************************************************/
+
+#ifndef EZWS_SPIN_COUNT
+#  define EZWS_SPIN_COUNT   64    /* steal rounds before an idle worker parks */
+#endif
+
+template <typename TYPE>
+class EzWorkStealPool
+{
+/* ------------- force EzWorkStealPool to be Noncopyable-class -------------- */
+  private:
+
+    EzWorkStealPool(const EzWorkStealPool& src);
+    EzWorkStealPool& operator=(const EzWorkStealPool& src);
+
+    struct Task {
+        void (*func)(TYPE);
+        TYPE arg;
+        EzTaskGroup *group;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   Deque : Chase-Lev work-stealing deque.                                   */
+/*       The owner worker push()es and pop()s at the bottom, and the other    */
+/*       threads steal() from the top. Replaced arrays are kept until the     */
+/*       deque is destroyed because a thief may still read them.             */
+/* -------------------------------------------------------------------------- */
+
+    struct Array {
+        long   mask;
+        Task  *buf;
+        Array *prev;   /* retired array */
+    };
+
+    class Deque {
+      private:
+        Deque(const Deque& src);
+        Deque& operator=(const Deque& src);
+
+        VOLATILE_ long     m_top;
+        VOLATILE_ long     m_bottom;
+        Array * VOLATILE_  m_array;
+
+        static Array *new_array(long capacity, Array *prev) {
+            Array *a = new Array;
+            a->mask = capacity - 1;
+            a->buf = new Task[capacity];
+            a->prev = prev;
+            return a;
+        };
+
+      public:
+        Deque() { m_top = m_bottom = 0; m_array = new_array(256, NULL); };
+        ~Deque() {
+            Array *a = m_array;
+            while (a) {
+                Array *prev = a->prev;
+                delete [] a->buf;
+                delete a;
+                a = prev;
+            }
+        };
+
+        void push(const Task& task) {
+            long b = EzAtomic::load_relaxed(&m_bottom);
+            long t = EzAtomic::load(&m_top);
+            Array *a = EzAtomic::load_relaxed(&m_array);
+            if (b - t > a->mask) {
+                Array *g = new_array((a->mask + 1) * 2, a);
+                for (long i = t; i < b; i++) g->buf[i & g->mask] = a->buf[i & a->mask];
+                EzAtomic::store(&m_array, g);
+                a = g;
+            }
+            a->buf[b & a->mask] = task;
+            EzAtomic::store(&m_bottom, b + 1);
+        };
+
+        bool pop(Task& task) {
+            long b = EzAtomic::load_relaxed(&m_bottom) - 1;
+            long t;
+            Array *a = EzAtomic::load_relaxed(&m_array);
+            EzAtomic::store_relaxed(&m_bottom, b);
+            EzAtomic::fence();
+            t = EzAtomic::load_relaxed(&m_top);
+            if (t > b) {                  /* empty */
+                EzAtomic::store_relaxed(&m_bottom, b + 1);
+                return false;
+            }
+            task = a->buf[b & a->mask];
+            if (t == b) {                 /* the last one: race with thieves */
+                bool won = (EzAtomic::cas(&m_top, t, t + 1) == t);
+                EzAtomic::store_relaxed(&m_bottom, b + 1);
+                return won;
+            }
+            return true;
+        };
+
+        bool steal(Task& task) {
+            long t = EzAtomic::load(&m_top);
+            EzAtomic::fence();
+            long b = EzAtomic::load(&m_bottom);
+            if (t >= b) return false;     /* empty */
+            Array *a = EzAtomic::load(&m_array);
+            task = a->buf[t & a->mask];
+            return (EzAtomic::cas(&m_top, t, t + 1) == t);
+        };
+
+        bool empty() const {
+            return (EzAtomic::load(&m_top) >= EzAtomic::load(&m_bottom));
+        };
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   Worker : a long-lived thread which owns a deque.                         */
+/* -------------------------------------------------------------------------- */
+
+    class Worker : public EzThreadBase {
+      public:
+        EzWorkStealPool *m_pool;
+        Deque            m_deque;
+        unsigned long    m_seed;    /* for choosing a victim */
+        Worker() { m_pool = NULL; m_seed = 1; };
+        ~Worker() { join(); };
+      private:
+        void app() { m_pool->worker_main(this); };
+    };
+    friend class Worker;
+
+    Worker    *m_workers;
+    int        m_nworkers;
+
+    EzRing<Task> m_inject;           /* tasks spawned from outside (guarded) */
+    EzMutex    mtx_inject;
+    VOLATILE_ eztoken_t m_ninject;   /* m_inject.size() for a lock-free peek */
+    volatile int m_shutdown;
+
+    VOLATILE_ eztoken_t m_signal;    /* bumped to wake parked workers        */
+    VOLATILE_ eztoken_t m_idle;      /* number of parked workers             */
+    VOLATILE_ eztoken_t m_pending;   /* tasks spawned but not finished       */
+    VOLATILE_ eztoken_t m_waiters;   /* threads blocked in wait_all()        */
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  self()                                                       */
+/*       return value: the worker running on the calling thread, or NULL      */
+/* -------------------------------------------------------------------------- */
+    Worker *self() {
+        EzThreadBase *cur = EzThreadBase::current();
+        if (cur == NULL || m_nworkers == 0) return NULL;
+        const char *p  = reinterpret_cast<const char *>(cur);
+        const char *lo = reinterpret_cast<const char *>(static_cast<EzThreadBase *>(&m_workers[0]));
+        const char *hi = reinterpret_cast<const char *>(static_cast<EzThreadBase *>(&m_workers[m_nworkers - 1]));
+        if (p < lo || p > hi || (size_t)(p - lo) % sizeof(Worker) != 0) return NULL;
+        return &m_workers[(size_t)(p - lo) / sizeof(Worker)];
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  find_task()                                                  */
+/*       Tries the own deque, then random victims, then the inject queue.     */
+/* -------------------------------------------------------------------------- */
+    bool find_task(Worker *me, Task& task) {
+        if (me && me->m_deque.pop(task)) return true;
+
+        if (m_nworkers > 1 || me == NULL) {
+            unsigned long x = (me ? me->m_seed : (unsigned long)(size_t)&task);
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;       /* xorshift */
+            if (me) me->m_seed = x;
+            int start = (int)(x % (unsigned long)m_nworkers);
+            for (int k = 0; k < m_nworkers; k++) {
+                Worker *victim = &m_workers[(start + k) % m_nworkers];
+                if (victim != me && victim->m_deque.steal(task)) return true;
+            }
+        }
+
+        if (EzAtomic::load_relaxed(&m_ninject)) {
+            bool found;
+            mtx_inject.lock();
+            found = m_inject.pop(task);
+            if (found) m_ninject--;
+            mtx_inject.unlock();
+            if (found) return true;
+        }
+        return false;
+    };
+
+    void execute(const Task& task) {
+        task.func(task.arg);
+        if (task.group) task.group->done();
+        finish_pending();
+    };
+
+    void finish_pending() {         /* wakes wait_all() at the last task */
+        if (EzAtomic::fetch_add(&m_pending, (eztoken_t)-1) == 1) {
+            EzAtomic::fence();      /* order m_pending before m_waiters */
+            if (EzAtomic::load_relaxed(&m_waiters)) EzMutex::unpark(&m_pending, EZ_UNPARK_ALL);
+        }
+    };
+
+    void notify() {
+        EzAtomic::fence();
+        if (EzAtomic::load_relaxed(&m_idle)) {
+            EzAtomic::fetch_add(&m_signal, (eztoken_t)1);
+            EzMutex::unpark(&m_signal, 1);
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  worker_main()                                                */
+/*       Runs tasks while any can be found. An idle worker keeps stealing     */
+/*       for a while, then parks on m_signal.                                 */
+/* -------------------------------------------------------------------------- */
+    void worker_main(Worker *me) {
+        Task task;
+        eztoken_t sig;
+        int spins = 0;
+
+        me->m_seed = (unsigned long)(me - m_workers) * 2654435761UL + 1;
+        for (;;) {
+            if (find_task(me, task)) {
+                execute(task);
+                spins = 0;
+                continue;
+            }
+            if (EzAtomic::load(&m_shutdown)) break;
+            if (++spins < EZWS_SPIN_COUNT) {
+                EzAtomic::relax();
+                continue;
+            }
+            sig = EzAtomic::load(&m_signal);
+            EzAtomic::fetch_add(&m_idle, (eztoken_t)1);
+            if (find_task(me, task)) {
+                EzAtomic::fetch_add(&m_idle, (eztoken_t)-1);
+                execute(task);
+                spins = 0;
+                continue;
+            }
+            if (!EzAtomic::load(&m_shutdown)) EzMutex::park(&m_signal, sig);
+            EzAtomic::fetch_add(&m_idle, (eztoken_t)-1);
+            spins = 0;
+        }
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR                                                              */
+/*       nthreads <= 0 : one worker per processor                             */
+/*       placement     : EZPLACE_NONE, EZPLACE_CPU or EZPLACE_NODE            */
+/*       attr          : attributes given to every worker (stack size,        */
+/*                       profiling...). The placement overrides its CPU set. */
+/* -------------------------------------------------------------------------- */
+
+    explicit EzWorkStealPool(int nthreads = 0, int placement = EZPLACE_NONE,
+                             const EzThreadAttr& worker_attr = EzThreadAttr())
+        : mtx_inject(EZMTX_ADAPTIVE, "EzWorkStealPool.inject") {
+        EzThreadAttr attr(worker_attr);
+        if (nthreads <= 0) nthreads = EzThreadBase::cpu_count();
+        m_ninject = 0;
+        m_shutdown = 0;
+        m_signal = m_idle = m_pending = m_waiters = 0;
+        m_workers = new Worker[nthreads];
+        m_nworkers = nthreads;
+        for (int i = 0; i < nthreads; i++) m_workers[i].m_pool = this;
+        EZ_MEM_BARRIER();
+        for (int i = 0; i < nthreads; i++) {
+            if (placement != EZPLACE_NONE) attr.place(placement, i);
+            m_workers[i].set_thread_attr(attr);
+            if (m_workers[i].run()) {   /* thread creation failure */
+                m_nworkers = i;
+                break;
+            }
+        }
+    };
+
+    virtual ~EzWorkStealPool() {
+        shutdown();
+        delete [] m_workers;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: spawn                                                          */
+/*      Queues func(arg). Called from a worker (i.e. from a running task),    */
+/*      the task goes to the worker's own deque. Otherwise it goes to the     */
+/*      shared inject queue. If group is given, the task is counted in it.    */
+/*      Return value :  0:success  -1:error (shut down or no worker)          */
+/* -------------------------------------------------------------------------- */
+
+    int spawn(void(*func)(TYPE), TYPE arg, EzTaskGroup *group = NULL) {
+        Task task;
+        Worker *me;
+        if (func == NULL || EzAtomic::load(&m_shutdown) || m_nworkers == 0) return -1;
+        task.func = func;
+        task.arg = arg;
+        task.group = group;
+        if (group) group->add();
+        EzAtomic::fetch_add(&m_pending, (eztoken_t)1);
+
+        if ((me = self()) != NULL) {
+            me->m_deque.push(task);
+        } else {
+            bool ok;
+            mtx_inject.lock();
+            ok = m_inject.push(task);
+            if (ok) m_ninject++;
+            mtx_inject.unlock();
+            if (!ok) {
+                if (group) group->done();
+                finish_pending();
+                return -1;
+            }
+        }
+        notify();
+        return 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait                                                           */
+/*      Blocks until all the tasks in group finish. The caller runs other     */
+/*      tasks meanwhile, so a task can spawn subtasks and wait for them       */
+/*      (fork-join) without blocking its worker.                              */
+/* -------------------------------------------------------------------------- */
+
+    void wait(EzTaskGroup& group) {
+        Worker *me = self();
+        Task task;
+        int n, spins = 0;
+        while ((n = group.pending()) != 0) {
+            if (find_task(me, task)) {
+                execute(task);
+                spins = 0;
+            } else if (++spins < EZWS_SPIN_COUNT) {
+                EzAtomic::relax();
+            } else {
+                group.park(n);
+                spins = 0;
+            }
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait_all                                                       */
+/*      Blocks until every spawned task has finished.                         */
+/*      Do not call it from a task; use wait() with an EzTaskGroup instead.   */
+/* -------------------------------------------------------------------------- */
+
+    void wait_all() {
+        eztoken_t n;
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+        while ((n = EzAtomic::load(&m_pending)) != 0) {
+            EzMutex::park(&m_pending, n);
+        }
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: shutdown                                                       */
+/*      Finishes the spawned tasks and joins the workers.                     */
+/*      It is called automatically at the object deletion.                    */
+/* -------------------------------------------------------------------------- */
+
+    void shutdown() {
+        if (m_nworkers > 0) wait_all();
+        EzAtomic::store(&m_shutdown, 1);
+        EzAtomic::fetch_add(&m_signal, (eztoken_t)1);
+        EzMutex::unpark(&m_signal, EZ_UNPARK_ALL);
+        for (int i = 0; i < m_nworkers; i++) m_workers[i].join();
+    };
+
+    int size() const { return m_nworkers; };
+    int pending() const { return (int)EzAtomic::load(&m_pending); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: worker_stats                                                   */
+/*      The profile of the i-th worker (see EzThreadAttr::set_profiling()).   */
+/*      The CPU time and the context switches are filled after shutdown().    */
+/* -------------------------------------------------------------------------- */
+
+    const EzThreadStats& worker_stats(int i) const {
+        return m_workers[i].thread_stats();
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzTaskGraph
+        A DAG of 'void funcname(TYPE)' tasks run on an EzWorkStealPool.
+        Each node has an atomic counter of unfinished predecessors; the
+        task which drops it to zero makes the node runnable at once, so
+        no stage waits for the slowest task of the previous one.
+        The successor lists are built at the first run after a change,
+        and later runs only reset the counters. Each run records the
+        start and the duration of every node, and the critical path.
+ *****************************************************************************/
+
+template <typename TYPE>
+class EzTaskGraph
+{
+  private:
+    EzTaskGraph(const EzTaskGraph& src);
+    EzTaskGraph& operator=(const EzTaskGraph& src);
+
+    struct Node {
+        void (*func)(TYPE);
+        TYPE arg;
+        EzTaskGraph *graph;
+        int npred;            /* number of predecessors                  */
+        int succ;             /* first successor in m_succ               */
+        int nsucc;
+        VOLATILE_ eztoken_t remaining;  /* predecessors not finished yet */
+        ezint64_t start_ns;   /* of the last run, from its start         */
+        ezint64_t end_ns;
+        ezint64_t path_ns;    /* longest path which ends at this node    */
+        int path_prev;        /* the previous node on that path, or -1   */
+    };
+    struct Edge {
+        int from, to;
+    };
+
+    Node  *m_nodes;
+    int    m_nnodes, m_node_cap;
+    Edge  *m_edges;
+    int    m_nedges, m_edge_cap;
+    int   *m_succ;            /* successors, grouped by node             */
+    int   *m_order;           /* a topological order, the roots first    */
+    int    m_built;           /* m_succ and m_order match the graph      */
+    int    m_path_done;       /* path_ns and path_prev are computed      */
+    int    m_path_last;       /* the last node of the critical path      */
+    ezint64_t m_t0;           /* nanotime() at the start of the run      */
+    ezint64_t m_elapsed;
+    EzWorkStealPool<void *> *m_pool;
+    EzTaskGroup m_group;
+
+    template <typename T>
+    static int grow(T *&arr, int n, int &cap) {
+        if (n < cap) return 0;
+        int ncap = cap ? cap * 2 : 16;
+        T *p = new T[ncap];
+        if (p == NULL) return -1;
+        for (int i = 0; i < n; i++) p[i] = arr[i];
+        delete [] arr;
+        arr = p;
+        cap = ncap;
+        return 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  build()                                                      */
+/*       Groups the edges by their source node and sorts the nodes            */
+/*       topologically (Kahn's algorithm).                                    */
+/*       Return value :  0:success  -1:cycle or allocation failure            */
+/* -------------------------------------------------------------------------- */
+    int build() {
+        int i, head, tail;
+
+        delete [] m_succ;
+        delete [] m_order;
+        m_succ = new int[m_nedges + 1];
+        m_order = new int[m_nnodes + 1];
+        if (m_succ == NULL || m_order == NULL) return -1;
+
+        for (i = 0; i < m_nnodes; i++) {
+            m_nodes[i].graph = this;
+            m_nodes[i].npred = m_nodes[i].nsucc = 0;
+        }
+        for (i = 0; i < m_nedges; i++) {
+            m_nodes[m_edges[i].from].nsucc++;
+            m_nodes[m_edges[i].to].npred++;
+        }
+        for (head = i = 0; i < m_nnodes; i++) {
+            m_nodes[i].succ = head;
+            head += m_nodes[i].nsucc;
+            m_nodes[i].nsucc = 0;
+        }
+        for (i = 0; i < m_nedges; i++) {
+            Node *from = &m_nodes[m_edges[i].from];
+            m_succ[from->succ + from->nsucc++] = m_edges[i].to;
+        }
+
+        /* m_order is the queue; remaining counts the unvisited predecessors */
+        for (tail = i = 0; i < m_nnodes; i++) {
+            m_nodes[i].remaining = m_nodes[i].npred;
+            if (m_nodes[i].npred == 0) m_order[tail++] = i;
+        }
+        for (head = 0; head < tail; head++) {
+            Node *n = &m_nodes[m_order[head]];
+            for (i = 0; i < n->nsucc; i++) {
+                int s = m_succ[n->succ + i];
+                if (--m_nodes[s].remaining == 0) m_order[tail++] = s;
+            }
+        }
+        if (tail != m_nnodes) return -1;   /* cycle */
+        m_built = 1;
+        return 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  exec()                                                       */
+/*       Runs a node and releases its successors. The last successor made     */
+/*       runnable is run next by the same worker, the others are spawned.    */
+/* -------------------------------------------------------------------------- */
+    static void exec(void *p) {
+        Node *node = static_cast<Node *>(p);
+        EzTaskGraph *g = node->graph;
+        while (node) {
+            Node *next = NULL;
+            node->start_ns = EzMutex::nanotime() - g->m_t0;
+            node->func(node->arg);
+            node->end_ns = EzMutex::nanotime() - g->m_t0;
+            for (int i = 0; i < node->nsucc; i++) {
+                Node *s = &g->m_nodes[g->m_succ[node->succ + i]];
+                if (EzAtomic::fetch_add(&s->remaining, (eztoken_t)-1) == 1) {
+                    if (next) g->dispatch(next);
+                    next = s;
+                }
+            }
+            node = next;
+        }
+    };
+
+    void dispatch(Node *node) {
+        if (m_pool->spawn(&exec, static_cast<void *>(node), &m_group)) {
+            exec(node);   /* the pool is shut down: run it here */
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  compute_path()                                               */
+/*       Longest path by the measured durations, in topological order.        */
+/* -------------------------------------------------------------------------- */
+    void compute_path() {
+        int i, k;
+        if (m_path_done) return;
+        m_path_last = -1;
+        for (i = 0; i < m_nnodes; i++) {
+            m_nodes[i].path_ns = 0;
+            m_nodes[i].path_prev = -1;
+        }
+        for (k = 0; k < m_nnodes && m_built; k++) {
+            Node *n = &m_nodes[m_order[k]];
+            n->path_ns += n->end_ns - n->start_ns;
+            for (i = 0; i < n->nsucc; i++) {
+                Node *s = &m_nodes[m_succ[n->succ + i]];
+                if (s->path_prev < 0 || n->path_ns > s->path_ns) {
+                    s->path_ns = n->path_ns;
+                    s->path_prev = m_order[k];
+                }
+            }
+            if (m_path_last < 0 || n->path_ns > m_nodes[m_path_last].path_ns) {
+                m_path_last = m_order[k];
+            }
+        }
+        m_path_done = 1;
+    };
+
+  public:
+
+    EzTaskGraph() {
+        m_nodes = NULL;
+        m_edges = NULL;
+        m_succ = m_order = NULL;
+        m_nnodes = m_node_cap = m_nedges = m_edge_cap = 0;
+        m_built = m_path_done = 0;
+        m_path_last = -1;
+        m_t0 = m_elapsed = 0;
+        m_pool = NULL;
+    };
+
+    virtual ~EzTaskGraph() {
+        delete [] m_nodes;
+        delete [] m_edges;
+        delete [] m_succ;
+        delete [] m_order;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: add_node / add_edge                                            */
+/*      add_node() adds func(arg) and returns its id (0, 1, 2, ...),          */
+/*      or -1 on error. add_edge() makes 'to' wait for 'from'.                */
+/*      Do not change the graph while it runs.                                */
+/*      add_edge() return value :  0:success  -1:error (bad id)               */
+/* -------------------------------------------------------------------------- */
+
+    int add_node(void(*func)(TYPE), TYPE arg) {
+        if (func == NULL || grow(m_nodes, m_nnodes, m_node_cap)) return -1;
+        Node& n = m_nodes[m_nnodes];
+        n.func = func;
+        n.arg = arg;
+        n.graph = this;
+        n.npred = n.succ = n.nsucc = 0;
+        n.remaining = 0;
+        n.start_ns = n.end_ns = n.path_ns = 0;
+        n.path_prev = -1;
+        m_built = m_path_done = 0;
+        return m_nnodes++;
+    };
+
+    int add_edge(int from, int to) {
+        if (from < 0 || from >= m_nnodes || to < 0 || to >= m_nnodes || from == to) return -1;
+        if (grow(m_edges, m_nedges, m_edge_cap)) return -1;
+        m_edges[m_nedges].from = from;
+        m_edges[m_nedges].to = to;
+        m_nedges++;
+        m_built = m_path_done = 0;
+        return 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: set_arg / clear                                                */
+/*      set_arg() changes the argument of a node for the next run.            */
+/*      clear() removes all the nodes and edges, keeping the memory.         */
+/* -------------------------------------------------------------------------- */
+
+    int set_arg(int id, TYPE arg) {
+        if (id < 0 || id >= m_nnodes) return -1;
+        m_nodes[id].arg = arg;
+        return 0;
+    };
+
+    void clear() {
+        m_nnodes = m_nedges = 0;
+        m_built = m_path_done = 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: run                                                            */
+/*      Runs every node once on the pool and blocks until all finish.         */
+/*      The calling thread runs tasks meanwhile. A graph must not be run     */
+/*      twice at the same time, nor from one of its own tasks.               */
+/*      Return value :  0:success  -1:error (the graph has a cycle)          */
+/* -------------------------------------------------------------------------- */
+
+    int run(EzWorkStealPool<void *>& pool) {
+        int i;
+        if (!m_built && build()) return -1;
+        for (i = 0; i < m_nnodes; i++) {
+            m_nodes[i].remaining = m_nodes[i].npred;
+            m_nodes[i].start_ns = m_nodes[i].end_ns = 0;
+        }
+        m_pool = &pool;
+        m_path_done = 0;
+        m_t0 = EzMutex::nanotime();
+        for (i = 0; i < m_nnodes && m_nodes[m_order[i]].npred == 0; i++) {
+            dispatch(&m_nodes[m_order[i]]);
+        }
+        pool.wait(m_group);
+        m_elapsed = EzMutex::nanotime() - m_t0;
+        return 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: timings of the last run (in nanoseconds)                       */
+/*      elapsed_ns()       : wall time of run()                               */
+/*      node_start_ns(id)  : start of the node, from the start of run()       */
+/*      node_time_ns(id)   : duration of the node                             */
+/* -------------------------------------------------------------------------- */
+
+    ezint64_t elapsed_ns() const { return m_elapsed; };
+
+    ezint64_t node_start_ns(int id) const {
+        return (id >= 0 && id < m_nnodes) ? m_nodes[id].start_ns : 0;
+    };
+
+    ezint64_t node_time_ns(int id) const {
+        return (id >= 0 && id < m_nnodes) ? m_nodes[id].end_ns - m_nodes[id].start_ns : 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: critical_path / critical_path_ns                               */
+/*      The chain of dependent nodes with the largest total duration in the   */
+/*      last run: the lower bound of elapsed_ns() on any number of workers.  */
+/*      critical_path() stores up to max ids into ids, from the first node,  */
+/*      and returns the number of nodes on the path.                          */
+/* -------------------------------------------------------------------------- */
+
+    int critical_path(int *ids, int max) {
+        int n = 0, k, i;
+        compute_path();
+        for (i = m_path_last; i >= 0; i = m_nodes[i].path_prev) n++;
+        for (k = n, i = m_path_last; i >= 0; i = m_nodes[i].path_prev) {
+            if (--k < max && ids) ids[k] = i;
+        }
+        return n;
+    };
+
+    ezint64_t critical_path_ns() {
+        compute_path();
+        return (m_path_last >= 0) ? m_nodes[m_path_last].path_ns : 0;
+    };
+
+    int size() const { return m_nnodes; };
+    int edges() const { return m_nedges; };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzTimerQueue
+        Runs 'void funcname(TYPE)' callbacks at given times, one-shot or at
+        a fixed rate, on a single thread. The deadlines are kept in a binary
+        min-heap on the nanotime() clock, so thousands of timers cost one
+        thread. The thread parks until the earliest deadline and finishes
+        the wait with EzMutex::nanosleep_until().
+        Callbacks run one at a time; a slow callback delays the others.
+ *****************************************************************************/
+
+template <typename TYPE>
+class EzTimerQueue
+{
+  private:
+    EzTimerQueue(const EzTimerQueue& src);
+    EzTimerQueue& operator=(const EzTimerQueue& src);
+
+    struct Timer {
+        ezint64_t due;       /* nanotime() of the next run     */
+        ezint64_t period;    /* 0 : one-shot                   */
+        void (*func)(TYPE);
+        TYPE arg;
+        long id;
+        int  index;          /* position in m_heap             */
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   Worker : the thread which runs the callbacks until shutdown().           */
+/* -------------------------------------------------------------------------- */
+
+    class Worker : public EzThreadBase {
+      public:
+        EzTimerQueue *m_queue;
+        Worker() { m_queue = NULL; };
+        ~Worker() { join(); };
+      private:
+        void app() { m_queue->worker_main(); };
+    };
+    friend class Worker;
+
+    Worker     m_worker;
+    Timer    **m_heap;       /* guarded by mtx_heap             */
+    int        m_count;
+    int        m_capacity;
+    long       m_next_id;
+    long       m_running;    /* id of the running callback, 0 : none */
+    int        m_shutdown;
+    EzMutex    mtx_heap;
+
+    VOLATILE_ eztoken_t m_signal;   /* bumped when the earliest deadline changes */
+    VOLATILE_ eztoken_t m_done;     /* bumped after each callback               */
+    VOLATILE_ eztoken_t m_waiters;  /* threads blocked in cancel()              */
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  heap_up() / heap_down() / heap_remove()                      */
+/*       Binary min-heap on Timer::due. Called with mtx_heap held.            */
+/* -------------------------------------------------------------------------- */
+    void heap_set(int i, Timer *t) {
+        m_heap[i] = t;
+        t->index = i;
+    };
+
+    void heap_up(int i) {
+        Timer *t = m_heap[i];
+        while (i > 0 && m_heap[(i - 1) / 2]->due > t->due) {
+            heap_set(i, m_heap[(i - 1) / 2]);
+            i = (i - 1) / 2;
+        }
+        heap_set(i, t);
+    };
+
+    void heap_down(int i) {
+        Timer *t = m_heap[i];
+        int c;
+        while ((c = 2 * i + 1) < m_count) {
+            if (c + 1 < m_count && m_heap[c + 1]->due < m_heap[c]->due) c++;
+            if (m_heap[c]->due >= t->due) break;
+            heap_set(i, m_heap[c]);
+            i = c;
+        }
+        heap_set(i, t);
+    };
+
+    bool heap_push(Timer *t) {
+        if (m_count == m_capacity) {
+            Timer **heap = new Timer*[m_capacity * 2];
+            if (heap == NULL) return false;
+            for (int i = 0; i < m_count; i++) heap[i] = m_heap[i];
+            delete [] m_heap;
+            m_heap = heap;
+            m_capacity *= 2;
+        }
+        heap_set(m_count++, t);
+        heap_up(m_count - 1);
+        return true;
+    };
+
+    void heap_remove(int i) {
+        Timer *last = m_heap[--m_count];
+        if (i == m_count) return;
+        heap_set(i, last);
+        heap_up(i);
+        heap_down(last->index);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  idle()                                                       */
+/*       Waits for a change of m_signal, at most timeout_ns (< 0 : forever).  */
+/*       Where park() does not block, sleep in 1ms slices.                    */
+/* -------------------------------------------------------------------------- */
+    void idle(eztoken_t sig, ezint64_t timeout_ns) {
+#if defined(EZ_PARK_BLOCKS__)
+        if (timeout_ns < 0) EzMutex::park(&m_signal, sig);
+        else EzMutex::park(&m_signal, sig, timeout_ns);
+#else
+        (void)timeout_ns;
+        if (EzAtomic::load(&m_signal) == sig) EzMutex::millisleep(1);
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  worker_main()                                                */
+/*       Sleeps until the earliest deadline and runs the callback.            */
+/*       A fixed-rate timer is rescheduled before its callback runs, at a     */
+/*       multiple of its period from the first deadline, so it does not      */
+/*       drift. Ticks missed by a late callback are skipped.                 */
+/* -------------------------------------------------------------------------- */
+    void worker_main() {
+        Timer *t;
+        ezint64_t now;
+        eztoken_t sig;
+
+        mtx_heap.lock();
+        while (!m_shutdown) {
+            sig = m_signal;
+            if (m_count == 0) {
+                mtx_heap.unlock();
+                idle(sig, -1);
+                mtx_heap.lock();
+                continue;
+            }
+            t = m_heap[0];
+            now = EzMutex::nanotime();
+            if (t->due - now > EZ_SLEEP_SPIN_NS) {
+                ezint64_t rest = t->due - now - EZ_SLEEP_SPIN_NS;
+                mtx_heap.unlock();
+                idle(sig, rest);
+                mtx_heap.lock();
+                continue;
+            }
+            if (t->due > now) {
+                ezint64_t due = t->due;
+                mtx_heap.unlock();
+                EzMutex::nanosleep_until(due);
+                mtx_heap.lock();
+                continue;   /* the earliest timer may have changed meanwhile */
+            }
+
+            void (*func)(TYPE) = t->func;
+            TYPE arg = t->arg;
+            m_running = t->id;
+            if (t->period > 0) {
+                now = EzMutex::nanotime();
+                t->due += t->period;
+                if (t->due <= now) {
+                    t->due += ((now - t->due) / t->period + 1) * t->period;
+                }
+                heap_down(0);
+            } else {
+                heap_remove(0);
+                delete t;
+            }
+            mtx_heap.unlock();
+
+            func(arg);
+
+            mtx_heap.lock();
+            m_running = 0;
+            EzAtomic::fetch_add(&m_done, (eztoken_t)1);
+            if (EzAtomic::load_relaxed(&m_waiters)) {
+                EzMutex::unpark(&m_done, EZ_UNPARK_ALL);
+            }
+        }
+        mtx_heap.unlock();
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  add()                                                        */
+/* -------------------------------------------------------------------------- */
+    long add(void(*func)(TYPE), TYPE arg, ezint64_t due, ezint64_t period) {
+        Timer *t;
+        long id;
+        bool first;
+        if (func == NULL || period < 0) return -1;
+        if ((t = new Timer) == NULL) return -1;
+        t->due = due;
+        t->period = period;
+        t->func = func;
+        t->arg = arg;
+        mtx_heap.lock();
+        if (m_shutdown || !heap_push(t)) {
+            mtx_heap.unlock();
+            delete t;
+            return -1;
+        }
+        id = t->id = m_next_id++;
+        if (m_next_id <= 0) m_next_id = 1;
+        first = (t->index == 0);
+        if (first) m_signal++;
+        mtx_heap.unlock();
+        if (first) EzMutex::unpark(&m_signal, 1);
+        return id;
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR                                                              */
+/*       Starts the timer thread. attr is applied to it (e.g. EZSCHED_FIFO).  */
+/* -------------------------------------------------------------------------- */
+
+    explicit EzTimerQueue(const EzThreadAttr& attr = EzThreadAttr())
+        : mtx_heap(EZMTX_ADAPTIVE, "EzTimerQueue.heap") {
+        m_capacity = 64;
+        m_heap = new Timer*[m_capacity];
+        m_count = 0;
+        m_next_id = 1;
+        m_running = 0;
+        m_shutdown = 0;
+        m_signal = m_done = m_waiters = 0;
+        m_worker.m_queue = this;
+        m_worker.set_thread_attr(attr);
+        EZ_MEM_BARRIER();
+        if (m_worker.run()) m_shutdown = 1;   /* thread creation failure */
+    };
+
+    virtual ~EzTimerQueue() {
+        shutdown();
+        for (int i = 0; i < m_count; i++) delete m_heap[i];
+        delete [] m_heap;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: schedule / schedule_at                                         */
+/*      Runs func(arg) once after delay_ns nanoseconds, or at the nanotime()  */
+/*      value due_ns.                                                         */
+/*   FUNCTION: schedule_rate                                                  */
+/*      Runs func(arg) every period_ns nanoseconds, first after delay_ns.     */
+/*      Return value :  a timer id (> 0) for cancel(),  -1:error              */
+/* -------------------------------------------------------------------------- */
+
+    long schedule(void(*func)(TYPE), TYPE arg, ezint64_t delay_ns) {
+        return add(func, arg, EzMutex::nanotime() + delay_ns, 0);
+    };
+
+    long schedule_at(void(*func)(TYPE), TYPE arg, ezint64_t due_ns) {
+        return add(func, arg, due_ns, 0);
+    };
+
+    long schedule_rate(void(*func)(TYPE), TYPE arg, ezint64_t delay_ns, ezint64_t period_ns) {
+        if (period_ns <= 0) return -1;
+        return add(func, arg, EzMutex::nanotime() + delay_ns, period_ns);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: cancel                                                         */
+/*      Removes a timer. If its callback is running on the timer thread,     */
+/*      cancel() waits until it returns (except when called from the         */
+/*      callback itself), so the argument can be freed afterwards.           */
+/*      Return value :  0:cancelled  -1:not found (one-shot already run)      */
+/* -------------------------------------------------------------------------- */
+
+    int cancel(long id) {
+        int ret = -1;
+        eztoken_t done;
+        mtx_heap.lock();
+        for (int i = 0; i < m_count; i++) {
+            if (m_heap[i]->id == id) {
+                Timer *t = m_heap[i];
+                heap_remove(i);
+                delete t;
+                ret = 0;
+                break;
+            }
+        }
+        if (EzThreadBase::current() != &m_worker) {
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+            while (m_running == id) {
+                done = m_done;
+                mtx_heap.unlock();
+                EzMutex::park(&m_done, done);
+                mtx_heap.lock();
+            }
+            EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
+        }
+        mtx_heap.unlock();
+        return ret;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: shutdown                                                       */
+/*      Stops the timer thread. The timers which have not run are dropped.    */
+/*      It is automatically called at the object deletion.                    */
+/* -------------------------------------------------------------------------- */
+
+    void shutdown() {
+        mtx_heap.lock();
+        m_shutdown = 1;
+        m_signal++;
+        mtx_heap.unlock();
+        EzMutex::unpark(&m_signal, EZ_UNPARK_ALL);
+        m_worker.join();
+    };
+
+    int size() {
+        int n;
+        mtx_heap.lock();
+        n = m_count;
+        mtx_heap.unlock();
+        return n;
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzSpscQueue
+        A bounded lock-free ring buffer for one producer thread and one
+        consumer thread. N must be a power of 2.
+        The head (consumer) and tail (producer) indices sit on separate
+        cache lines, and each side caches the other side's index so that
+        it touches the other line only when the queue looks empty/full.
+        push()/pop() block when the queue is full/empty; the other side
+        wakes them (one fence per operation).
+ *****************************************************************************/
+
+#ifndef EZQ_SPIN_COUNT
+#  define EZQ_SPIN_COUNT    256   /* retries before a blocking call parks */
+#endif
+#ifndef EZQ_YIELD_COUNT
+#  define EZQ_YIELD_COUNT   64    /* EzMpmcQueue: yields before parking  */
+#endif
+
+template <typename T, int N>
+class EzSpscQueue
+{
+  private:
+    EzSpscQueue(const EzSpscQueue& src);
+    EzSpscQueue& operator=(const EzSpscQueue& src);
+
+    typedef char N_must_be_a_power_of_2[((N & (N - 1)) == 0 && N > 0) ? 1 : -1];
+    typedef unsigned eztoken_t index_t;   /* free-running, wraps around */
+
+    char                m_pad0[EZ_CACHE_LINE];
+    /* ----- consumer's line ----- */
+    VOLATILE_ eztoken_t m_head;           /* next slot to pop               */
+    index_t             m_tail_cache;     /* consumer's copy of m_tail      */
+    char                m_pad1[EZ_CACHE_LINE - sizeof(eztoken_t) - sizeof(index_t)];
+    /* ----- producer's line ----- */
+    VOLATILE_ eztoken_t m_tail;           /* next slot to push              */
+    index_t             m_head_cache;     /* producer's copy of m_head      */
+    char                m_pad2[EZ_CACHE_LINE - sizeof(eztoken_t) - sizeof(index_t)];
+    /* ----- waiting flags (written only by a blocking call) ----- */
+    VOLATILE_ eztoken_t m_cons_wait;      /* consumer parked on m_tail      */
+    VOLATILE_ eztoken_t m_prod_wait;      /* producer parked on m_head      */
+    char                m_pad3[EZ_CACHE_LINE - 2 * sizeof(eztoken_t)];
+
+    T m_buf[N];
+
+    void wake_consumer() {
+        EzAtomic::fence();
+        if (EzAtomic::load_relaxed(&m_cons_wait)) EzMutex::unpark(&m_tail, 1);
+    };
+    void wake_producer() {
+        EzAtomic::fence();
+        if (EzAtomic::load_relaxed(&m_prod_wait)) EzMutex::unpark(&m_head, 1);
+    };
+
+  public:
+    EzSpscQueue() {
+        m_head = m_tail = 0;
+        m_tail_cache = m_head_cache = 0;
+        m_cons_wait = m_prod_wait = 0;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: try_push / push_n  (producer only)                             */
+/*      try_push: Return value :  true:pushed  false:full                     */
+/*      push_n  : pushes up to n items. Return value : number of pushed items */
+/* -------------------------------------------------------------------------- */
+    bool try_push(const T& v) {
+        index_t t = (index_t)EzAtomic::load_relaxed(&m_tail);
+        if (t - m_head_cache == (index_t)N) {
+            m_head_cache = (index_t)EzAtomic::load(&m_head);
+            if (t - m_head_cache == (index_t)N) return false;
+        }
+        m_buf[t & (N - 1)] = v;
+        EzAtomic::store(&m_tail, (eztoken_t)(t + 1));
+        wake_consumer();
+        return true;
+    };
+
+    int push_n(const T *v, int n) {
+        index_t t = (index_t)EzAtomic::load_relaxed(&m_tail);
+        index_t room = (index_t)N - (t - m_head_cache);
+        if (room < (index_t)n) {
+            m_head_cache = (index_t)EzAtomic::load(&m_head);
+            room = (index_t)N - (t - m_head_cache);
+        }
+        if ((index_t)n > room) n = (int)room;
+        if (n <= 0) return 0;
+        for (int i = 0; i < n; i++) m_buf[(t + i) & (N - 1)] = v[i];
+        EzAtomic::store(&m_tail, (eztoken_t)(t + n));
+        wake_consumer();
+        return n;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: try_pop / pop_n  (consumer only)                               */
+/*      try_pop : Return value :  true:popped  false:empty                    */
+/*      pop_n   : pops up to n items. Return value : number of popped items   */
+/* -------------------------------------------------------------------------- */
+    bool try_pop(T& v) {
+        index_t h = (index_t)EzAtomic::load_relaxed(&m_head);
+        if (h == m_tail_cache) {
+            m_tail_cache = (index_t)EzAtomic::load(&m_tail);
+            if (h == m_tail_cache) return false;
+        }
+        v = m_buf[h & (N - 1)];
+        EzAtomic::store(&m_head, (eztoken_t)(h + 1));
+        wake_producer();
+        return true;
+    };
+
+    int pop_n(T *v, int n) {
+        index_t h = (index_t)EzAtomic::load_relaxed(&m_head);
+        index_t avail = m_tail_cache - h;
+        if (avail < (index_t)n) {
+            m_tail_cache = (index_t)EzAtomic::load(&m_tail);
+            avail = m_tail_cache - h;
+        }
+        if ((index_t)n > avail) n = (int)avail;
+        if (n <= 0) return 0;
+        for (int i = 0; i < n; i++) v[i] = m_buf[(h + i) & (N - 1)];
+        EzAtomic::store(&m_head, (eztoken_t)(h + n));
+        wake_producer();
+        return n;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: push / pop                                                     */
+/*      Blocking versions. They spin for a while, then park until the other  */
+/*      side makes room / pushes an item.                                     */
+/* -------------------------------------------------------------------------- */
+    void push(const T& v) {
+        for (int k = 0; !try_push(v); k++) {
+            if (k < EZQ_SPIN_COUNT) {
+                EzAtomic::relax();
+                continue;
+            }
+            eztoken_t h = EzAtomic::load(&m_head);
+            EzAtomic::exchange(&m_prod_wait, (eztoken_t)1);
+            if ((index_t)EzAtomic::load_relaxed(&m_tail) - (index_t)h == (index_t)N) {
+                EzMutex::park(&m_head, h);
+            }
+            EzAtomic::store(&m_prod_wait, (eztoken_t)0);
+        }
+    };
+
+    void pop(T& v) {
+        for (int k = 0; !try_pop(v); k++) {
+            if (k < EZQ_SPIN_COUNT) {
+                EzAtomic::relax();
+                continue;
+            }
+            eztoken_t t = EzAtomic::load(&m_tail);
+            EzAtomic::exchange(&m_cons_wait, (eztoken_t)1);
+            if (t == EzAtomic::load_relaxed(&m_head)) {
+                EzMutex::park(&m_tail, t);
+            }
+            EzAtomic::store(&m_cons_wait, (eztoken_t)0);
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: size / empty / capacity                                        */
+/*      size() and empty() are exact only on the producer or consumer thread. */
+/* -------------------------------------------------------------------------- */
+    int  size() const {
+        return (int)((index_t)EzAtomic::load(&m_tail) - (index_t)EzAtomic::load(&m_head));
+    };
+    bool empty() const { return (size() == 0); };
+    int  capacity() const { return N; };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzMpmcQueue
+        A bounded lock-free queue for any number of producers and consumers
+        (D. Vyukov's algorithm). Each slot has a sequence number which tells
+        whether it is ready for the producer of a lap or the consumer of the
+        lap, so a push or a pop is one CAS on the shared position plus a
+        store into the slot.
+        push()/pop() block when the queue is full/empty, and close() wakes
+        every blocked thread so that workers can shut down.
+ *****************************************************************************/
+
+template <typename T>
+class EzMpmcQueue
+{
+  private:
+    EzMpmcQueue(const EzMpmcQueue& src);
+    EzMpmcQueue& operator=(const EzMpmcQueue& src);
+
+    typedef unsigned eztoken_t index_t;   /* free-running, wraps around */
+
+    struct Cell {
+        VOLATILE_ eztoken_t seq;
+        T data;
+    };
+
+    char                m_pad0[EZ_CACHE_LINE];
+    /* ----- read-mostly line ----- */
+    Cell               *m_buf;
+    index_t             m_mask;
+    volatile int        m_closed;
+    char                m_pad1[EZ_CACHE_LINE];
+    /* ----- producers' line ----- */
+    VOLATILE_ eztoken_t m_enq_pos;
+    char                m_pad2[EZ_CACHE_LINE - sizeof(eztoken_t)];
+    /* ----- consumers' line ----- */
+    VOLATILE_ eztoken_t m_deq_pos;
+    char                m_pad3[EZ_CACHE_LINE - sizeof(eztoken_t)];
+    /* ----- blocking calls ----- */
+    VOLATILE_ eztoken_t m_push_signal;    /* bumped when a slot is freed */
+    VOLATILE_ eztoken_t m_push_waiters;
+    VOLATILE_ eztoken_t m_pop_signal;     /* bumped when an item arrives */
+    VOLATILE_ eztoken_t m_pop_waiters;
+    char                m_pad4[EZ_CACHE_LINE - 4 * sizeof(eztoken_t)];
+
+    static eztoken_t diff(eztoken_t a, index_t b) {
+        return (eztoken_t)((index_t)a - b);
+    };
+
+    static void signal(VOLATILE_ eztoken_t *sig, VOLATILE_ eztoken_t *waiters) {
+        EzAtomic::fence();
+        if (EzAtomic::load_relaxed(waiters)) {
+            EzAtomic::fetch_add(sig, (eztoken_t)1);
+            EzMutex::unpark(sig, 1);
+        }
+    };
+
+    bool enqueue(const T& v) {
+        index_t pos = (index_t)EzAtomic::load_relaxed(&m_enq_pos);
+        Cell *cell;
+        for (;;) {
+            cell = &m_buf[pos & m_mask];
+            eztoken_t d = diff(EzAtomic::load(&cell->seq), pos);
+            if (d == 0) {
+                index_t cur = (index_t)EzAtomic::cas(&m_enq_pos, (eztoken_t)pos, (eztoken_t)(pos + 1));
+                if (cur == pos) break;
+                pos = cur;
+            } else if (d < 0) {
+                return false;                  /* full */
+            } else {
+                pos = (index_t)EzAtomic::load_relaxed(&m_enq_pos);
+            }
+        }
+        cell->data = v;
+        EzAtomic::store(&cell->seq, (eztoken_t)(pos + 1));
+        return true;
+    };
+
+    bool dequeue(T& v) {
+        index_t pos = (index_t)EzAtomic::load_relaxed(&m_deq_pos);
+        Cell *cell;
+        for (;;) {
+            cell = &m_buf[pos & m_mask];
+            eztoken_t d = diff(EzAtomic::load(&cell->seq), pos + 1);
+            if (d == 0) {
+                index_t cur = (index_t)EzAtomic::cas(&m_deq_pos, (eztoken_t)pos, (eztoken_t)(pos + 1));
+                if (cur == pos) break;
+                pos = cur;
+            } else if (d < 0) {
+                return false;                  /* empty */
+            } else {
+                pos = (index_t)EzAtomic::load_relaxed(&m_deq_pos);
+            }
+        }
+        v = cell->data;
+        EzAtomic::store(&cell->seq, (eztoken_t)(pos + m_mask + 1));
+        return true;
+    };
+
+    /* true if the slot at the consumers' position holds an item */
+    bool dequeue_ready() const {
+        index_t pos = (index_t)EzAtomic::load(&m_deq_pos);
+        return (diff(EzAtomic::load(&m_buf[pos & m_mask].seq), pos + 1) >= 0);
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR                                                              */
+/*       capacity is rounded up to a power of 2 (at least 2).                 */
+/* -------------------------------------------------------------------------- */
+    explicit EzMpmcQueue(int capacity = 1024) {
+        index_t n = 2;
+        while ((int)n < capacity) n <<= 1;
+        m_buf = new Cell[n];
+        m_mask = n - 1;
+        for (index_t i = 0; i < n; i++) m_buf[i].seq = (eztoken_t)i;
+        m_closed = 0;
+        m_enq_pos = m_deq_pos = 0;
+        m_push_signal = m_push_waiters = m_pop_signal = m_pop_waiters = 0;
+    };
+    ~EzMpmcQueue() { delete [] m_buf; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: try_push / try_pop                                             */
+/*      Non-blocking versions.                                                */
+/*      try_push: Return value :  true:pushed  false:full or closed           */
+/*      try_pop : Return value :  true:popped  false:empty                    */
+/* -------------------------------------------------------------------------- */
+    bool try_push(const T& v) {
+        if (EzAtomic::load_relaxed(&m_closed) || !enqueue(v)) return false;
+        signal(&m_pop_signal, &m_pop_waiters);
+        return true;
+    };
+
+    bool try_pop(T& v) {
+        if (!dequeue(v)) return false;
+        signal(&m_push_signal, &m_push_waiters);
+        return true;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: push / pop                                                     */
+/*      Blocking versions. They spin for a while, then park.                  */
+/*      push: Return value :  true:pushed  false:closed                       */
+/*      pop : Return value :  true:popped  false:closed and empty             */
+/* -------------------------------------------------------------------------- */
+    bool push(const T& v) {
+        for (int k = 0; ; k++) {
+            if (EzAtomic::load(&m_closed)) return false;
+            if (try_push(v)) return true;
+            if (k < EZQ_SPIN_COUNT) {
+                EzAtomic::relax();
+                continue;
+            }
+            if (k < EZQ_SPIN_COUNT + EZQ_YIELD_COUNT) {
+                EzMutex::Wait();
+                continue;
+            }
+            eztoken_t sig = EzAtomic::load(&m_push_signal);
+            EzAtomic::fetch_add(&m_push_waiters, (eztoken_t)1);
+            if (!EzAtomic::load(&m_closed) && size() >= capacity()) {
+                EzMutex::park(&m_push_signal, sig);
+            }
+            EzAtomic::fetch_add(&m_push_waiters, (eztoken_t)-1);
+        }
+    };
+
+    bool pop(T& v) {
+        for (int k = 0; ; k++) {
+            if (try_pop(v)) return true;
+            if (EzAtomic::load(&m_closed) && size() == 0) return false;
+            if (k < EZQ_SPIN_COUNT) {
+                EzAtomic::relax();
+                continue;
+            }
+            if (k < EZQ_SPIN_COUNT + EZQ_YIELD_COUNT) {
+                EzMutex::Wait();
+                continue;
+            }
+            eztoken_t sig = EzAtomic::load(&m_pop_signal);
+            EzAtomic::fetch_add(&m_pop_waiters, (eztoken_t)1);
+            if (!EzAtomic::load(&m_closed) && !dequeue_ready()) {
+                EzMutex::park(&m_pop_signal, sig);
+            }
+            EzAtomic::fetch_add(&m_pop_waiters, (eztoken_t)-1);
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: close                                                          */
+/*      Rejects further pushes and wakes all the blocked threads. pop()       */
+/*      still returns the remaining items, then returns false.                */
+/* -------------------------------------------------------------------------- */
+    void close() {
+        EzAtomic::store(&m_closed, 1);
+        EzAtomic::fetch_add(&m_push_signal, (eztoken_t)1);
+        EzAtomic::fetch_add(&m_pop_signal, (eztoken_t)1);
+        EzMutex::unpark(&m_push_signal, EZ_UNPARK_ALL);
+        EzMutex::unpark(&m_pop_signal, EZ_UNPARK_ALL);
+    };
+
+    bool is_closed() const { return (EzAtomic::load(&m_closed) != 0); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: size / capacity                                                */
+/*      size() is approximate while other threads push or pop.                */
+/* -------------------------------------------------------------------------- */
+    int size() const {
+        eztoken_t n = diff(EzAtomic::load(&m_enq_pos), (index_t)EzAtomic::load(&m_deq_pos));
+        return (n < 0) ? 0 : (int)n;
+    };
+    int capacity() const { return (int)(m_mask + 1); };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzAsymFence
+        An asymmetric memory barrier for a frequent side (light()) and a
+        rare side (heavy()). Where the OS can make every thread of the
+        process execute a barrier (Linux membarrier(), Windows Vista
+        FlushProcessWriteBuffers()), light() is a compiler barrier only,
+        and heavy() is that system call. Otherwise both are full fences.
+ *****************************************************************************/
+
+#if defined(__linux__) && defined(SYS_membarrier)
+#  define EZ_HAVE_MEMBARRIER__
+#  define EZ_MEMBARRIER_CMD_QUERY__                        0
+#  define EZ_MEMBARRIER_CMD_PRIVATE_EXPEDITED__            (1 << 3)
+#  define EZ_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED__   (1 << 4)
+#endif
+
+class EzAsymFence
+{
+  private:
+    static VOLATILE_ eztoken_t *mode() {   /* -1:unknown  0:fences  1:asymmetric */
+        static VOLATILE_ eztoken_t m = -1;
+        return &m;
+    };
+
+    static inline void compiler_barrier() {
+#if defined(__GNUC__)
+        __asm__ __volatile__("" ::: "memory");
+#elif defined(_MSC_VER)
+        _ReadWriteBarrier();
+#endif
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  init()                                                       */
+/*       Enables the asymmetric mode if the OS supports it. Call it before    */
+/*       any thread uses light() (EzEpoch and EzHazardPtr do it).             */
+/*       Return value :  true if asymmetric                                   */
+/* -------------------------------------------------------------------------- */
+    static bool init() {
+        eztoken_t m = EzAtomic::load(mode());
+        if (m >= 0) return m == 1;
+        m = 0;
+#if defined(EZ_HAVE_MEMBARRIER__) && defined(__GNUC__) && !defined(EZ_NO_MEMBARRIER)
+        {
+            long cmds = syscall(SYS_membarrier, EZ_MEMBARRIER_CMD_QUERY__, 0);
+            if (cmds > 0 && (cmds & EZ_MEMBARRIER_CMD_PRIVATE_EXPEDITED__) &&
+                syscall(SYS_membarrier, EZ_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED__, 0) == 0) {
+                m = 1;
+            }
+        }
+#elif defined(_WIN32) && defined(_MSC_VER) && defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0600)
+        m = 1;
+#endif
+        EzAtomic::store(mode(), m);
+        return m == 1;
+    };
+
+    static inline void light() {
+        if (EzAtomic::load_relaxed(mode()) == 1) compiler_barrier();
+        else EzAtomic::fence();
+    };
+
+    static void heavy() {
+        if (EzAtomic::load_relaxed(mode()) == 1) {
+#if defined(EZ_HAVE_MEMBARRIER__)
+            syscall(SYS_membarrier, EZ_MEMBARRIER_CMD_PRIVATE_EXPEDITED__, 0);
+#elif defined(_WIN32)
+            FlushProcessWriteBuffers();
+#endif
+        } else {
+            EzAtomic::fence();
+        }
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   EzThreadRec__ : a per-thread record of a reclamation domain.             */
+/*       It is linked in the list of its domain, which only grows, and in     */
+/*       the list of the thread which owns it. state tells who frees it:      */
+/*       free (the domain), owned (the thread gives it back at its exit) or   */
+/*       orphaned (the domain is gone, the thread deletes it).                */
+/* -------------------------------------------------------------------------- */
+#define EZREC_FREE__      0
+#define EZREC_OWNED__     1
+#define EZREC_ORPHAN__    2
+
+struct EzThreadRec__ {
+    EzThreadRec__      *next;     /* in the domain's list  */
+    EzThreadRec__      *tnext;    /* in the thread's list  */
+    eztoken_t           domain;   /* id of the domain      */
+    VOLATILE_ eztoken_t state;
+
+    EzThreadRec__() : next(NULL), tnext(NULL), domain(0), state(EZREC_FREE__) {};
+    virtual ~EzThreadRec__() {};
+    virtual void on_release() {};   /* the owner thread leaves the domain    */
+    virtual void drain() {};        /* the domain frees what is still retired */
+};
+
+/* -------------------------------------------------------------------------- */
+/*   EzThreadRecList__ : the records owned by the calling thread, for all     */
+/*       the domains, in one process-wide TLS slot. They are given back       */
+/*       when the thread exits (by the TLS destructor on POSIX and on         */
+/*       Windows Vista or later, and when app() returns on an EzThreadBase    */
+/*       thread), or by release().                                            */
+/* -------------------------------------------------------------------------- */
+#if defined(USE_WIN_THREAD) && defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0600)
+#  define EZREC_FLS__        /* fiber local storage calls a destructor */
+#endif
+
+class EzThreadRecList__
+{
+  private:
+#ifdef USE_WIN_THREAD
+#  ifdef EZREC_FLS__
+    static EzThreadRec__ *get() { return static_cast<EzThreadRec__ *>(FlsGetValue(key())); };
+    static void set(EzThreadRec__ *r) { FlsSetValue(key(), r); };
+    static void WINAPI tls_destructor(PVOID p) { release_list(static_cast<EzThreadRec__ *>(p)); };
+#  else
+    static EzThreadRec__ *get() { return static_cast<EzThreadRec__ *>(TlsGetValue(key())); };
+    static void set(EzThreadRec__ *r) { TlsSetValue(key(), r); };
+#  endif
+    static DWORD& key() {
+        static DWORD k = 0;
+        return k;
+    };
+#else
+    static EzThreadRec__ *get() { return static_cast<EzThreadRec__ *>(pthread_getspecific(key())); };
+    static void set(EzThreadRec__ *r) { pthread_setspecific(key(), r); };
+    static void tls_destructor(void *p) { release_list(static_cast<EzThreadRec__ *>(p)); };
+    static pthread_key_t& key() {
+        static pthread_key_t k;
+        return k;
+    };
+#endif
+
+    static void release_list(EzThreadRec__ *r) {
+        while (r) {
+            EzThreadRec__ *tnext = r->tnext;
+            release(r);
+            r = tnext;
+        }
+    };
+
+    static void thread_exit() {     /* EzThreadBase::exit_hook() */
+        EzThreadRec__ *r = get();
+        if (r) {
+            set(NULL);
+            release_list(r);
+        }
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  init()                                                       */
+/*       Allocates the TLS slot at the first call.                            */
+/*       Return value :  0:success, -1:error (no TLS slot left)               */
+/* -------------------------------------------------------------------------- */
+    static int init() {
+        static VOLATILE_ eztoken_t state = 0;   /* 0:none 1:allocating 2:ready 3:failed */
+        eztoken_t s = EzAtomic::load(&state);
+        if (s < 2) {
+            if (EzAtomic::cas(&state, (eztoken_t)0, (eztoken_t)1) == 0) {
+#ifdef USE_WIN_THREAD
+#  ifdef EZREC_FLS__
+                key() = FlsAlloc(&tls_destructor);
+                s = (key() == FLS_OUT_OF_INDEXES) ? 3 : 2;
+#  else
+                key() = TlsAlloc();
+                s = (key() == TLS_OUT_OF_INDEXES) ? 3 : 2;
+#  endif
+#else
+                s = (pthread_key_create(&key(), &tls_destructor) == 0) ? 2 : 3;
+#endif
+                if (s == 2) EzAtomic::store(EzThreadBase::exit_hook(), &thread_exit);
+                EzAtomic::store(&state, s);
+            } else {
+                while ((s = EzAtomic::load(&state)) < 2) EzMutex::Wait();
+            }
+        }
+        return (s == 2) ? 0 : -1;
+    };
+
+    static eztoken_t new_id() {     /* a domain id, unique in the process */
+        static VOLATILE_ eztoken_t last = 0;
+        return EzAtomic::fetch_add(&last, (eztoken_t)1) + 1;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  find() / add() / remove() / release()                        */
+/*       find()    : the calling thread's record of domain, or NULL. It is    */
+/*                   moved to the front, and orphans met on the way are       */
+/*                   deleted.                                                 */
+/*       add()     : gives r (owned) to the calling thread.                   */
+/*       remove()  : gives back the calling thread's record of domain.        */
+/*       release() : gives back r, or deletes it if it is an orphan.          */
+/* -------------------------------------------------------------------------- */
+    static inline EzThreadRec__ *find(eztoken_t domain) {
+        EzThreadRec__ *head = get(), *prev = NULL, *r;
+        if (head && head->domain == domain) return head;
+        for (r = head; r; ) {
+            EzThreadRec__ *tnext = r->tnext;
+            if (r->domain == domain) {
+                if (prev) prev->tnext = tnext;
+                else head = tnext;
+                r->tnext = head;
+                set(r);
+                return r;
+            }
+            if (EzAtomic::load(&r->state) == EZREC_ORPHAN__) {
+                if (prev) prev->tnext = tnext;
+                else head = tnext;
+                delete r;
+            } else {
+                prev = r;
+            }
+            r = tnext;
+        }
+        set(head);
+        return NULL;
+    };
+
+    static void add(EzThreadRec__ *r) {
+        r->tnext = get();
+        set(r);
+    };
+
+    static void remove(eztoken_t domain) {
+        EzThreadRec__ *r = find(domain);
+        if (r) {
+            set(r->tnext);
+            release(r);
+        }
+    };
+
+    static void release(EzThreadRec__ *r) {
+        r->on_release();
+        if (EzAtomic::cas(&r->state, (eztoken_t)EZREC_OWNED__, (eztoken_t)EZREC_FREE__) != EZREC_OWNED__) {
+            delete r;   /* orphaned */
+        }
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   EzThreadRecords__ : the records of one reclamation domain.               */
+/*       A thread gets a record at its first call, and keeps it until it      */
+/*       exits or calls release(). Released records are reused. The list      */
+/*       only grows, so it can be walked without a lock. The destructor       */
+/*       drains every record, deletes the free ones and orphans the others.   */
+/* -------------------------------------------------------------------------- */
+template <typename REC>
+class EzThreadRecords__
+{
+  private:
+    EzThreadRecords__(const EzThreadRecords__& src);
+    EzThreadRecords__& operator=(const EzThreadRecords__& src);
+
+    EzThreadRec__ * VOLATILE_ m_head;
+    eztoken_t m_id;
+
+    REC *acquire() {
+        EzThreadRec__ *r, *head;
+        for (r = EzAtomic::load(&m_head); r; r = r->next) {
+            if (EzAtomic::load_relaxed(&r->state) == EZREC_FREE__ &&
+                EzAtomic::cas(&r->state, (eztoken_t)EZREC_FREE__, (eztoken_t)EZREC_OWNED__) == EZREC_FREE__) break;
+        }
+        if (r == NULL) {
+            r = new REC;
+            r->domain = m_id;
+            r->state = EZREC_OWNED__;
+            head = EzAtomic::load(&m_head);
+            for (;;) {
+                EzThreadRec__ *prev;
+                r->next = head;
+                prev = EzAtomic::cas(&m_head, head, r);
+                if (prev == head) break;
+                head = prev;
+            }
+        }
+        EzThreadRecList__::add(r);
+        return static_cast<REC *>(r);
+    };
+
+  public:
+    EzThreadRecords__() {
+        if (EzThreadRecList__::init() != 0) throw std::bad_alloc();
+        m_head = NULL;
+        m_id = EzThreadRecList__::new_id();
+    };
+    ~EzThreadRecords__() {
+        EzThreadRec__ *r = m_head;
+        while (r) {
+            EzThreadRec__ *next = r->next;
+            r->drain();
+            if (EzAtomic::exchange(&r->state, (eztoken_t)EZREC_ORPHAN__) == EZREC_FREE__) delete r;
+            r = next;
+        }
+    };
+
+    inline REC *local() {
+        EzThreadRec__ *r = EzThreadRecList__::find(m_id);
+        return r ? static_cast<REC *>(r) : acquire();
+    };
+
+    void release() { EzThreadRecList__::remove(m_id); };
+
+    REC *head() const { return static_cast<REC *>(EzAtomic::load(&m_head)); };
+    static REC *next(const REC *r) { return static_cast<REC *>(r->next); };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   EzRetired__ : an object waiting to be freed, and how to free it.         */
+/* -------------------------------------------------------------------------- */
+struct EzRetired__ {
+    void *ptr;
+    void (*deleter)(void *);
+};
+
+template <typename T>
+void ez_delete__(void *p) { delete static_cast<T *>(p); }
+
+/*****************************************************************************
+      CLASS DEFINITION : EzEpoch
+        Epoch-based reclamation. Readers of a lock-free structure run
+        between enter() and exit(); an object unlinked from the structure
+        is passed to retire() and freed once every thread has left the
+        critical regions it could have been seen in (two epoch advances).
+        enter()/exit() cost a store each (plus a TLS lookup): with
+        EzAsymFence in asymmetric mode, the fence is paid by the thread
+        which advances the epoch, once per EZEPOCH_BATCH retire() calls.
+        A thread stuck in a critical region stops all reclamation; use
+        EzHazardPtr where memory must stay bounded.
+ *****************************************************************************/
+
+#ifndef EZEPOCH_BATCH
+#  define EZEPOCH_BATCH     64    /* retire() calls between reclamations */
+#endif
+
+class EzEpoch
+{
+  private:
+    EzEpoch(const EzEpoch& src);
+    EzEpoch& operator=(const EzEpoch& src);
+
+    struct Bag {              /* objects retired in one epoch      */
+        eztoken_t    epoch;
+        int          n, cap;
+        EzRetired__ *items;
+    };
+
+  public:
+    struct Record : public EzThreadRec__ {
+        VOLATILE_ eztoken_t local;    /* epoch + 1 while in a region, else 0 */
+        int       depth;              /* nesting of enter()                  */
+        int       count;              /* retire() calls since reclamation    */
+        Bag       bags[3];            /* by (epoch / 2) % 3                  */
+        char      pad[EZ_CACHE_LINE];
+
+        Record() {
+            local = 0;
+            depth = count = 0;
+            for (int i = 0; i < 3; i++) {
+                bags[i].epoch = 0;
+                bags[i].n = bags[i].cap = 0;
+                bags[i].items = NULL;
+            }
+        };
+        ~Record() {
+            for (int i = 0; i < 3; i++) {
+                free_bag(bags[i]);
+                delete [] bags[i].items;
+            }
+        };
+        void drain() {
+            for (int i = 0; i < 3; i++) free_bag(bags[i]);
+        };
+        void on_release() {
+            depth = 0;
+            EzAtomic::store(&local, (eztoken_t)0);
+        };
+    };
+
+  private:
+    char     m_pad0[EZ_CACHE_LINE];
+    VOLATILE_ eztoken_t m_epoch;      /* always even */
+    char     m_pad1[EZ_CACHE_LINE];
+    EzThreadRecords__<Record> m_records;
+
+    static void free_bag(Bag& b) {
+        for (int i = 0; i < b.n; i++) b.items[i].deleter(b.items[i].ptr);
+        b.n = 0;
+    };
+
+    static bool is_old(eztoken_t epoch, eztoken_t now) {   /* two advances ago */
+        return (unsigned long)now - (unsigned long)epoch >= 4;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  try_advance()                                                */
+/*       Advances the epoch if every thread in a region has seen it.          */
+/* -------------------------------------------------------------------------- */
+    bool try_advance() {
+        eztoken_t e = EzAtomic::load(&m_epoch);
+        EzAsymFence::heavy();
+        for (Record *r = m_records.head(); r; r = m_records.next(r)) {
+            eztoken_t l = EzAtomic::load(&r->local);
+            if (l != 0 && l - 1 != e) return false;
+        }
+        EzAtomic::cas(&m_epoch, e, (eztoken_t)(e + 2));
+        return true;
+    };
+
+    void reclaim(Record *r) {
+        eztoken_t now;
+        r->count = 0;
+        try_advance();
+        now = EzAtomic::load(&m_epoch);
+        for (int i = 0; i < 3; i++) {
+            if (r->bags[i].n > 0 && is_old(r->bags[i].epoch, now)) free_bag(r->bags[i]);
+        }
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR : throws std::bad_alloc if no TLS slot is left.              */
+/* -------------------------------------------------------------------------- */
+    EzEpoch() {
+        m_epoch = 0;
+        EzAsymFence::init();
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   DESTRUCTOR : frees every retired object. No thread may be using the      */
+/*                domain; the threads which used it may live on.              */
+/* -------------------------------------------------------------------------- */
+    ~EzEpoch() {};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: enter / exit                                                   */
+/*      Begin / end a critical region, in which pointers read from the        */
+/*      structure stay valid. Regions may nest.                               */
+/* -------------------------------------------------------------------------- */
+
+    inline void enter() {
+        Record *r = m_records.local();
+        if (r->depth++ == 0) {
+            EzAtomic::store_relaxed(&r->local, (eztoken_t)(EzAtomic::load_relaxed(&m_epoch) + 1));
+            EzAsymFence::light();
+        }
+    };
+
+    inline void exit() {
+        Record *r = m_records.local();
+        if (--r->depth == 0) EzAtomic::store(&r->local, (eztoken_t)0);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: retire                                                         */
+/*      Frees p with deleter(p) (delete p for the template) when no thread    */
+/*      can see it any more. p must already be unlinked from the structure.   */
+/* -------------------------------------------------------------------------- */
+
+    void retire(void *p, void (*deleter)(void *)) {
+        Record *r = m_records.local();
+        eztoken_t now = EzAtomic::load(&m_epoch);
+        Bag& b = r->bags[((unsigned long)now >> 1) % 3];
+        if (b.n > 0 && b.epoch != now) free_bag(b);   /* 3 epochs old */
+        b.epoch = now;
+        if (b.n == b.cap) {
+            int ncap = b.cap ? b.cap * 2 : EZEPOCH_BATCH;
+            EzRetired__ *items = new EzRetired__[ncap];
+            for (int i = 0; i < b.n; i++) items[i] = b.items[i];
+            delete [] b.items;
+            b.items = items;
+            b.cap = ncap;
+        }
+        b.items[b.n].ptr = p;
+        b.items[b.n].deleter = deleter;
+        b.n++;
+        if (++r->count >= EZEPOCH_BATCH) reclaim(r);
+    };
+
+    template <typename T>
+    void retire(T *p) { retire(static_cast<void *>(p), &ez_delete__<T>); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: collect / synchronize                                          */
+/*      collect()     : tries to advance the epoch and frees what it can of   */
+/*                      the calling thread's retired objects.                 */
+/*      synchronize() : waits until all the objects the calling thread has   */
+/*                      retired are freed. Call it outside of a region.       */
+/* -------------------------------------------------------------------------- */
+
+    void collect() { reclaim(m_records.local()); };
+
+    void synchronize() {
+        Record *r = m_records.local();
+        for (;;) {
+            reclaim(r);
+            if (r->bags[0].n == 0 && r->bags[1].n == 0 && r->bags[2].n == 0) break;
+            EzMutex::Wait();
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: release_thread                                                 */
+/*      Gives the calling thread's record back. It is done automatically      */
+/*      when an EzThreadBase thread's app() returns, and when any thread      */
+/*      exits (except on Windows before Vista). Objects still waiting are     */
+/*      freed by the next user of the record, or by the domain's destructor.  */
+/* -------------------------------------------------------------------------- */
+
+    void release_thread() { m_records.release(); };
+
+    eztoken_t epoch() const { return EzAtomic::load(&m_epoch); };
+
+/* -------------------------------------------------------------------------- */
+/*   Guard : enter() at construction, exit() at deletion.                     */
+/* -------------------------------------------------------------------------- */
+    class Guard {
+      private:
+        Guard(const Guard& src);
+        Guard& operator=(const Guard& src);
+        EzEpoch& m_domain;
+      public:
+        explicit Guard(EzEpoch& domain) : m_domain(domain) { m_domain.enter(); };
+        ~Guard() { m_domain.exit(); };
+    };
+};
+
+/*****************************************************************************
+      CLASS DEFINITION : EzHazardPtr
+        Hazard pointers. A reader publishes each pointer it is about to use
+        in one of its EZHP_SLOTS slots with protect(). retire() frees an
+        object once no slot holds it: each thread scans all the slots after
+        EZHP_BATCH retire() calls, so at most EZHP_BATCH + (the number of
+        slots) objects per thread wait, whatever the readers do.
+ *****************************************************************************/
+
+#ifndef EZHP_SLOTS
+#  define EZHP_SLOTS        4     /* hazard pointers per thread          */
+#endif
+#ifndef EZHP_BATCH
+#  define EZHP_BATCH        64    /* retire() calls between scans        */
+#endif
+
+class EzHazardPtr
+{
+  private:
+    EzHazardPtr(const EzHazardPtr& src);
+    EzHazardPtr& operator=(const EzHazardPtr& src);
+
+  public:
+    struct Record : public EzThreadRec__ {
+        void * VOLATILE_ hp[EZHP_SLOTS];
+        EzRetired__ *items;           /* retired, not freed yet   */
+        int          n, cap;
+        void       **scan;            /* buffer for the hazards   */
+        int          scan_cap;
+        char         pad[EZ_CACHE_LINE];
+
+        Record() {
+            for (int i = 0; i < EZHP_SLOTS; i++) hp[i] = NULL;
+            items = NULL;
+            n = cap = 0;
+            scan = NULL;
+            scan_cap = 0;
+        };
+        ~Record() {
+            drain();
+            delete [] items;
+            delete [] scan;
+        };
+        void drain() {
+            for (int i = 0; i < n; i++) items[i].deleter(items[i].ptr);
+            n = 0;
+        };
+        void on_release() {
+            for (int i = 0; i < EZHP_SLOTS; i++) EzAtomic::store(&hp[i], (void *)NULL);
+        };
+    };
+
+  private:
+    EzThreadRecords__<Record> m_records;
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  scan()                                                       */
+/*       Collects the published hazards, sorts them, and frees the retired    */
+/*       objects which are not among them.                                    */
+/* -------------------------------------------------------------------------- */
+    void scan(Record *r) {
+        int nh = 0, i, j, gap, kept = 0;
+        Record *head = m_records.head(), *rec;   /* records added later cannot see r->items */
+
+        EzAsymFence::heavy();
+        for (rec = head; rec; rec = m_records.next(rec)) nh += EZHP_SLOTS;
+        if (nh > r->scan_cap) {
+            delete [] r->scan;
+            r->scan = new void *[nh];
+            r->scan_cap = nh;
+        }
+        nh = 0;
+        for (rec = head; rec; rec = m_records.next(rec)) {
+            for (i = 0; i < EZHP_SLOTS; i++) {
+                void *p = EzAtomic::load(&rec->hp[i]);
+                if (p) r->scan[nh++] = p;
+            }
+        }
+        for (gap = nh / 2; gap > 0; gap /= 2) {          /* shell sort */
+            for (i = gap; i < nh; i++) {
+                void *v = r->scan[i];
+                for (j = i; j >= gap && r->scan[j - gap] > v; j -= gap) r->scan[j] = r->scan[j - gap];
+                r->scan[j] = v;
+            }
+        }
+        for (i = 0; i < r->n; i++) {
+            void *p = r->items[i].ptr;
+            int lo = 0, hi = nh;
+            while (lo < hi) {                            /* binary search */
+                int mid = (lo + hi) / 2;
+                if (r->scan[mid] < p) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo < nh && r->scan[lo] == p) r->items[kept++] = r->items[i];
+            else r->items[i].deleter(p);
+        }
+        r->n = kept;
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR : throws std::bad_alloc if no TLS slot is left.              */
+/* -------------------------------------------------------------------------- */
+    EzHazardPtr() { EzAsymFence::init(); };
+
+/* -------------------------------------------------------------------------- */
+/*   DESTRUCTOR : frees every retired object. No thread may be using the      */
+/*                domain; the threads which used it may live on.              */
+/* -------------------------------------------------------------------------- */
+    ~EzHazardPtr() {};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: protect                                                        */
+/*      Reads *src, publishes it in slot, and re-reads *src until it is       */
+/*      unchanged, so the returned object cannot be freed before the slot     */
+/*      is cleared or reused.                                                 */
+/* -------------------------------------------------------------------------- */
+
+    template <typename T>
+    inline T *protect(int slot, T * VOLATILE_ const *src) {
+        Record *r = m_records.local();
+        T *p = EzAtomic::load(src), *q;
+        for (;;) {
+            EzAtomic::store_relaxed(&r->hp[slot], static_cast<void *>(p));
+            EzAsymFence::light();
+            q = EzAtomic::load(src);
+            if (q == p) return p;
+            p = q;
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: set / clear                                                    */
+/*      set() publishes p without validation; the caller must check that p   */
+/*      is still reachable afterwards. clear() empties the slot.             */
+/* -------------------------------------------------------------------------- */
+
+    inline void set(int slot, void *p) {
+        Record *r = m_records.local();
+        EzAtomic::store_relaxed(&r->hp[slot], p);
+        EzAsymFence::light();
+    };
+
+    inline void clear(int slot) {
+        EzAtomic::store(&m_records.local()->hp[slot], (void *)NULL);
+    };
+
+    void clear_all() { m_records.local()->on_release(); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: retire                                                         */
+/*      Frees p with deleter(p) (delete p for the template) when no slot      */
+/*      holds it. p must already be unlinked from the structure.              */
+/* -------------------------------------------------------------------------- */
+
+    void retire(void *p, void (*deleter)(void *)) {
+        Record *r = m_records.local();
+        if (r->n == r->cap) {
+            int ncap = r->cap ? r->cap * 2 : EZHP_BATCH * 2;
+            EzRetired__ *items = new EzRetired__[ncap];
+            for (int i = 0; i < r->n; i++) items[i] = r->items[i];
+            delete [] r->items;
+            r->items = items;
+            r->cap = ncap;
+        }
+        r->items[r->n].ptr = p;
+        r->items[r->n].deleter = deleter;
+        if (++r->n >= EZHP_BATCH) scan(r);
+    };
+
+    template <typename T>
+    void retire(T *p) { retire(static_cast<void *>(p), &ez_delete__<T>); };
+
+    void collect() { scan(m_records.local()); };
+
+    void release_thread() { m_records.release(); };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzConcurrentMap
+        A hash map shared by many threads. Entries are kept in
+        open-addressed groups of a few slots, sized to whole cache lines,
+        with one control byte per slot (empty, deleted or 7 bits of the
+        hash). Readers do not lock: each group has a sequence number,
+        odd while a writer changes it, and a reader retries the group if
+        the number changed under it. Writers lock only the groups they
+        touch. When the table grows, the entries move to the new table a
+        few groups at a time, by the writers, while readers look in both;
+        the old table is freed through an EzEpoch.
+        K and V must be plain data (copyable as bytes), because a reader
+        may copy a slot while it is being written, and then retries.
+ *****************************************************************************/
+
+#include <string.h>         /* memcpy() */
+
+#ifndef EZMAP_STRIPES
+#  define EZMAP_STRIPES     16    /* counters of used slots per table       */
+#endif
+#ifndef EZMAP_MIGRATE
+#  define EZMAP_MIGRATE     8     /* groups moved per write during a resize */
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   EzHash<K> : the default hash. Keys up to the size of size_t are taken    */
+/*               as they are (the map mixes the bits), longer ones are        */
+/*               hashed byte by byte. A key with padding bytes needs a hash   */
+/*               of its own.                                                  */
+/* -------------------------------------------------------------------------- */
+template <typename K>
+struct EzHash {
+    size_t operator()(const K& key) const {
+        size_t h = 0;
+        if (sizeof(K) <= sizeof(size_t)) {
+            memcpy(&h, &key, sizeof(K));
+        } else {
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(&key);
+            h = 2166136261UL;                      /* FNV-1a */
+            for (size_t i = 0; i < sizeof(K); i++) {
+                h ^= p[i];
+                h *= 16777619UL;
+            }
+        }
+        return h;
+    };
+};
 
-    EzThreadBase(const EzThreadBase& src);
-    EzThreadBase& operator=(const EzThreadBase& src);
+template <typename K, typename V, typename HASH = EzHash<K> >
+class EzConcurrentMap
+{
+  private:
+    EzConcurrentMap(const EzConcurrentMap& src);
+    EzConcurrentMap& operator=(const EzConcurrentMap& src);
 
-/* ----------------------- private member variables ------------------------- */
+    enum {      /* slots per group: at least 4 entries, in whole cache lines */
+        ENTRY  = sizeof(K) + sizeof(V),
+        HEADER = 2 * sizeof(eztoken_t) + 1,
+        LINES  = (HEADER + 4 * (ENTRY + 1) + EZ_CACHE_LINE - 1) / EZ_CACHE_LINE,
+        FIT    = (LINES * EZ_CACHE_LINE - HEADER) / (ENTRY + 1),
+        SLOTS  = FIT < 1 ? 1 : (FIT > 16 ? 16 : FIT)
+    };
+    enum { CTRL_EMPTY = 0, CTRL_DELETED = 1, CTRL_FULL = 0x80 };
+    enum { OP_INSERT, OP_ASSIGN, OP_UPDATE, OP_MODIFY, OP_ERASE };
 
-    // threadid_t     m_ThreadId_;      /* unique ID for each thread             */
-    threadhandle_t m_ThreadHandle_;  /* Win:HANDLE POSIX:pthread_t            */
-    volatile int m_ThreadState_;     /* 0:unexecuted, 1:creating, 2:running, 4:finished, 8:joined */
-    volatile int m_IsThreadCreated_; /* 0:joined or not created, -1:created   */
+    struct Group {
+        VOLATILE_ eztoken_t seq;        /* odd while the slots change         */
+        VOLATILE_ eztoken_t lock;       /* writers of the keys homed here     */
+        VOLATILE_ unsigned char moved;  /* the entries are in the next table  */
+        VOLATILE_ unsigned char ctrl[SLOTS];
+        K key[SLOTS];
+        V val[SLOTS];
+
+        Group() : seq(0), lock(0), moved(0) {
+            for (int i = 0; i < SLOTS; i++) ctrl[i] = CTRL_EMPTY;
+        };
+    };
+
+    struct Counter {
+        VOLATILE_ eztoken_t used;       /* slots no longer empty    */
+        VOLATILE_ eztoken_t dead;       /* deleted slots among them */
+        char pad[EZ_CACHE_LINE - 2 * sizeof(eztoken_t)];
+    };
+
+    struct Table {
+        size_t    ngroups, mask, stride;
+        eztoken_t nstripes, limit;      /* resize when a stripe uses limit */
+        char     *raw, *base;
+        Table * VOLATILE_ next;         /* resize target                   */
+        char      pad0[EZ_CACHE_LINE];
+        VOLATILE_ eztoken_t claim;      /* next group to move              */
+        char      pad1[EZ_CACHE_LINE];
+        VOLATILE_ eztoken_t done;       /* groups moved                    */
+        char      pad2[EZ_CACHE_LINE];
+        Counter   cnt[EZMAP_STRIPES];
+
+        explicit Table(size_t n) {
+            ngroups = n;
+            mask = n - 1;
+            stride = (sizeof(Group) + EZ_CACHE_LINE - 1) / EZ_CACHE_LINE * EZ_CACHE_LINE;
+            nstripes = (eztoken_t)(n < EZMAP_STRIPES ? n : EZMAP_STRIPES);
+            limit = (eztoken_t)(n / nstripes * SLOTS * 7 / 8);  /* 7/8 full */
+            raw = new char[n * stride + EZ_CACHE_LINE];
+            base = raw + (EZ_CACHE_LINE - (size_t)raw % EZ_CACHE_LINE) % EZ_CACHE_LINE;
+            for (size_t i = 0; i < n; i++) new (base + i * stride) Group;
+            next = NULL;
+            claim = done = 0;
+            for (int i = 0; i < EZMAP_STRIPES; i++) cnt[i].used = cnt[i].dead = 0;
+        };
+        ~Table() {
+            for (size_t i = 0; i < ngroups; i++) group(i)->~Group();
+            delete [] raw;
+        };
+        inline Group *group(size_t i) const {
+            return reinterpret_cast<Group *>(base + i * stride);
+        };
+        inline Counter& counter(const Group *g) {
+            return cnt[(size_t)((const char *)g - base) / stride % nstripes];
+        };
+    };
+
+    struct Probe {
+        Group *found_g, *free_g;
+        int    found_i;
+        bool   moved;
+    };
+
+    struct NoFunc {
+        void operator()(V&) const {};
+    };
+
+    Table * VOLATILE_ m_table;
+    HASH              m_hash;
+    mutable EzEpoch   m_epoch;
+
+    static void delete_table(void *p) { delete static_cast<Table *>(p); };
+
+    size_t hash_of(const K& key) const {
+        size_t h = m_hash(key);
+        h ^= (h >> 16) >> 16;                       /* fold 64-bit hashes */
+        h ^= h >> 16;                               /* murmur3 finalizer  */
+        h *= 0x85ebca6bUL;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35UL;
+        h ^= h >> 16;
+        return h;
+    };
+    static inline unsigned char tag_of(size_t h) {
+        return (unsigned char)(CTRL_FULL | ((h >> 25) & 0x7f));
+    };
+
+    static void spin(int& n) {
+        if (++n < 64) EzAtomic::relax();
+        else EzMutex::Wait();
+    };
+    static void lock_key(Group *g) {
+        int n = 0;
+        while (EzAtomic::load_relaxed(&g->lock) != 0 ||
+               EzAtomic::cas(&g->lock, (eztoken_t)0, (eztoken_t)1) != 0) spin(n);
+    };
+    static void unlock_key(Group *g) { EzAtomic::store(&g->lock, (eztoken_t)0); };
+    static eztoken_t lock_seq(Group *g) {
+        int n = 0;
+        for (;;) {
+            eztoken_t s = EzAtomic::load_relaxed(&g->seq);
+            if ((s & 1) == 0 && EzAtomic::cas(&g->seq, s, (eztoken_t)(s + 1)) == s) return s + 1;
+            spin(n);
+        }
+    };
+    static void unlock_seq(Group *g, eztoken_t s) { EzAtomic::store(&g->seq, (eztoken_t)(s + 1)); };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  probe()                                                      */
+/*       Walks the groups of key in t without locking, until a group with an  */
+/*       empty slot. Finds its slot, the first free slot, and whether a       */
+/*       group has moved. If value is not NULL, copies the value found.       */
+/* -------------------------------------------------------------------------- */
+    void probe(Table *t, const K& key, size_t h, Probe& p, V *value) const {
+        unsigned char tag = tag_of(h);
+        size_t gi = h & t->mask;
+        p.found_g = p.free_g = NULL;
+        p.found_i = -1;
+        p.moved = false;
+        for (size_t n = 0; n < t->ngroups; n++, gi = (gi + 1) & t->mask) {
+            Group *g = t->group(gi);
+            int found, spins = 0, i, fi;
+            bool empty, moved;
+            V tmp = V();
+            for (;;) {
+                eztoken_t s = EzAtomic::load(&g->seq);
+                if (s & 1) {
+                    spin(spins);
+                    continue;
+                }
+                found = fi = -1;
+                empty = false;
+                moved = g->moved != 0;
+                for (i = 0; i < SLOTS; i++) {
+                    unsigned char c = g->ctrl[i];
+                    if (c == tag && g->key[i] == key) {
+                        found = i;
+                        if (value) tmp = g->val[i];
+                    } else if (c == CTRL_EMPTY) {
+                        empty = true;
+                        if (fi < 0) fi = i;
+                    } else if (c == CTRL_DELETED && fi < 0) {
+                        fi = i;
+                    }
+                }
+                EzAtomic::fence_acquire();
+                if (EzAtomic::load_relaxed(&g->seq) == s) break;
+            }
+            if (moved) {
+                p.moved = true;
+            } else if (found >= 0) {
+                p.found_g = g;
+                p.found_i = found;
+                if (value) *value = tmp;
+                return;
+            } else if (fi >= 0 && p.free_g == NULL) {
+                p.free_g = g;
+            }
+            if (empty) return;
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  move_group() / put_moved()                                   */
+/*       Moves the entries of group gi of t to t->next. The slots are kept,   */
+/*       marked as moved, so lookups still stop at the same group.            */
+/*       Return value :  true if the group has an empty slot                  */
+/* -------------------------------------------------------------------------- */
+    void put_moved(Table *t, const K& key, const V& val) {
+        size_t h = hash_of(key);
+        size_t gi = h & t->mask;
+        for (;;) {
+            Group *g = t->group(gi);
+            eztoken_t s = lock_seq(g);
+            for (int i = 0; i < SLOTS; i++) {
+                if (g->ctrl[i] & CTRL_FULL) continue;
+                bool was_empty = g->ctrl[i] == CTRL_EMPTY;
+                g->key[i] = key;
+                g->val[i] = val;
+                g->ctrl[i] = tag_of(h);
+                unlock_seq(g, s);
+                Counter& c = t->counter(g);
+                if (was_empty) EzAtomic::fetch_add(&c.used, (eztoken_t)1);
+                else EzAtomic::fetch_add(&c.dead, (eztoken_t)-1);
+                return;
+            }
+            unlock_seq(g, s);
+            gi = (gi + 1) & t->mask;
+        }
+    };
+
+    bool move_group(Table *t, size_t gi) {
+        Group *g = t->group(gi);
+        Table *nt = EzAtomic::load(&t->next);
+        bool empty = false;
+        eztoken_t s = lock_seq(g);
+        for (int i = 0; i < SLOTS; i++) {
+            if (g->ctrl[i] == CTRL_EMPTY) empty = true;
+            else if (!g->moved && (g->ctrl[i] & CTRL_FULL)) put_moved(nt, g->key[i], g->val[i]);
+        }
+        g->moved = 1;
+        unlock_seq(g, s);
+        return empty;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  help()                                                       */
+/*       Moves the next EZMAP_MIGRATE groups of t. The thread which moves     */
+/*       the last ones makes t->next the current table and retires t.         */
+/*       Return value :  false if there was nothing left to claim             */
+/* -------------------------------------------------------------------------- */
+    bool help(Table *t) {
+        eztoken_t n = (eztoken_t)t->ngroups;
+        eztoken_t c = EzAtomic::fetch_add(&t->claim, (eztoken_t)EZMAP_MIGRATE);
+        if (c >= n) return false;
+        eztoken_t end = (c + EZMAP_MIGRATE < n) ? c + EZMAP_MIGRATE : n;
+        for (eztoken_t gi = c; gi < end; gi++) move_group(t, (size_t)gi);
+        if (EzAtomic::fetch_add(&t->done, (eztoken_t)(end - c)) + (end - c) == n) {
+            EzAtomic::cas(&m_table, t, EzAtomic::load(&t->next));
+            m_epoch.retire(static_cast<void *>(t), &delete_table);
+        }
+        return true;
+    };
+
+    void migrate_chain(Table *t, size_t h) {   /* all the groups a key may be in */
+        size_t gi = h & t->mask;
+        for (size_t n = 0; n < t->ngroups; n++, gi = (gi + 1) & t->mask) {
+            if (move_group(t, gi)) break;
+        }
+    };
+
+    void start_resize(Table *t) {
+        size_t used = 0, dead = 0, live, n;
+        if (EzAtomic::load(&m_table) != t || EzAtomic::load(&t->next) != NULL) return;
+        for (eztoken_t i = 0; i < t->nstripes; i++) {
+            used += (size_t)EzAtomic::load_relaxed(&t->cnt[i].used);
+            dead += (size_t)EzAtomic::load_relaxed(&t->cnt[i].dead);
+        }
+        live = used > dead ? used - dead : 0;
+        for (n = t->ngroups; live * 2 > n * SLOTS; n *= 2) ;   /* half full after */
+        Table *nt = new Table(n);
+        if (EzAtomic::cas(&t->next, (Table *)NULL, nt) != NULL) delete nt;
+        m_epoch.collect();
+    };
+
+    void wait_resize(Table *t) {      /* t is full */
+        for (;;) {
+            Table *cur = EzAtomic::load(&m_table);
+            if (EzAtomic::load(&cur->next) != NULL) {
+                if (!help(cur)) EzMutex::Wait();
+            } else if (cur == t) {
+                start_resize(t);
+            } else {
+                return;
+            }
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  lock_table()                                                 */
+/*       Returns the newest table with the key lock of key's home group       */
+/*       held. Where a resize is going on, it first helps, and moves every    */
+/*       group of the old table where key may be.                             */
+/* -------------------------------------------------------------------------- */
+    Table *lock_table(size_t h) {
+        for (;;) {
+            Table *t = EzAtomic::load(&m_table), *nt;
+            while ((nt = EzAtomic::load(&t->next)) != NULL) {
+                help(t);
+                migrate_chain(t, h);
+                t = nt;
+            }
+            Group *home = t->group(h & t->mask);
+            lock_key(home);
+            if (EzAtomic::load(&t->next) == NULL) return t;
+            unlock_key(home);
+        }
+    };
+
+    template <typename F>
+    bool write(const K& key, const V *val, int op, F& func) {
+        size_t h = hash_of(key);
+        EzEpoch::Guard guard(m_epoch);
+        for (;;) {
+            Table *t = lock_table(h);
+            Group *home = t->group(h & t->mask), *g;
+            Probe p;
+            eztoken_t s;
+            int i;
+
+            probe(t, key, h, p, NULL);
+            if (p.moved) {
+                unlock_key(home);
+                continue;
+            }
+            if (p.found_g) {                    /* the key is there */
+                if (op == OP_INSERT) {
+                    unlock_key(home);
+                    return false;
+                }
+                g = p.found_g;
+                i = p.found_i;
+                s = lock_seq(g);
+                if (g->moved) {
+                    unlock_seq(g, s);
+                    unlock_key(home);
+                    continue;
+                }
+                if (op == OP_ERASE) g->ctrl[i] = CTRL_DELETED;
+                else if (op == OP_MODIFY) func(g->val[i]);
+                else g->val[i] = *val;
+                unlock_seq(g, s);
+                unlock_key(home);
+                if (op == OP_ERASE) EzAtomic::fetch_add(&t->counter(g).dead, (eztoken_t)1);
+                return op != OP_ASSIGN;
+            }
+            if (op != OP_INSERT && op != OP_ASSIGN) {
+                unlock_key(home);
+                return false;
+            }
+            if (p.free_g == NULL) {             /* no room before the end */
+                unlock_key(home);
+                wait_resize(t);
+                continue;
+            }
+            g = p.free_g;
+            s = lock_seq(g);
+            for (i = 0; i < SLOTS && (g->ctrl[i] & CTRL_FULL); i++) ;
+            if (g->moved || i == SLOTS) {       /* moved, or taken meanwhile */
+                unlock_seq(g, s);
+                unlock_key(home);
+                continue;
+            }
+            bool was_empty = g->ctrl[i] == CTRL_EMPTY;
+            g->key[i] = key;
+            g->val[i] = *val;
+            g->ctrl[i] = tag_of(h);
+            unlock_seq(g, s);
+            unlock_key(home);
+            Counter& c = t->counter(g);
+            if (!was_empty) {
+                EzAtomic::fetch_add(&c.dead, (eztoken_t)-1);
+            } else if (EzAtomic::fetch_add(&c.used, (eztoken_t)1) >= t->limit) {
+                start_resize(t);
+            }
+            return true;
+        }
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   CONSTRUCTOR : capacity is the expected number of entries (optional).     */
+/* -------------------------------------------------------------------------- */
+    explicit EzConcurrentMap(size_t capacity = 0, const HASH& hash = HASH()) : m_hash(hash) {
+        size_t n = 4;
+        while (n * SLOTS < capacity * 2) n *= 2;
+        m_table = new Table(n);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   DESTRUCTOR : No thread may use the map any more.                         */
+/* -------------------------------------------------------------------------- */
+    ~EzConcurrentMap() {
+        Table *t = m_table;
+        while (t) {
+            Table *nt = t->next;
+            delete t;
+            t = nt;
+        }
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: find / contains                                                */
+/*      Copies the value of key into value. They never lock nor write to      */
+/*      shared memory (apart from the caller's EzEpoch record).               */
+/*      Return value :  true if found                                         */
+/* -------------------------------------------------------------------------- */
+
+    bool find(const K& key, V& value) const {
+        size_t h = hash_of(key);
+        Probe p;
+        EzEpoch::Guard guard(m_epoch);
+        for (Table *t = EzAtomic::load(&m_table); t; t = EzAtomic::load(&t->next)) {
+            probe(t, key, h, p, &value);
+            if (p.found_g) return true;
+        }
+        return false;
+    };
+
+    bool contains(const K& key) const {
+        V value;
+        return find(key, value);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: insert / assign / update / modify / erase                      */
+/*      insert() : adds key if it is not there. Return value: true if added.  */
+/*      assign() : adds key, or replaces its value. Return value: true if     */
+/*                 added.                                                     */
+/*      update() : replaces the value of key if it is there.                  */
+/*      modify() : calls func(V&) on the value of key if it is there, with    */
+/*                 the group locked. Keep func short.                         */
+/*      erase()  : removes key.                                               */
+/*      Return value of update(), modify() and erase() :  true if found       */
+/* -------------------------------------------------------------------------- */
+
+    bool insert(const K& key, const V& value) {
+        NoFunc f;
+        return write(key, &value, OP_INSERT, f);
+    };
+
+    bool assign(const K& key, const V& value) {
+        NoFunc f;
+        return write(key, &value, OP_ASSIGN, f);
+    };
+
+    bool update(const K& key, const V& value) {
+        NoFunc f;
+        return write(key, &value, OP_UPDATE, f);
+    };
+
+    template <typename F>
+    bool modify(const K& key, F func) {
+        return write(key, (const V *)NULL, OP_MODIFY, func);
+    };
+
+    bool erase(const K& key) {
+        NoFunc f;
+        return write(key, (const V *)NULL, OP_ERASE, f);
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: size / capacity                                                */
+/*      size()     : counts the entries (it reads the whole table). Exact     */
+/*                   when no other thread is writing.                         */
+/*      capacity() : number of slots of the current table.                    */
+/* -------------------------------------------------------------------------- */
+
+    size_t size() const {
+        size_t n = 0;
+        EzEpoch::Guard guard(m_epoch);
+        for (Table *t = EzAtomic::load(&m_table); t; t = EzAtomic::load(&t->next)) {
+            for (size_t gi = 0; gi < t->ngroups; gi++) {
+                Group *g = t->group(gi);
+                if (g->moved) continue;
+                for (int i = 0; i < SLOTS; i++) {
+                    if (g->ctrl[i] & CTRL_FULL) n++;
+                }
+            }
+        }
+        return n;
+    };
+
+    size_t capacity() const {
+        EzEpoch::Guard guard(m_epoch);
+        return EzAtomic::load(&m_table)->ngroups * SLOTS;
+    };
+
+    static int slots_per_group() { return SLOTS; };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: release_thread                                                 */
+/*      Gives back the calling thread's record of the map's EzEpoch. Only a   */
+/*      plain thread on Windows before Vista needs it before it exits.        */
+/* -------------------------------------------------------------------------- */
+
+    void release_thread() { m_epoch.release_thread(); };
+};
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzParallel
+        Runs the iterations of a loop on a shared EzThreadPool. The calling
+        thread works on the loop too, so a call from inside a job never
+        waits for a worker which is not available.
+        The range is split into chunks, and every participant claims
+        chunks through an atomic counter:
+          EZ_PARTITION_STATIC  : one equal chunk per participant
+          EZ_PARTITION_DYNAMIC : chunks of 'grain' iterations (for uneven
+                                 iteration costs)
+        See ez_parallel_for() and ez_parallel_reduce().
+ *****************************************************************************/
+
+#define EZ_PARTITION_STATIC   0x0
+#define EZ_PARTITION_DYNAMIC  0x1
+
+#ifndef EZ_PARALLEL_GRAIN_DIV
+#  define EZ_PARALLEL_GRAIN_DIV  8   /* automatic grain: chunks per participant */
+#endif
+
+class EzParallel
+{
+  private:
+    EzParallel();
+    EzParallel(const EzParallel& src);
+    EzParallel& operator=(const EzParallel& src);
+
+/* -------------------------------------------------------------------------- */
+/*   Ctx : shared state of one call. It is released by the last of the        */
+/*         caller and the submitted jobs, because a job may start after the  */
+/*         call has returned. Body is only touched while chunks are left.    */
+/* -------------------------------------------------------------------------- */
+    template <class Body>
+    struct Ctx {
+        Body     *body;
+        long      begin, end, chunk;
+        eztoken_t nchunks;
+        VOLATILE_ eztoken_t next_chunk;
+        VOLATILE_ eztoken_t next_slot;
+        VOLATILE_ eztoken_t active;     /* participants inside participate() */
+        VOLATILE_ eztoken_t waiters;
+        VOLATILE_ eztoken_t refs;
+
+        void release() {
+            if (EzAtomic::fetch_add(&refs, (eztoken_t)-1) == 1) delete this;
+        };
+    };
+
+    template <class Body>
+    static void participate(Ctx<Body> *c) {
+        eztoken_t k;
+        EzAtomic::fetch_add(&c->active, (eztoken_t)1);
+        k = EzAtomic::fetch_add(&c->next_chunk, (eztoken_t)1);
+        if (k < c->nchunks) {
+            int slot = (int)EzAtomic::fetch_add(&c->next_slot, (eztoken_t)1);
+            do {
+                long b = c->begin + (long)k * c->chunk;
+                long e = (c->end - b > c->chunk) ? b + c->chunk : c->end;
+                c->body->run(b, e, slot);
+                k = EzAtomic::fetch_add(&c->next_chunk, (eztoken_t)1);
+            } while (k < c->nchunks);
+        }
+        if (EzAtomic::fetch_add(&c->active, (eztoken_t)-1) == 1) {
+            EzAtomic::fence();      /* order active before waiters */
+            if (EzAtomic::load_relaxed(&c->waiters)) EzMutex::unpark(&c->active, EZ_UNPARK_ALL);
+        }
+    };
+
+    template <class Body>
+    static void job(void *arg) {
+        Ctx<Body> *c = static_cast<Ctx<Body> *>(arg);
+        participate(c);
+        c->release();
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  pool_storage()                                               */
+/*       The shared pool is created at the first use (cpu_count() - 1         */
+/*       workers) and lives until the process exits.                          */
+/* -------------------------------------------------------------------------- */
+    static EzThreadPool<void *> *pool_storage() {
+        static VOLATILE_ eztoken_t state = 0;   /* 0:none, 1:creating, 2:ready */
+        static EzThreadPool<void *> *pool = NULL;
+        if (EzAtomic::load(&state) != 2) {
+            if (EzAtomic::cas(&state, (eztoken_t)0, (eztoken_t)1) == 0) {
+                int n = EzThreadBase::cpu_count() - 1;
+                if (n > 0) pool = new EzThreadPool<void *>(n);
+                EzAtomic::store(&state, (eztoken_t)2);
+            } else {
+                while (EzAtomic::load(&state) != 2) EzMutex::Wait();
+            }
+        }
+        return pool;
+    };
+
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: concurrency                                                    */
+/*      return value: the maximum number of participants in a call           */
+/*                    (workers of the shared pool + the caller)               */
+/* -------------------------------------------------------------------------- */
+    static int concurrency() {
+        EzThreadPool<void *> *pool = pool_storage();
+        return (pool != NULL) ? pool->size() + 1 : 1;
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: run                                                            */
+/*      Calls body.run(b, e, slot) for every chunk [b, e) of [begin, end),    */
+/*      where 0 <= slot < concurrency() is unique to the participant.         */
+/*      Returns when all the chunks have finished.                            */
+/* -------------------------------------------------------------------------- */
+    template <class Body>
+    static void run(Body& body, long begin, long end, long grain, int partition) {
+        EzThreadPool<void *> *pool = pool_storage();
+        int nparts = concurrency();
+        long n = end - begin;
+        long nchunks;
+        Ctx<Body> *c;
+        eztoken_t a;
+        int i, njobs;
+
+        if (n <= 0) return;
+        if (partition == EZ_PARTITION_STATIC) {
+            if (grain < 1) grain = 1;
+            nchunks = (n + grain - 1) / grain;
+            if (nchunks > nparts) nchunks = nparts;
+            grain = (n + nchunks - 1) / nchunks;
+        } else if (grain < 1) {
+            grain = n / ((long)nparts * EZ_PARALLEL_GRAIN_DIV);
+            if (grain < 1) grain = 1;
+        }
+        while ((nchunks = (n - 1) / grain + 1) > 0x3fffffffL) grain *= 2;
+
+        c = new Ctx<Body>;
+        c->body = &body;
+        c->begin = begin;
+        c->end = end;
+        c->chunk = grain;
+        c->nchunks = (eztoken_t)nchunks;
+        c->next_chunk = c->next_slot = c->active = c->waiters = 0;
+        c->refs = 1;
+        EZ_MEM_BARRIER();
+
+        njobs = (nchunks < nparts) ? (int)nchunks - 1 : nparts - 1;
+        for (i = 0; i < njobs; i++) {
+            EzAtomic::fetch_add(&c->refs, (eztoken_t)1);
+            if (pool->submit(&EzParallel::job<Body>, c) != 0) {
+                EzAtomic::fetch_add(&c->refs, (eztoken_t)-1);
+                break;
+            }
+        }
+
+        participate(c);
+
+        /* no chunk is left: wait for the participants still running one */
+        EzAtomic::fetch_add(&c->waiters, (eztoken_t)1);
+        while ((a = EzAtomic::load(&c->active)) != 0) {
+            EzMutex::park(&c->active, a);
+        }
+        EzAtomic::fetch_add(&c->waiters, (eztoken_t)-1);
+        c->release();
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   Body classes of ez_parallel_for() / ez_parallel_reduce()                 */
+/* -------------------------------------------------------------------------- */
+
+template <typename F>
+class EzParallelForBody
+{
+  public:
+    F &m_func;
+    explicit EzParallelForBody(F& func) : m_func(func) {};
+    void run(long b, long e, int) { for (long i = b; i < e; i++) m_func(i); };
+};
+
+template <typename R, typename M, typename C>
+class EzParallelReduceBody
+{
+  private:
+    EzParallelReduceBody(const EzParallelReduceBody& src);
+    EzParallelReduceBody& operator=(const EzParallelReduceBody& src);
+
+    /* one partial result per participant, on its own cache line */
+    struct Slot {
+        R    value;
+        int  used;
+        char pad[EZ_CACHE_LINE];
+    };
+
+  public:
+    Slot *m_slots;
+    int   m_nslots;
+    R     m_identity;
+    M    &m_map;
+    C    &m_combine;
+
+    EzParallelReduceBody(int nslots, const R& identity, M& map, C& combine)
+        : m_identity(identity), m_map(map), m_combine(combine) {
+        m_nslots = nslots;
+        m_slots = new Slot[nslots];
+        for (int i = 0; i < nslots; i++) {
+            m_slots[i].value = identity;
+            m_slots[i].used = 0;
+        }
+    };
+    ~EzParallelReduceBody() { delete [] m_slots; };
+
+    void run(long b, long e, int slot) {
+        R acc = m_slots[slot].value;
+        for (long i = b; i < e; i++) acc = m_combine(acc, m_map(i));
+        m_slots[slot].value = acc;
+        m_slots[slot].used = 1;
+    };
+
+    R result() {
+        R acc = m_identity;
+        for (int i = 0; i < m_nslots; i++) {
+            if (m_slots[i].used) acc = m_combine(acc, m_slots[i].value);
+        }
+        return acc;
+    };
+};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: ez_parallel_for                                                */
+/*      Calls func(i) for begin <= i < end on the shared pool and the         */
+/*      calling thread, and returns when all the calls have finished.         */
+/*      func is a function or a function object; it is shared (not copied)   */
+/*      by the threads. grain <= 0 chooses a chunk size automatically.        */
+/* -------------------------------------------------------------------------- */
+template <typename F>
+void ez_parallel_for(long begin, long end, long grain, F func,
+                     int partition = EZ_PARTITION_DYNAMIC)
+{
+    EzParallelForBody<F> body(func);
+    EzParallel::run(body, begin, end, grain, partition);
+}
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: ez_parallel_reduce                                             */
+/*      Returns combine(...combine(identity, map(begin))..., map(end - 1))    */
+/*      computed in parallel. combine must be associative and commutative,   */
+/*      since the chunks are accumulated in no particular order.              */
+/* -------------------------------------------------------------------------- */
+template <typename R, typename M, typename C>
+R ez_parallel_reduce(long begin, long end, R identity, M map, C combine,
+                     long grain = 0, int partition = EZ_PARTITION_DYNAMIC)
+{
+    EzParallelReduceBody<R, M, C> body(EzParallel::concurrency(), identity, map, combine);
+    EzParallel::run(body, begin, end, grain, partition);
+    return body.result();
+}
+
+/* -------------------------------------------------------------------------- */
+
+/*****************************************************************************
+      CLASS DEFINITION : EzFiberScheduler
+        User-mode threads (fibers) multiplexed on N EzThreadBase workers.
+        A fiber has its own small stack and is switched by the worker
+        without a system call:
+          x86-64 GCC/Clang (ELF) : a hand-written switch of the callee-
+                                   saved registers and the stack pointer
+          Windows                : the Fiber API (SwitchToFiber)
+          others                 : ucontext (swapcontext), or with
+                                   EZFIBER_USE_UCONTEXT defined
+        A fiber stays on the worker it was given at spawn() (round robin).
+        EzFiber::yield() / sleep(), EzFiberMutex and EzFiberCondVar park
+        the fiber, not the worker thread. Any other blocking call (I/O,
+        EzMutex, millisleep...) blocks every fiber of the worker.
+        Finished fibers and their stacks are kept for the next spawn().
+        The stacks are mapped EZFIBER_SLAB at a time, without guard pages
+        unless EZFIBER_GUARD_PAGE is defined (a guard page costs a memory
+        mapping per fiber, which vm.max_map_count limits on Linux).
+ *****************************************************************************/
+
+#if defined(_WIN32)
+#  define EZFIBER_WIN32__
+#elif defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__) && !defined(EZFIBER_USE_UCONTEXT)
+#  define EZFIBER_ASM__
+#else
+#  define EZFIBER_UCONTEXT__
+#  include <ucontext.h>     /* getcontext(), makecontext(), swapcontext() */
+#endif
+#include <string.h>         /* memcpy() */
+#if !defined(_WIN32)
+#  include <sys/mman.h>     /* mmap(), mprotect() */
+#endif
+
+#ifndef EZFIBER_STACK
+#  define EZFIBER_STACK     (64 * 1024)  /* default stack size in bytes     */
+#endif
+#ifndef EZFIBER_SLAB
+#  define EZFIBER_SLAB      32           /* stacks per memory mapping       */
+#endif
+
+#ifdef EZFIBER_ASM__
+/* -------------------------------------------------------------------------- */
+/*   ez_fiber_switch__(save, sp) : saves the callee-saved registers, MXCSR    */
+/*       and the x87 control word on the stack, stores the stack pointer      */
+/*       into *save, and resumes the context saved at sp.                     */
+/*   ez_fiber_start__ : the first return address of a new fiber. It calls     */
+/*       r13(r12), which never returns.                                       */
+/*   The symbols are weak, so every translation unit can define them.         */
+/* -------------------------------------------------------------------------- */
+extern "C" void ez_fiber_switch__(void **save, void *sp);
+extern "C" void ez_fiber_start__(void);
+__asm__(
+    ".text\n"
+    ".weak   ez_fiber_switch__\n"
+    ".hidden ez_fiber_switch__\n"
+    ".type   ez_fiber_switch__, @function\n"
+    "ez_fiber_switch__:\n"
+    "    pushq   %rbp\n"
+    "    pushq   %rbx\n"
+    "    pushq   %r12\n"
+    "    pushq   %r13\n"
+    "    pushq   %r14\n"
+    "    pushq   %r15\n"
+    "    subq    $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw  4(%rsp)\n"
+    "    movq    %rsp, (%rdi)\n"
+    "    movq    %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw   4(%rsp)\n"
+    "    addq    $8, %rsp\n"
+    "    popq    %r15\n"
+    "    popq    %r14\n"
+    "    popq    %r13\n"
+    "    popq    %r12\n"
+    "    popq    %rbx\n"
+    "    popq    %rbp\n"
+    "    ret\n"
+    ".size   ez_fiber_switch__, .-ez_fiber_switch__\n"
+    ".weak   ez_fiber_start__\n"
+    ".hidden ez_fiber_start__\n"
+    ".type   ez_fiber_start__, @function\n"
+    "ez_fiber_start__:\n"
+    "    movq    %r12, %rdi\n"
+    "    callq   *%r13\n"
+    "    ud2\n"
+    ".size   ez_fiber_start__, .-ez_fiber_start__\n"
+);
+#endif
+
+class EzFiber;
+class EzFiberMutex;
+class EzFiberCondVar;
+
+class EzFiberScheduler
+{
+/* ------------ force EzFiberScheduler to be Noncopyable-class -------------- */
+  private:
+
+    EzFiberScheduler(const EzFiberScheduler& src);
+    EzFiberScheduler& operator=(const EzFiberScheduler& src);
+
+    friend class EzFiber;
+    friend class EzFiberMutex;
+    friend class EzFiberCondVar;
+
+    class Worker;
+
+    enum { RUN_YIELD, RUN_BLOCK, RUN_SLEEP, RUN_EXIT };
+
+/* -------------------------------------------------------------------------- */
+/*   Fiber : a stack with a saved context. It is reused after the fiber       */
+/*           function returns, so its entry function never returns.           */
+/* -------------------------------------------------------------------------- */
+    struct Fiber {
+        Fiber     *next;      /* run queue, wait queue or cache       */
+        void     (*func)(void *);
+        void      *arg;
+        Worker    *worker;
+        ezint64_t  wake_ns;   /* RUN_SLEEP : nanotime() to wake at    */
+        int        action;    /* why it switched back to the worker   */
+#if defined(EZFIBER_ASM__)
+        void      *sp;
+#elif defined(EZFIBER_UCONTEXT__)
+        ucontext_t uc;
+#else
+        LPVOID     handle;
+#endif
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   Worker : a thread which runs the fibers given to it.                     */
+/*       m_head..m_tail and m_heap are touched by the worker only. Other      */
+/*       threads hand fibers over through m_remote (a CAS push list).         */
+/* -------------------------------------------------------------------------- */
+    class Worker : public EzThreadBase {
+      public:
+        EzFiberScheduler *m_sched;
+        Fiber     *m_current;
+        Fiber     *m_head, *m_tail;    /* runnable fibers                 */
+        Fiber    **m_heap;             /* sleeping fibers, by wake_ns     */
+        int        m_nheap, m_heap_cap;
+#if defined(EZFIBER_ASM__)
+        void      *m_sp;
+#elif defined(EZFIBER_UCONTEXT__)
+        ucontext_t m_uc;
+#else
+        LPVOID     m_main;
+#endif
+        char       m_pad0[EZ_CACHE_LINE];
+        Fiber * VOLATILE_ m_remote;    /* fibers made runnable elsewhere  */
+        VOLATILE_ eztoken_t m_signal;  /* bumped to wake the worker       */
+        VOLATILE_ eztoken_t m_idle;    /* 1 while the worker parks        */
+        char       m_pad1[EZ_CACHE_LINE];
+
+        Worker() {
+            m_sched = NULL;
+            m_current = m_head = m_tail = NULL;
+            m_heap = NULL;
+            m_nheap = m_heap_cap = 0;
+            m_remote = NULL;
+            m_signal = m_idle = 0;
+        };
+        ~Worker() { join(); delete [] m_heap; };
+      private:
+        void app() { m_sched->worker_main(this); };
+    };
+    friend class Worker;
+
+    Worker    *m_workers;
+    int        m_nworkers;
+    size_t     m_stack_size;
 
-    EzMutex      mtx_thread_state;   /* mutex for m_ThreadState_              */
+    EzMutex    mtx_cache;      /* guards the members below            */
+    Fiber     *m_cache;        /* finished fibers                     */
+    char      *m_slab;         /* unused part of the newest slab      */
+    int        m_slab_left;
+    void     **m_slabs;        /* every slab, unmapped at deletion    */
+    int        m_nslabs, m_slabs_cap;
+    Fiber    **m_all;          /* every fiber, deleted at deletion    */
+    int        m_nall, m_all_cap;
+
+    VOLATILE_ eztoken_t m_next;     /* round robin for spawn()             */
+    VOLATILE_ eztoken_t m_live;     /* fibers spawned but not finished     */
+    VOLATILE_ eztoken_t m_waiters;  /* threads blocked in wait_all()       */
+    VOLATILE_ eztoken_t m_stop;
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION :  setThreadState()                                             */
-/*       This function is used to set a member variable "m_ThreadState_"      */
-/*       with mutex guard for thread-safe.                                    */
+/*   FUNCTION :  current_worker()                                             */
+/*       return value: the worker running on the calling thread, or NULL      */
 /* -------------------------------------------------------------------------- */
-    void setThreadState(int state) {
-        mtx_thread_state.lock();
-        m_ThreadState_ = state;
-        mtx_thread_state.unlock();
+#ifdef USE_WIN_THREAD
+    static DWORD tls_key() {
+        static VOLATILE_ long state = 0;   /* 0:none, 1:allocating, 2:ready */
+        static DWORD key = TLS_OUT_OF_INDEXES;
+        if (state != 2) {
+            if (EzAtomic::cas(&state, 0L, 1L) == 0) {
+                key = TlsAlloc();
+                EZ_MEM_BARRIER();
+                state = 2;
+            } else {
+                while (state != 2) EzMutex::Wait();
+            }
+        }
+        return key;
+    };
+    static Worker *current_worker() {
+        return static_cast<Worker *>(TlsGetValue(tls_key()));
+    };
+    static void set_current_worker(Worker *w) { TlsSetValue(tls_key(), w); };
+#else
+    static pthread_key_t& tls_key_storage() {
+        static pthread_key_t key;
+        return key;
+    };
+    static void tls_key_create() {
+        pthread_key_create(&tls_key_storage(), NULL);
+    };
+    static pthread_key_t tls_key() {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once(&once, &tls_key_create);
+        return tls_key_storage();
+    };
+    static Worker *current_worker() {
+        return static_cast<Worker *>(pthread_getspecific(tls_key()));
+    };
+    static void set_current_worker(Worker *w) { pthread_setspecific(tls_key(), w); };
+#endif
+
+    static Fiber *current_fiber() {
+        Worker *w = current_worker();
+        return w ? w->m_current : NULL;
     };
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION :  m_ThreadFuncWrapper()                                        */
-/*       m_ThreadFuncWrapper() is a static member function                    */
-/*       which invokes app() method in a thread.                              */
+/*   FUNCTION :  fiber_main() / switch_out() / switch_in()                    */
+/*       fiber_main() runs the fiber functions given to a Fiber, one after    */
+/*       another. switch_out() returns from a fiber to its worker, and        */
+/*       switch_in() from a worker to a fiber.                                */
 /* -------------------------------------------------------------------------- */
+    static void fiber_main(Fiber *f) {
+        for (;;) {
+            f->func(f->arg);
+            f->action = RUN_EXIT;
+            switch_out(f);
+        }
+    };
 
-#ifdef USE_WIN_THREAD
-    static unsigned __stdcall m_ThreadFuncWrapper(void* arg) {
-        static_cast<EzThreadBase *>(arg)->setThreadState(EZTH_RUNNING);
-        static_cast<EzThreadBase *>(arg)->app();
-        static_cast<EzThreadBase *>(arg)->setThreadState(EZTH_FINISHED);
-        return 0;
+#if defined(EZFIBER_ASM__)
+    static void fiber_entry(void *p) { fiber_main(static_cast<Fiber *>(p)); };
+    static void switch_out(Fiber *f) { ez_fiber_switch__(&f->sp, f->worker->m_sp); };
+    static void switch_in(Worker *w, Fiber *f) { ez_fiber_switch__(&w->m_sp, f->sp); };
+#elif defined(EZFIBER_UCONTEXT__)
+    static void fiber_entry(unsigned int hi, unsigned int lo) {
+        unsigned long long p = ((unsigned long long)hi << 32) | lo;
+        fiber_main(reinterpret_cast<Fiber *>((size_t)p));
     };
+    static void switch_out(Fiber *f) { swapcontext(&f->uc, &f->worker->m_uc); };
+    static void switch_in(Worker *w, Fiber *f) { swapcontext(&w->m_uc, &f->uc); };
 #else
-    static void* m_ThreadFuncWrapper(void *arg) {
-        static_cast<EzThreadBase *>(arg)->setThreadState(EZTH_RUNNING);
-        static_cast<EzThreadBase *>(arg)->app();
-        static_cast<EzThreadBase *>(arg)->setThreadState(EZTH_FINISHED);
-        return NULL;
-    };
+    static VOID CALLBACK fiber_entry(LPVOID p) { fiber_main(static_cast<Fiber *>(p)); };
+    static void switch_out(Fiber *f) { SwitchToFiber(f->worker->m_main); };
+    static void switch_in(Worker *w, Fiber *f) { (void)w; SwitchToFiber(f->handle); };
 #endif
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION: app                                                            */
-/*   A user routine to be executed on a thread.                               */
-/*   It should be a pure virtual function to force the user to implement it.  */
+/*   FUNCTION :  suspend()                                                    */
+/*       Switches from the current fiber to its worker, which then handles    */
+/*       action. RUN_BLOCK leaves the fiber until wake() is called on it.     */
 /* -------------------------------------------------------------------------- */
+    static void suspend(Fiber *f, int action) {
+        f->action = action;
+        switch_out(f);
+    };
 
-  protected:
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  wake()                                                       */
+/*       Makes a blocked fiber runnable. From its own worker thread, it goes  */
+/*       to the local run queue. Otherwise it is pushed onto the worker's     */
+/*       m_remote, which the worker takes only after the fiber has switched  */
+/*       out, so wake() may be called before the fiber has blocked.           */
+/* -------------------------------------------------------------------------- */
+    static void wake(Fiber *f) {
+        Worker *w = f->worker;
+        if (current_worker() == w) {
+            push_local(w, f);
+            return;
+        }
+        Fiber *head = EzAtomic::load(&w->m_remote), *prev;
+        for (;;) {
+            f->next = head;
+            prev = EzAtomic::cas(&w->m_remote, head, f);
+            if (prev == head) break;
+            head = prev;
+        }
+        EzAtomic::fence();          /* pairs with the fence in worker_main() */
+        if (EzAtomic::load(&w->m_idle)) {
+            EzAtomic::fetch_add(&w->m_signal, (eztoken_t)1);
+            EzMutex::unpark(&w->m_signal, 1);
+        }
+    };
 
-    virtual void app() = 0;
+    static void push_local(Worker *w, Fiber *f) {
+        f->next = NULL;
+        if (w->m_tail) w->m_tail->next = f;
+        else           w->m_head = f;
+        w->m_tail = f;
+    };
 
 /* -------------------------------------------------------------------------- */
-/*   CONSTRUCTOR                                                              */
+/*   FUNCTION :  take_remote()                                                */
+/*       Moves m_remote to the local run queue, in the order of the pushes.   */
 /* -------------------------------------------------------------------------- */
+    static void take_remote(Worker *w) {
+        Fiber *f, *rev = NULL;
+        if (EzAtomic::load_relaxed(&w->m_remote) == NULL) return;
+        f = EzAtomic::exchange(&w->m_remote, (Fiber *)NULL);
+        while (f) {
+            Fiber *next = f->next;
+            f->next = rev;
+            rev = f;
+            f = next;
+        }
+        while (rev) {
+            Fiber *next = rev->next;
+            push_local(w, rev);
+            rev = next;
+        }
+    };
 
-    EzThreadBase() {
-        m_IsThreadCreated_ = m_ThreadState_ = 0;
-        mtx_thread_state.unlock();
-#ifdef USE_WIN_THREAD
-        m_ThreadHandle_ = NULL;
-        // m_ThreadId_ = 0;
-#else
-        m_ThreadHandle_ = pthread_self();
-        // m_ThreadId_ = m_ThreadHandle_;
-#endif
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  heap_push() / heap_pop()                                     */
+/*       A binary min-heap of the sleeping fibers, by wake_ns.                */
+/* -------------------------------------------------------------------------- */
+    static void heap_push(Worker *w, Fiber *f) {
+        int i;
+        if (w->m_nheap == w->m_heap_cap) {
+            int ncap = w->m_heap_cap ? w->m_heap_cap * 2 : 64;
+            Fiber **p = new Fiber *[ncap];
+            for (i = 0; i < w->m_nheap; i++) p[i] = w->m_heap[i];
+            delete [] w->m_heap;
+            w->m_heap = p;
+            w->m_heap_cap = ncap;
+        }
+        for (i = w->m_nheap++; i > 0; i = (i - 1) / 2) {
+            Fiber *parent = w->m_heap[(i - 1) / 2];
+            if (parent->wake_ns <= f->wake_ns) break;
+            w->m_heap[i] = parent;
+        }
+        w->m_heap[i] = f;
+    };
+
+    static Fiber *heap_pop(Worker *w) {
+        Fiber *top = w->m_heap[0], *last = w->m_heap[--w->m_nheap];
+        int i = 0, c;
+        while ((c = 2 * i + 1) < w->m_nheap) {
+            if (c + 1 < w->m_nheap && w->m_heap[c + 1]->wake_ns < w->m_heap[c]->wake_ns) c++;
+            if (last->wake_ns <= w->m_heap[c]->wake_ns) break;
+            w->m_heap[i] = w->m_heap[c];
+            i = c;
+        }
+        if (w->m_nheap > 0) w->m_heap[i] = last;
+        return top;
     };
 
 /* -------------------------------------------------------------------------- */
-/*   DESTRUCTOR                                                               */
-/*       This destructor must be a virtual function in order that             */
-/*       a destructor in the derived class never fail to be called.           */
+/*   FUNCTION :  make_context()                                               */
+/*       Prepares f to start fiber_main(f) on the given stack.                */
 /* -------------------------------------------------------------------------- */
+#if defined(EZFIBER_ASM__)
+    static void make_context(Fiber *f, char *stack, size_t size) {
+        /* the frame popped by ez_fiber_switch__(), see above */
+        void **a = (void **)(((size_t)(stack + size) & ~(size_t)15) - 16);
+        unsigned int csr[2];
+        csr[0] = 0x1F80;                      /* MXCSR default         */
+        csr[1] = 0x037F;                      /* x87 control default   */
+        a[-1] = (void *)&ez_fiber_start__;    /* return address        */
+        a[-2] = a[-3] = NULL;                 /* rbp, rbx              */
+        a[-4] = (void *)f;                    /* r12 : argument        */
+        a[-5] = (void *)&fiber_entry;         /* r13 : function        */
+        a[-6] = a[-7] = NULL;                 /* r14, r15              */
+        memcpy(&a[-8], csr, sizeof(csr));
+        f->sp = &a[-8];
+    };
+#elif defined(EZFIBER_UCONTEXT__)
+    static void make_context(Fiber *f, char *stack, size_t size) {
+        unsigned long long p = (unsigned long long)(size_t)f;
+        getcontext(&f->uc);
+        f->uc.uc_stack.ss_sp = stack;
+        f->uc.uc_stack.ss_size = size;
+        f->uc.uc_link = NULL;
+        makecontext(&f->uc, (void (*)())&fiber_entry, 2,
+                    (unsigned int)(p >> 32), (unsigned int)(p & 0xffffffffUL));
+    };
+#endif
 
-  public:
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION :  new_fiber() / free_fiber()                                   */
+/*       new_fiber() takes a finished fiber, or makes one with a stack from   */
+/*       the current slab. Called with mtx_cache locked.                      */
+/*       Return value :  a fiber,  NULL:allocation failure                    */
+/* -------------------------------------------------------------------------- */
+    template <typename T>
+    static int grow(T *&arr, int n, int &cap) {
+        if (n < cap) return 0;
+        int ncap = cap ? cap * 2 : 64;
+        T *p = new T[ncap];
+        if (p == NULL) return -1;
+        for (int i = 0; i < n; i++) p[i] = arr[i];
+        delete [] arr;
+        arr = p;
+        cap = ncap;
+        return 0;
+    };
 
-    virtual ~EzThreadBase() {
-#ifdef USE_WIN_THREAD
-        if (m_ThreadHandle_) {
-            CloseHandle(m_ThreadHandle_);
-            // m_ThreadHandle_ = NULL;
+    Fiber *new_fiber() {
+        Fiber *f = m_cache;
+        if (f != NULL) {
+            m_cache = f->next;
+            return f;
+        }
+        if (grow(m_all, m_nall, m_all_cap)) return NULL;
+        f = new Fiber;
+        if (f == NULL) return NULL;
+#if defined(EZFIBER_WIN32__)
+        f->handle = CreateFiber(m_stack_size, &fiber_entry, f);
+        if (f->handle == NULL) {
+            delete f;
+            return NULL;
         }
 #else
-        if (!pthread_equal(m_ThreadHandle_, pthread_self())) {
-            pthread_detach(m_ThreadHandle_);
-            // m_ThreadHandle_ = pthread_self();
+        if (m_slab_left == 0) {
+            void *p;
+            int flags = MAP_PRIVATE | MAP_ANON;
+#  ifdef MAP_NORESERVE
+            flags |= MAP_NORESERVE;
+#  endif
+            if (grow(m_slabs, m_nslabs, m_slabs_cap)) {
+                delete f;
+                return NULL;
+            }
+            p = mmap(NULL, m_stack_size * EZFIBER_SLAB, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p == MAP_FAILED) {
+                delete f;
+                return NULL;
+            }
+            m_slabs[m_nslabs++] = p;
+            m_slab = static_cast<char *>(p);
+            m_slab_left = EZFIBER_SLAB;
         }
+        char *stack = m_slab;
+        m_slab += m_stack_size;
+        m_slab_left--;
+#  ifdef EZFIBER_GUARD_PAGE
+        mprotect(stack, (size_t)sysconf(_SC_PAGESIZE), PROT_NONE);
+#  endif
+        make_context(f, stack, m_stack_size);
 #endif
+        m_all[m_nall++] = f;
+        return f;
+    };
+
+    void free_fiber(Fiber *f) {
+        mtx_cache.lock();
+        f->next = m_cache;
+        m_cache = f;
+        mtx_cache.unlock();
     };
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION: get_thread_id                                                  */
+/*   FUNCTION :  worker_main()                                                */
+/*       Runs the runnable fibers, wakes the sleeping ones when they are      */
+/*       due, and parks when there is nothing to do.                          */
 /* -------------------------------------------------------------------------- */
+    void worker_main(Worker *w) {
+        Fiber *f;
+        eztoken_t sig;
 
-    // threadid_t get_thread_id() const { return m_ThreadId_; }
+        set_current_worker(w);
+#if defined(EZFIBER_WIN32__)
+        w->m_main = ConvertThreadToFiber(NULL);
+#endif
+        for (;;) {
+            take_remote(w);
+            if (w->m_nheap > 0) {
+                ezint64_t now = EzMutex::nanotime();
+                while (w->m_nheap > 0 && w->m_heap[0]->wake_ns <= now) {
+                    push_local(w, heap_pop(w));
+                }
+            }
+            if ((f = w->m_head) != NULL) {
+                w->m_head = f->next;
+                if (w->m_head == NULL) w->m_tail = NULL;
+                w->m_current = f;
+                switch_in(w, f);
+                w->m_current = NULL;
+                switch (f->action) {
+                  case RUN_YIELD:
+                    push_local(w, f);
+                    break;
+                  case RUN_SLEEP:
+                    heap_push(w, f);
+                    break;
+                  case RUN_EXIT:
+                    free_fiber(f);
+                    if (EzAtomic::fetch_add(&m_live, (eztoken_t)-1) == 1) {
+                        EzAtomic::fence();      /* order m_live before m_waiters */
+                        if (EzAtomic::load_relaxed(&m_waiters)) EzMutex::unpark(&m_live, EZ_UNPARK_ALL);
+                    }
+                    break;
+                  default:   /* RUN_BLOCK : wake() will bring it back */
+                    break;
+                }
+                continue;
+            }
+            if (EzAtomic::load(&m_stop)) break;
+
+            sig = EzAtomic::load(&w->m_signal);
+            EzAtomic::exchange(&w->m_idle, (eztoken_t)1);
+            EzAtomic::fence();      /* order m_idle before m_remote */
+            if (EzAtomic::load(&w->m_remote) == NULL && !EzAtomic::load(&m_stop)) {
+                if (w->m_nheap > 0) {
+                    EzMutex::park(&w->m_signal, sig, w->m_heap[0]->wake_ns - EzMutex::nanotime());
+                } else {
+                    EzMutex::park(&w->m_signal, sig);
+                }
+            }
+            EzAtomic::store(&w->m_idle, (eztoken_t)0);
+        }
+#if defined(EZFIBER_WIN32__) && defined(_WIN32_WINNT) && (_WIN32_WINNT >= 0x0501)
+        ConvertFiberToThread();   /* XP or later; otherwise freed at exit */
+#endif
+        set_current_worker(NULL);
+    };
+
+  public:
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION: get_[win|posix]_thread_handle                                  */
+/*   CONSTRUCTOR                                                              */
+/*       nthreads <= 0 : one worker per processor                             */
+/*       stack_size    : the stack of every fiber (EZFIBER_STACK if 0)        */
+/*       placement     : EZPLACE_NONE, EZPLACE_CPU or EZPLACE_NODE            */
+/*       attr          : attributes given to every worker thread              */
 /* -------------------------------------------------------------------------- */
 
-#ifdef USE_WIN_THREAD
-    HANDLE get_win_thread_handle() const { return m_ThreadHandle_; }
-#else
-    pthread_t get_posix_thread_handle() const { return m_ThreadHandle_; }
+    explicit EzFiberScheduler(int nthreads = 0, size_t stack_size = 0,
+                              int placement = EZPLACE_NONE,
+                              const EzThreadAttr& worker_attr = EzThreadAttr())
+        : mtx_cache(EZMTX_ADAPTIVE, "EzFiberScheduler.cache") {
+        EzThreadAttr attr(worker_attr);
+        size_t page = 4096;
+#if !defined(_WIN32)
+        page = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+        if (nthreads <= 0) nthreads = EzThreadBase::cpu_count();
+        if (stack_size == 0) stack_size = EZFIBER_STACK;
+        m_stack_size = (stack_size + page - 1) / page * page;
+        m_cache = NULL;
+        m_slab = NULL;
+        m_slab_left = 0;
+        m_slabs = NULL;
+        m_nslabs = m_slabs_cap = 0;
+        m_all = NULL;
+        m_nall = m_all_cap = 0;
+        m_next = m_live = m_waiters = m_stop = 0;
+        m_workers = new Worker[nthreads];
+        m_nworkers = nthreads;
+        for (int i = 0; i < nthreads; i++) m_workers[i].m_sched = this;
+        EZ_MEM_BARRIER();
+        for (int i = 0; i < nthreads; i++) {
+            if (placement != EZPLACE_NONE) attr.place(placement, i);
+            m_workers[i].set_thread_attr(attr);
+            if (m_workers[i].run()) {   /* thread creation failure */
+                m_nworkers = i;
+                break;
+            }
+        }
+    };
+
+    virtual ~EzFiberScheduler() {
+        int i;
+        shutdown();
+        delete [] m_workers;
+        for (i = 0; i < m_nall; i++) {
+#if defined(EZFIBER_WIN32__)
+            DeleteFiber(m_all[i]->handle);
+#endif
+            delete m_all[i];
+        }
+        delete [] m_all;
+#if !defined(_WIN32)
+        for (i = 0; i < m_nslabs; i++) munmap(m_slabs[i], m_stack_size * EZFIBER_SLAB);
 #endif
+        delete [] m_slabs;
+    };
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION: status                                                         */
-/*      get the status of this thread                                         */
-/*   return value:                                                            */
-/*      0:unexecuted, 1:creating, 2:created and running, 4:finished, 8:joined */
+/*   FUNCTION: spawn                                                          */
+/*      Starts func(arg) as a fiber on the next worker (round robin).         */
+/*      It can be called from any thread, including a fiber.                  */
+/*      Return value :  0:success  -1:error (shut down or out of memory)      */
 /* -------------------------------------------------------------------------- */
 
-    int status() {
-        int ret;
-        mtx_thread_state.lock();
-        ret = m_ThreadState_;
-        mtx_thread_state.unlock();
-        return ret;
-    }
+    int spawn(void (*func)(void *), void *arg) {
+        Fiber *f;
+        if (func == NULL || m_nworkers == 0 || EzAtomic::load(&m_stop)) return -1;
+        mtx_cache.lock();
+        f = new_fiber();
+        mtx_cache.unlock();
+        if (f == NULL) return -1;
+        f->func = func;
+        f->arg = arg;
+        f->worker = &m_workers[(unsigned)EzAtomic::fetch_add(&m_next, (eztoken_t)1) % (unsigned)m_nworkers];
+        EzAtomic::fetch_add(&m_live, (eztoken_t)1);
+        wake(f);
+        return 0;
+    };
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION: run                                                            */
-/*      This function creates and starts a thread.                            */
-/*      > Invokes app() method on a thread via m_ThreadFuncWrapper()          */
-/*      Return value :  0:success  -1:error                                   */
+/*   FUNCTION: wait_all                                                       */
+/*      Blocks until every spawned fiber has finished.                        */
+/*      Do not call it from a fiber.                                          */
 /* -------------------------------------------------------------------------- */
 
-    DO_NOT_OVERRIDE__  int run()  OVERRIDE_IS_PROHIBITED__
-    {
-        if(!m_IsThreadCreated_) {
-            m_ThreadState_ = EZTH_CREATING;
-            EZ_MEM_BARRIER();
-#ifdef USE_WIN_THREAD
-            unsigned dummy;  /* Digital Mars requires the 6th arg of _beginthreadex. */
-                             /* Other compilers do not require it (allow NULL).      */
-            m_ThreadHandle_ = (HANDLE)_beginthreadex(NULL, 0, &m_ThreadFuncWrapper,
-                                                  this, 0, &dummy);
-            if (m_ThreadHandle_ == (HANDLE)0L)    /* Fail */
-            {
-                m_ThreadHandle_ = NULL;
-                m_ThreadState_ = EZTH_UNEXEC;
-            } else {                              /* Success */
-                m_IsThreadCreated_ = -1;
-            }
-#else
-            if( pthread_create(&m_ThreadHandle_, NULL,
-                               &m_ThreadFuncWrapper,
-                               this) /* !=0 */ )  /* Fail */
-            {
-                m_ThreadHandle_ = pthread_self();
-                m_ThreadState_ = EZTH_UNEXEC;
-            } else {                              /* Success */
-                m_IsThreadCreated_ = -1;
-                // m_ThreadId_ = m_ThreadHandle_;
-            }
-#endif
+    void wait_all() {
+        eztoken_t n;
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)1);
+        while ((n = EzAtomic::load(&m_live)) != 0) {
+            EzMutex::park(&m_live, n);
         }
-        return (m_IsThreadCreated_ ? 0 : -1);
+        EzAtomic::fetch_add(&m_waiters, (eztoken_t)-1);
     };
 
 /* -------------------------------------------------------------------------- */
-/*   FUNCTION: join                                                           */
-/*      This function waits until the thread finishes.                        */
-/*      Return value :  0:success  -1:error                                   */
+/*   FUNCTION: shutdown                                                       */
+/*      Waits for the fibers and joins the workers.                           */
+/*      It is called automatically at the object deletion.                    */
 /* -------------------------------------------------------------------------- */
 
-    DO_NOT_OVERRIDE__  int join()  OVERRIDE_IS_PROHIBITED__
-    {
-        if(m_IsThreadCreated_) {
-#ifdef USE_WIN_THREAD
-            if (m_ThreadHandle_) {
-                if (WaitForSingleObject(m_ThreadHandle_, INFINITE) == WAIT_OBJECT_0) {
-                    CloseHandle(m_ThreadHandle_);
-                    m_ThreadHandle_ = NULL;
-                    m_IsThreadCreated_ = 0;
-                    EZ_MEM_BARRIER();
-                    m_ThreadState_ = EZTH_JOINED;
-                }
-            }
-#else
-            if (!pthread_equal(m_ThreadHandle_, pthread_self())) {
-                if (pthread_join(m_ThreadHandle_, NULL) == 0) {
-                    m_ThreadHandle_ = pthread_self();
-                    m_IsThreadCreated_ = 0;
-                    EZ_MEM_BARRIER();
-                    m_ThreadState_ = EZTH_JOINED;
-                }
-            }
-#endif
+    void shutdown() {
+        if (m_nworkers > 0) wait_all();
+        EzAtomic::store(&m_stop, (eztoken_t)1);
+        for (int i = 0; i < m_nworkers; i++) {
+            EzAtomic::fetch_add(&m_workers[i].m_signal, (eztoken_t)1);
+            EzMutex::unpark(&m_workers[i].m_signal, 1);
         }
-        return (m_IsThreadCreated_ ? -1 : 0);
+        for (int i = 0; i < m_nworkers; i++) m_workers[i].join();
     };
 
+    int size() const { return m_nworkers; };
+    int live() const { return (int)EzAtomic::load(&m_live); };
+    size_t stack_size() const { return m_stack_size; };
 };
 
+/*****************************************************************************
+      CLASS DEFINITION : EzFiber
+        Functions for the running fiber. Called from a plain thread, they
+        act on the thread instead: yield() gives up the time slice and
+        sleep() sleeps.
+ *****************************************************************************/
+
+class EzFiber
+{
+  public:
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: yield                                                          */
+/*      Lets the other runnable fibers of the worker run first.               */
+/* -------------------------------------------------------------------------- */
+
+    static void yield() {
+        EzFiberScheduler::Fiber *f = EzFiberScheduler::current_fiber();
+        if (f) EzFiberScheduler::suspend(f, EzFiberScheduler::RUN_YIELD);
+        else   EzMutex::Wait();
+    };
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: sleep / sleep_ns                                               */
+/*      Parks the fiber for ms milliseconds (ns nanoseconds). The worker      */
+/*      runs other fibers meanwhile.                                          */
+/* -------------------------------------------------------------------------- */
+
+    static void sleep_ns(ezint64_t ns) {
+        EzFiberScheduler::Fiber *f = EzFiberScheduler::current_fiber();
+        if (f == NULL) {
+            EzMutex::nanosleep_for(ns);
+            return;
+        }
+        f->wake_ns = EzMutex::nanotime() + ns;
+        EzFiberScheduler::suspend(f, EzFiberScheduler::RUN_SLEEP);
+    };
+
+    static void sleep(unsigned long ms) { sleep_ns((ezint64_t)ms * 1000000); };
 
 /* -------------------------------------------------------------------------- */
+/*   FUNCTION: in_fiber / current                                             */
+/*      in_fiber() : true if the caller is a fiber                            */
+/*      current()  : an id of the running fiber, NULL on a plain thread       */
+/* -------------------------------------------------------------------------- */
+
+    static bool in_fiber() { return EzFiberScheduler::current_fiber() != NULL; };
+    static void *current() { return EzFiberScheduler::current_fiber(); };
+};
 
 /*****************************************************************************
-      CLASS DEFINITION : EzThread
+      CLASS DEFINITION : EzFiberMutex
+        A mutex which parks a waiting fiber and lets its worker run other
+        fibers. unlock() hands the mutex to the first waiter (FIFO).
+        A plain thread may use it too, but it spins while waiting.
  *****************************************************************************/
 
-template <typename TYPE>
-class EzThread : private EzThreadBase
+class EzFiberMutex
 {
   private:
-    void (*m_func)(TYPE);
-    TYPE m_arg;
-    void app() { m_func(m_arg); };
+    EzFiberMutex(const EzFiberMutex& src);
+    EzFiberMutex& operator=(const EzFiberMutex& src);
+
+    friend class EzFiberCondVar;
+    typedef EzFiberScheduler::Fiber Fiber;
+
+    VOLATILE_ eztoken_t m_guard;   /* spin lock for the members below */
+    int    m_locked;
+    Fiber *m_head, *m_tail;        /* parked fibers                   */
+
+    void guard_lock() {
+        while (EzAtomic::exchange(&m_guard, (eztoken_t)1) != 0) {
+            while (EzAtomic::load_relaxed(&m_guard) != 0) EzAtomic::relax();
+        }
+    };
+    void guard_unlock() { EzAtomic::store(&m_guard, (eztoken_t)0); };
 
   public:
+    EzFiberMutex() {
+        m_guard = 0;
+        m_locked = 0;
+        m_head = m_tail = NULL;
+    };
+    ~EzFiberMutex() {};
 
-    virtual ~EzThread() { wait(); };
-    EzThread() {
-        m_func = NULL;
+    void lock() {
+        Fiber *self = EzFiberScheduler::current_fiber();
+        for (;;) {
+            guard_lock();
+            if (!m_locked) {
+                m_locked = 1;
+                guard_unlock();
+                return;
+            }
+            if (self == NULL) {          /* plain thread */
+                guard_unlock();
+                EzMutex::Wait();
+                continue;
+            }
+            self->next = NULL;
+            if (m_tail) m_tail->next = self;
+            else        m_head = self;
+            m_tail = self;
+            guard_unlock();
+            EzFiberScheduler::suspend(self, EzFiberScheduler::RUN_BLOCK);
+            return;                      /* unlock() handed it over */
+        }
     };
-    EzThread(void(*func)(TYPE), TYPE arg) {
-        m_func = NULL;
-        EZ_MEM_BARRIER();
-        EzThread<TYPE>::run(func, arg);
+
+    bool try_lock() {
+        bool ok = false;
+        guard_lock();
+        if (!m_locked) m_locked = ok = true;
+        guard_unlock();
+        return ok;
     };
-    virtual int run(void(*func)(TYPE), TYPE arg) {
-        if ( (func != NULL) && ((EzThreadBase::status() & 0x7) == 0) ) {
-            m_func = func;
-            m_arg = arg;
-            EZ_MEM_BARRIER();
-            return EzThreadBase::run();
+
+    void unlock() {
+        Fiber *f;
+        guard_lock();
+        if ((f = m_head) != NULL) {
+            m_head = f->next;
+            if (m_head == NULL) m_tail = NULL;
+        } else {
+            m_locked = 0;
         }
-        return -1;
+        guard_unlock();
+        if (f) EzFiberScheduler::wake(f);
     };
-    virtual int rerun() {
-        if ( (m_func != NULL) && ((EzThreadBase::status() & 0x7) == 0) ) {
-            return EzThreadBase::run();
+};
+
+/*****************************************************************************
+      CLASS DEFINITION : EzFiberCondVar
+        A condition variable for EzFiberMutex. wait() parks the fiber.
+        On a plain thread, wait() returns after a short sleep (a spurious
+        wakeup), so the caller's predicate loop polls.
+ *****************************************************************************/
+
+class EzFiberCondVar
+{
+  private:
+    EzFiberCondVar(const EzFiberCondVar& src);
+    EzFiberCondVar& operator=(const EzFiberCondVar& src);
+
+    typedef EzFiberScheduler::Fiber Fiber;
+
+    VOLATILE_ eztoken_t m_guard;
+    Fiber *m_head, *m_tail;
+
+    void guard_lock() {
+        while (EzAtomic::exchange(&m_guard, (eztoken_t)1) != 0) {
+            while (EzAtomic::load_relaxed(&m_guard) != 0) EzAtomic::relax();
+        }
+    };
+    void guard_unlock() { EzAtomic::store(&m_guard, (eztoken_t)0); };
+
+  public:
+    EzFiberCondVar() {
+        m_guard = 0;
+        m_head = m_tail = NULL;
+    };
+    ~EzFiberCondVar() {};
+
+/* -------------------------------------------------------------------------- */
+/*   FUNCTION: wait                                                           */
+/*      Unlocks mtx, parks until notified, and locks mtx again.               */
+/*      Check the condition in a loop, as for any condition variable.         */
+/* -------------------------------------------------------------------------- */
+
+    void wait(EzFiberMutex& mtx) {
+        Fiber *self = EzFiberScheduler::current_fiber();
+        if (self == NULL) {
+            mtx.unlock();
+            EzMutex::Wait();
+            mtx.lock();
+            return;
+        }
+        guard_lock();
+        self->next = NULL;
+        if (m_tail) m_tail->next = self;
+        else        m_head = self;
+        m_tail = self;
+        guard_unlock();
+        mtx.unlock();
+        EzFiberScheduler::suspend(self, EzFiberScheduler::RUN_BLOCK);
+        mtx.lock();
+    };
+
+    void notify_one() {
+        Fiber *f;
+        guard_lock();
+        if ((f = m_head) != NULL) {
+            m_head = f->next;
+            if (m_head == NULL) m_tail = NULL;
+        }
+        guard_unlock();
+        if (f) EzFiberScheduler::wake(f);
+    };
+
+    void notify_all() {
+        Fiber *f;
+        guard_lock();
+        f = m_head;
+        m_head = m_tail = NULL;
+        guard_unlock();
+        while (f) {
+            Fiber *next = f->next;    /* wake() reuses f->next */
+            EzFiberScheduler::wake(f);
+            f = next;
         }
-        return -1;
     };
-    virtual int status() { return EzThreadBase::status(); };
-    virtual int wait() { return EzThreadBase::join(); };
 };
 
 #endif /* EZTHREAD_HPP__ */
\ No newline at end of file
@@ -0,0 +1,177 @@
+/***********************************************************************
+bench_arena.cpp : worker scratch memory, EzArena / EzFixedPool vs new
+
+  scratch  : every worker runs tasks which allocate BLOCKS blocks of
+             16..256 bytes and free them all at the end of the task.
+               new      : operator new[] / delete[] per block
+               arena    : EzArena::alloc(), then reset() per task
+  fixed    : same, with 64-byte blocks
+               new      : new / delete per block
+               pool     : EzFixedPool alloc() / free() by the owner
+  remote   : one thread allocates 64-byte blocks, another frees them
+             (handed over through an EzSpscQueue)
+               new      : new / delete
+               pool     : EzFixedPool, freed through its lock-free list
+  Reported: nanoseconds per block.
+
+  usage: bench_arena [tasks]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_arena.cpp -pthread
+ MinGW:         g++ -O2 -static bench_arena.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_arena.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   8
+#define BLOCKS        64     /* blocks per task */
+#define OBJ_SIZE      64     /* fixed and remote cases */
+#define QSIZE         1024   /* remote case handoff queue */
+
+enum { MODE_NEW, MODE_ARENA, MODE_POOL };
+
+static int g_tasks = 20000;
+static int g_mode;
+static volatile long g_sink;
+
+/* ------------------------------------------------------------------------- */
+
+static void scratch_worker(int id)
+{
+    char *p[BLOCKS];
+    EzArena *arena = EzThreadBase::current_arena();
+    long x = 0;
+    int t, i;
+
+    for (t = 0; t < g_tasks; t++) {
+        for (i = 0; i < BLOCKS; i++) {
+            size_t size = 16 + ((i * 37 + id) & 15) * 16;
+            p[i] = (g_mode == MODE_NEW) ? new char[size]
+                                        : (char *)arena->alloc(size);
+            p[i][0] = (char)i;
+            x += p[i][0];
+        }
+        if (g_mode == MODE_NEW) {
+            for (i = 0; i < BLOCKS; i++) delete [] p[i];
+        } else {
+            arena->reset();
+        }
+    }
+    g_sink = x;
+}
+
+struct Obj { char data[OBJ_SIZE]; };
+
+static void fixed_worker(int id)
+{
+    Obj *p[BLOCKS];
+    EzFixedPool pool(sizeof(Obj));
+    long x = 0;
+    int t, i;
+
+    for (t = 0; t < g_tasks; t++) {
+        for (i = 0; i < BLOCKS; i++) {
+            p[i] = (g_mode == MODE_NEW) ? new Obj : (Obj *)pool.alloc();
+            p[i]->data[0] = (char)(i + id);
+            x += p[i]->data[0];
+        }
+        for (i = 0; i < BLOCKS; i++) {
+            if (g_mode == MODE_NEW) delete p[i];
+            else                    pool.free(p[i]);
+        }
+    }
+    g_sink = x;
+}
+
+static void run_case(const char *name, void (*func)(int), int mode, int nthreads)
+{
+    EzThread<int> th[MAX_THREADS];
+    double t0, t1;
+    int i;
+
+    g_mode = mode;
+    t0 = bench_seconds();
+    for (i = 0; i < nthreads; i++) th[i].run(func, i);
+    for (i = 0; i < nthreads; i++) th[i].wait();
+    t1 = bench_seconds();
+
+    printf("%-16s %2d threads : %8.2f ns/block\n", name, nthreads,
+           (t1 - t0) * 1e9 / ((double)g_tasks * BLOCKS * nthreads));
+    fflush(stdout);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static EzSpscQueue<Obj *, QSIZE> *g_handoff;
+static EzFixedPool *g_pool;
+
+static void remote_producer(long n)
+{
+    if (g_mode == MODE_POOL) g_pool->set_owner();   /* this thread allocates */
+    for (long i = 0; i < n; i++) {
+        Obj *p = (g_mode == MODE_NEW) ? new Obj : (Obj *)g_pool->alloc();
+        p->data[0] = (char)i;
+        g_handoff->push(p);
+    }
+    g_handoff->push((Obj *)NULL);
+}
+
+static void remote_consumer(long n)
+{
+    Obj *p;
+    long x = 0;
+    (void)n;
+    for (;;) {
+        g_handoff->pop(p);
+        if (p == NULL) break;
+        x += p->data[0];
+        if (g_mode == MODE_NEW) delete p;
+        else                    g_pool->free(p);
+    }
+    g_sink = x;
+}
+
+static void run_remote(const char *name, int mode)
+{
+    EzSpscQueue<Obj *, QSIZE> handoff;
+    EzThread<long> prod, cons;
+    long n = (long)g_tasks * BLOCKS;
+    double t0, t1;
+
+    g_mode = mode;
+    g_handoff = &handoff;
+    t0 = bench_seconds();
+    cons.run(&remote_consumer, n);
+    prod.run(&remote_producer, n);
+    prod.wait();
+    cons.wait();
+    t1 = bench_seconds();
+
+    printf("%-16s  2 threads : %8.2f ns/block\n", name, (t1 - t0) * 1e9 / n);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && atoi(argv[1]) > 0) g_tasks = atoi(argv[1]);
+    printf("%d tasks of %d blocks, cpu_count = %d\n", g_tasks, BLOCKS,
+           EzThreadBase::cpu_count());
+
+    for (int n = 1; n <= MAX_THREADS; n <<= 1) {
+        run_case("scratch.new",   &scratch_worker, MODE_NEW,   n);
+        run_case("scratch.arena", &scratch_worker, MODE_ARENA, n);
+        run_case("fixed.new",     &fixed_worker,   MODE_NEW,   n);
+        run_case("fixed.pool",    &fixed_worker,   MODE_POOL,  n);
+    }
+
+    EzFixedPool pool(sizeof(Obj));
+    g_pool = &pool;
+    run_remote("remote.new", MODE_NEW);
+    run_remote("remote.pool", MODE_POOL);
+    return 0;
+}
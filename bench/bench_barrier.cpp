@@ -0,0 +1,96 @@
+/***********************************************************************
+bench_barrier.cpp : phased computation with EzBarrier vs rerun()
+
+  NTHREADS workers run PHASES lockstep phases of a small amount of work.
+    rerun    : every phase joins the workers and starts them again
+               with rerun() (a thread creation per worker per phase)
+    central  : the workers stay alive and meet at arrive_and_wait()
+    tree     : same, with the combining tree, arrive_and_wait(id)
+  Reported: microseconds per phase.
+
+  usage: bench_barrier [phases]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_barrier.cpp -pthread
+ MinGW:         g++ -O2 -static bench_barrier.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_barrier.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   64
+#define WORK          2000   /* loop count per worker per phase */
+
+enum { MODE_RERUN, MODE_CENTRAL, MODE_TREE };
+
+static int g_phases = 2000;
+static int g_mode;
+static EzBarrier *g_barrier;
+static volatile long g_sink;
+
+/* ------------------------------------------------------------------------- */
+
+static void do_work(int id)
+{
+    long x = id;
+    for (int i = 0; i < WORK; i++) x = x * 1103515245L + 12345L;
+    g_sink = x;
+}
+
+static void one_phase(int id)
+{
+    do_work(id);
+}
+
+static void all_phases(int id)
+{
+    for (int p = 0; p < g_phases; p++) {
+        do_work(id);
+        if (g_mode == MODE_TREE) g_barrier->arrive_and_wait(id);
+        else                     g_barrier->arrive_and_wait();
+    }
+}
+
+static void run_case(const char *name, int mode, int nthreads)
+{
+    EzThread<int> th[MAX_THREADS];
+    EzBarrier barrier(nthreads);
+    double t0, t1;
+    int i, p;
+
+    g_mode = mode;
+    g_barrier = &barrier;
+    t0 = bench_seconds();
+    if (mode == MODE_RERUN) {
+        for (i = 0; i < nthreads; i++) th[i].run(&one_phase, i);
+        for (i = 0; i < nthreads; i++) th[i].wait();
+        for (p = 1; p < g_phases; p++) {
+            for (i = 0; i < nthreads; i++) th[i].rerun();
+            for (i = 0; i < nthreads; i++) th[i].wait();
+        }
+    } else {
+        for (i = 0; i < nthreads; i++) th[i].run(&all_phases, i);
+        for (i = 0; i < nthreads; i++) th[i].wait();
+    }
+    t1 = bench_seconds();
+
+    printf("%-8s %3d threads : %10.2f us/phase\n", name, nthreads,
+           (t1 - t0) * 1e6 / g_phases);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && atoi(argv[1]) > 0) g_phases = atoi(argv[1]);
+    printf("%d phases, cpu_count = %d\n", g_phases, EzThreadBase::cpu_count());
+    for (int n = 2; n <= MAX_THREADS; n <<= 1) {
+        run_case("rerun",   MODE_RERUN,   n);
+        run_case("central", MODE_CENTRAL, n);
+        run_case("tree",    MODE_TREE,    n);
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef BENCH_COMMON_H__
+#define BENCH_COMMON_H__
+/**************************************************************************
+  bench_common.h : helpers shared by the benchmark programs
+ **************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   bench_seconds() : monotonic wall clock in seconds                        */
+/* -------------------------------------------------------------------------- */
+#ifdef _WIN32
+static inline double bench_seconds(void)
+{
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+}
+#else
+static inline double bench_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*   bench_duration_ms() : measurement time per case (argv[1] or default)     */
+/* -------------------------------------------------------------------------- */
+static inline unsigned long bench_duration_ms(int argc, char *argv[], unsigned long dflt)
+{
+    if (argc > 1) {
+        long ms = atol(argv[1]);
+        if (ms > 0) return (unsigned long)ms;
+    }
+    return dflt;
+}
+
+#endif /* BENCH_COMMON_H__ */
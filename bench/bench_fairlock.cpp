@@ -0,0 +1,131 @@
+/***********************************************************************
+bench_fairlock.cpp : EzTicketMutex / EzMcsMutex vs EzMutex
+
+  Each thread repeats lock / short critical section / unlock / short
+  private work for a fixed period of time, with 2 to 64 threads.
+  The lock type is a template parameter of the worker, as the locks
+  share the lock / try_lock / unlock interface.
+  Reported per case:
+    Mops/s        : total throughput
+    max wait      : the longest time a lock() call took (us)
+    min/max ops   : fairness between the threads
+
+  usage: bench_fairlock [milliseconds per case]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_fairlock.cpp -pthread
+ MinGW:         g++ -O2 -static bench_fairlock.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_fairlock.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   64
+#define INNER_WORK    20    /* loop count inside the critical section  */
+#define OUTER_WORK    100   /* loop count outside the critical section */
+
+/* ------------------------------------------------------------------------- */
+
+template <class LOCK>
+struct Shared {
+    LOCK *mtx;
+    volatile int start;
+    volatile int stop;
+    volatile unsigned long counter;
+};
+
+template <class LOCK>
+class Worker : public EzThreadBase
+{
+  public:
+    Shared<LOCK> *m_sh;
+    unsigned long m_ops;
+    ezint64_t m_max_wait;
+
+    Worker() { m_sh = NULL; m_ops = 0; m_max_wait = 0; };
+    ~Worker() { join(); };
+
+    void app() {
+        volatile unsigned long dummy = 0;
+        unsigned long n = 0;
+        ezint64_t t0, t1, w = 0;
+        int i;
+
+        while (!m_sh->start) EzMutex::Wait();
+        while (!m_sh->stop) {
+            t0 = EzMutex::nanotime();
+            m_sh->mtx->lock();
+            t1 = EzMutex::nanotime();
+            for (i = 0; i < INNER_WORK; i++) dummy++;
+            m_sh->counter++;
+            m_sh->mtx->unlock();
+            if (t1 - t0 > w) w = t1 - t0;
+            for (i = 0; i < OUTER_WORK; i++) dummy++;
+            n++;
+        }
+        m_ops = n;
+        m_max_wait = w;
+    };
+};
+
+/* ------------------------------------------------------------------------- */
+
+template <class LOCK>
+static void run_case(const char *name, LOCK& mtx, int nthreads, unsigned long ms)
+{
+    Shared<LOCK> sh;
+    Worker<LOCK> w[MAX_THREADS];
+    unsigned long total = 0, lo = (unsigned long)-1, hi = 0;
+    ezint64_t max_wait = 0;
+    double t0, t1;
+    int i;
+
+    sh.mtx = &mtx;
+    sh.start = 0;
+    sh.stop = 0;
+    sh.counter = 0;
+    for (i = 0; i < nthreads; i++) {
+        w[i].m_sh = &sh;
+        w[i].run();
+    }
+
+    t0 = bench_seconds();
+    sh.start = 1;
+    EzMutex::millisleep(ms);
+    sh.stop = 1;
+    for (i = 0; i < nthreads; i++) w[i].join();
+    t1 = bench_seconds();
+
+    for (i = 0; i < nthreads; i++) {
+        total += w[i].m_ops;
+        if (w[i].m_ops < lo) lo = w[i].m_ops;
+        if (w[i].m_ops > hi) hi = w[i].m_ops;
+        if (w[i].m_max_wait > max_wait) max_wait = w[i].m_max_wait;
+    }
+    printf("%-9s %3d threads : %8.3f Mops/s  max wait %9.1f us  min/max ops %lu/%lu%s\n",
+           name, nthreads, (double)total / (t1 - t0) * 1e-6,
+           (double)max_wait * 1e-3, lo, hi,
+           (sh.counter == total) ? "" : "  ** COUNT MISMATCH **");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long ms = bench_duration_ms(argc, argv, 200);
+    int n;
+
+    for (n = 2; n <= MAX_THREADS; n <<= 1) {
+        EzMutex spin(EZMTX_SPIN);
+        EzMutex adaptive(EZMTX_ADAPTIVE);
+        EzTicketMutex ticket;
+        EzMcsMutex mcs;
+        run_case("spin",     spin,     n, ms);
+        run_case("adaptive", adaptive, n, ms);
+        run_case("ticket",   ticket,   n, ms);
+        run_case("mcs",      mcs,      n, ms);
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+/***********************************************************************
+bench_fiber.cpp : EzFiberScheduler fibers vs OS threads
+
+  yield    : two fibers on one worker call EzFiber::yield() in turn
+             (a switch to the worker and a switch to the other fiber)
+  pingpong : two fibers pass a token with EzFiberMutex/EzFiberCondVar,
+             compared with two EzThreads using EzMutex/EzCondVar
+  spawn    : spawn() of fibers which return at once (stacks reused),
+             from the main thread and from a fiber on the same worker
+  sleepers : NFIBERS fibers which each sleep 10 ms, ROUNDS times
+  Reported: nanoseconds per operation.
+
+  usage: bench_fiber [count]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_fiber.cpp -pthread
+ MinGW:         g++ -O2 -static bench_fiber.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_fiber.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define NFIBERS   100000
+#define ROUNDS    3
+
+static long g_count = 1000000;
+
+/* ------------------------------------------------------------------------- */
+
+static void yielder(void *arg)
+{
+    (void)arg;
+    for (long i = 0; i < g_count; i++) EzFiber::yield();
+}
+
+static void bench_yield()
+{
+    EzFiberScheduler sched(1);
+    double t0 = bench_seconds();
+    sched.spawn(&yielder, NULL);
+    sched.spawn(&yielder, NULL);
+    sched.wait_all();
+    double t1 = bench_seconds();
+    printf("%-24s : %8.1f ns/yield\n", "yield", (t1 - t0) * 1e9 / (2.0 * g_count));
+}
+
+/* ------------------------------------------------------------------------- */
+
+static EzFiberMutex   g_fmtx;
+static EzFiberCondVar g_fcv;
+static EzMutex        g_mtx;
+static EzCondVar      g_cv;
+static int            g_turn;
+
+static void fiber_pingpong(void *arg)
+{
+    int me = (int)(size_t)arg;
+    for (long i = 0; i < g_count / 10; i++) {
+        g_fmtx.lock();
+        while (g_turn != me) g_fcv.wait(g_fmtx);
+        g_turn = 1 - me;
+        g_fcv.notify_one();
+        g_fmtx.unlock();
+    }
+}
+
+static void thread_pingpong(int me)
+{
+    for (long i = 0; i < g_count / 10; i++) {
+        g_mtx.lock();
+        while (g_turn != me) g_cv.wait(g_mtx);
+        g_turn = 1 - me;
+        g_cv.notify_one();
+        g_mtx.unlock();
+    }
+}
+
+static void bench_pingpong(int nworkers)
+{
+    char name[64];
+    EzFiberScheduler sched(nworkers);
+    double t0, t1;
+
+    g_turn = 0;
+    t0 = bench_seconds();
+    sched.spawn(&fiber_pingpong, (void *)0);
+    sched.spawn(&fiber_pingpong, (void *)1);
+    sched.wait_all();
+    t1 = bench_seconds();
+    sprintf(name, "pingpong.fiber x%d", nworkers);
+    printf("%-24s : %8.1f ns/handoff\n", name, (t1 - t0) * 1e9 / (2.0 * (g_count / 10)));
+}
+
+static void bench_pingpong_thread()
+{
+    EzThread<int> a, b;
+    double t0, t1;
+
+    g_turn = 0;
+    t0 = bench_seconds();
+    a.run(&thread_pingpong, 0);
+    b.run(&thread_pingpong, 1);
+    a.wait();
+    b.wait();
+    t1 = bench_seconds();
+    printf("%-24s : %8.1f ns/handoff\n", "pingpong.thread",
+           (t1 - t0) * 1e9 / (2.0 * (g_count / 10)));
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void nothing(void *arg)
+{
+    (void)arg;
+}
+
+static void sleeper(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < ROUNDS; i++) EzFiber::sleep(10);
+}
+
+static EzFiberScheduler *g_sched;
+
+static void spawner(void *arg)
+{
+    long n = (long)(size_t)arg;
+    for (long i = 0; i < n; i++) {
+        g_sched->spawn(&nothing, NULL);
+        if ((i & 63) == 63) EzFiber::yield();   /* let them finish */
+    }
+}
+
+static void bench_spawn()
+{
+    EzFiberScheduler sched(1);
+    long n = g_count / 10, i;
+    double t0, t1;
+
+    for (i = 0; i < 1000; i++) sched.spawn(&nothing, NULL);   /* warm up */
+    sched.wait_all();
+    t0 = bench_seconds();
+    for (i = 0; i < n; i++) sched.spawn(&nothing, NULL);
+    sched.wait_all();
+    t1 = bench_seconds();
+    printf("%-24s : %8.1f ns/fiber\n", "spawn.thread", (t1 - t0) * 1e9 / n);
+
+    g_sched = &sched;
+    t0 = bench_seconds();
+    sched.spawn(&spawner, (void *)(size_t)n);
+    sched.wait_all();
+    t1 = bench_seconds();
+    printf("%-24s : %8.1f ns/fiber\n", "spawn.fiber", (t1 - t0) * 1e9 / n);
+}
+
+static void bench_sleepers()
+{
+    EzFiberScheduler sched;
+    double t0, t1;
+    int i;
+
+    t0 = bench_seconds();
+    for (i = 0; i < NFIBERS; i++) {
+        if (sched.spawn(&sleeper, NULL)) break;
+    }
+    sched.wait_all();
+    t1 = bench_seconds();
+    printf("%-24s : %8.1f ms for %d fibers x %d sleeps of 10 ms (%d workers)\n",
+           "sleepers", (t1 - t0) * 1e3, i, ROUNDS, sched.size());
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && atol(argv[1]) > 0) g_count = atol(argv[1]);
+    printf("count = %ld, cpu_count = %d\n", g_count, EzThreadBase::cpu_count());
+    bench_yield();
+    bench_pingpong(1);
+    bench_pingpong(2);
+    bench_pingpong_thread();
+    bench_spawn();
+    bench_sleepers();
+    return 0;
+}
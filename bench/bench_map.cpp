@@ -0,0 +1,144 @@
+/***********************************************************************
+bench_map.cpp : shared lookup table, EzConcurrentMap vs EzMutex+std::map
+
+  read     : 95% find, 5% assign of random keys
+  mixed    : 50% find, 25% assign, 25% erase of random keys
+             (KEYS keys, half of them in the table at the start)
+               std::map : one EzMutex around a std::map
+               ezmap    : EzConcurrentMap
+  The thread count goes from 1 up to the number of processors.
+  Reported: million operations per second (all threads together).
+
+  usage: bench_map [ops per thread]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_map.cpp -pthread
+ MinGW:         g++ -O2 -static bench_map.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT /EHsc bench_map.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   64
+#define KEYS          (1 << 16)
+
+typedef unsigned long Key;
+typedef unsigned long Value;
+typedef std::map<Key, Value> StdMap;
+typedef EzConcurrentMap<Key, Value> EzMap;
+
+enum { MODE_STD, MODE_EZ };
+
+static long    g_ops = 1000000;
+static int     g_mode;
+static int     g_find_pct;           /* the rest: half assign, half erase */
+static int     g_erase_pct;
+static StdMap *g_std;
+static EzMutex g_std_mtx;
+static EzMap  *g_ez;
+static volatile long g_sink;
+
+static inline unsigned long next_rand(unsigned long *x)   /* xorshift */
+{
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void worker(int id)
+{
+    unsigned long x = 88172645UL + (unsigned long)id * 7919UL;
+    long found = 0;
+
+    for (long i = 0; i < g_ops; i++) {
+        unsigned long r = next_rand(&x);
+        Key key = (Key)((r >> 8) % KEYS);
+        int pct = (int)(r % 100);
+        Value v;
+
+        if (g_mode == MODE_STD) {
+            g_std_mtx.lock();
+            if (pct < g_find_pct) {
+                StdMap::iterator it = g_std->find(key);
+                if (it != g_std->end()) found += (long)it->second;
+            } else if (pct < 100 - g_erase_pct) {
+                (*g_std)[key] = (Value)i;
+            } else {
+                g_std->erase(key);
+            }
+            g_std_mtx.unlock();
+        } else {
+            if (pct < g_find_pct) {
+                if (g_ez->find(key, v)) found += (long)v;
+            } else if (pct < 100 - g_erase_pct) {
+                g_ez->assign(key, (Value)i);
+            } else {
+                g_ez->erase(key);
+            }
+        }
+    }
+    g_sink = found;
+}
+
+static void run_case(const char *load, int mode, int nthreads)
+{
+    EzThread<int> th[MAX_THREADS];
+    double t0, t1;
+    int i;
+
+    g_mode = mode;
+    g_std = new StdMap;
+    g_ez = new EzMap;
+    for (Key k = 0; k < KEYS; k += 2) {
+        (*g_std)[k] = k;
+        g_ez->assign(k, k);
+    }
+
+    t0 = bench_seconds();
+    for (i = 0; i < nthreads; i++) th[i].run(worker, i);
+    for (i = 0; i < nthreads; i++) th[i].wait();
+    t1 = bench_seconds();
+
+    printf("%-6s %-9s %2d threads : %8.2f Mops/s\n", load,
+           mode == MODE_STD ? "std::map" : "ezmap", nthreads,
+           (double)g_ops * nthreads / (t1 - t0) * 1e-6);
+    fflush(stdout);
+
+    delete g_std;
+    delete g_ez;
+}
+
+static void run_load(const char *load, int find_pct, int erase_pct)
+{
+    int ncpu = EzThreadBase::cpu_count();
+    int n;
+
+    if (ncpu > MAX_THREADS) ncpu = MAX_THREADS;
+    g_find_pct = find_pct;
+    g_erase_pct = erase_pct;
+    for (n = 1; ; n *= 2) {
+        if (n > ncpu) n = ncpu;
+        run_case(load, MODE_STD, n);
+        run_case(load, MODE_EZ, n);
+        if (n == ncpu) break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) g_ops = atol(argv[1]);
+    if (g_ops < 1) g_ops = 1;
+
+    printf("EzConcurrentMap: %d slots per group\n", EzMap::slots_per_group());
+    run_load("read",  95, 0);
+    run_load("mixed", 50, 25);
+    return 0;
+}
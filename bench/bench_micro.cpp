@@ -0,0 +1,416 @@
+/***********************************************************************
+bench_micro.cpp : latency microbenchmarks with percentiles
+
+  Each case collects many latency samples in nanoseconds and reports
+  min / p50 / p90 / p99 / max / mean, so that two versions of
+  EzThread.hpp can be compared case by case.
+
+    create_join.ezthread   : EzThread run() + wait() of an empty function
+    create_join.base       : EzThreadBase run() + join() of an empty app()
+    create_join.start      : run() until the new thread starts (EzThreadStats)
+    mutex.<mode>.uncontended : lock() + unlock() on one thread
+    mutex.<mode>.contended : lock() + unlock() on CONTENDERS threads
+    status.poll            : status() of a running thread
+    sleep.millisleep_1ms   : oversleep of millisleep(1)
+    sleep.wait             : duration of Wait()
+    sleep.nanosleep_until  : lateness of EzMutex::nanosleep_until()
+    timer.oneshot          : lateness of EzTimerQueue one-shot timers
+    handoff.event          : one-way latency of an EzEvent ping-pong
+    handoff.spin           : one-way latency of a spinning ping-pong
+
+  Sub-microsecond operations are timed in batches of BATCH calls and
+  each sample is the average of a batch.
+
+  usage: bench_micro [text|json|csv] [samples]
+
+  The Makefile in this directory builds all the benchmarks;
+  "make run" writes build/bench_micro.json and build/bench_micro.csv.
+
+How to compile:
+
+ GNU:           g++ -O2 bench_micro.cpp -pthread
+ MinGW:         g++ -O2 -static bench_micro.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_micro.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define BATCH         256   /* calls per sample for the short operations */
+#define CONTENDERS    4     /* threads in the contended mutex cases      */
+#define SPIN_LIMIT    1000  /* relax() calls before Wait() in handoff    */
+
+enum { OUT_TEXT, OUT_JSON, OUT_CSV };
+
+static int g_format = OUT_TEXT;
+static int g_samples = 2000;
+static int g_ncases = 0;
+
+/* ------------------------------------------------------------------------- */
+/*   statistics and output                                                   */
+/* ------------------------------------------------------------------------- */
+
+static int cmp_int64(const void *a, const void *b)
+{
+    ezint64_t x = *(const ezint64_t *)a, y = *(const ezint64_t *)b;
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/* nearest-rank percentile of sorted samples */
+static double percentile(const ezint64_t *s, int n, int pct)
+{
+    int k = (n * pct + 99) / 100;
+    if (k < 1) k = 1;
+    return (double)s[k - 1];
+}
+
+static void report(const char *name, ezint64_t *s, int n)
+{
+    double mean = 0.0;
+    int i;
+    if (n <= 0) return;
+    qsort(s, (size_t)n, sizeof(s[0]), cmp_int64);
+    for (i = 0; i < n; i++) mean += (double)s[i];
+    mean /= n;
+
+    switch (g_format) {
+    case OUT_JSON:
+        printf("%s    {\"name\": \"%s\", \"samples\": %d, \"min\": %.0f, \"p50\": %.0f, "
+               "\"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f, \"mean\": %.1f}",
+               g_ncases ? ",\n" : "", name, n, (double)s[0],
+               percentile(s, n, 50), percentile(s, n, 90), percentile(s, n, 99),
+               (double)s[n - 1], mean);
+        break;
+    case OUT_CSV:
+        printf("%s,%d,%.0f,%.0f,%.0f,%.0f,%.0f,%.1f\n", name, n, (double)s[0],
+               percentile(s, n, 50), percentile(s, n, 90), percentile(s, n, 99),
+               (double)s[n - 1], mean);
+        break;
+    default:
+        printf("%-28s %7d %10.0f %10.0f %10.0f %10.0f %10.0f %10.1f\n", name, n,
+               (double)s[0], percentile(s, n, 50), percentile(s, n, 90),
+               percentile(s, n, 99), (double)s[n - 1], mean);
+        break;
+    }
+    g_ncases++;
+    fflush(stdout);
+}
+
+static void print_header(void)
+{
+    switch (g_format) {
+    case OUT_JSON:
+        printf("{\n  \"unit\": \"ns\",\n  \"cpus\": %d,\n"
+#if defined(__VERSION__)
+               "  \"compiler\": \"" __VERSION__ "\",\n"
+#endif
+               "  \"results\": [\n", EzThreadBase::cpu_count());
+        break;
+    case OUT_CSV:
+        printf("name,samples,min_ns,p50_ns,p90_ns,p99_ns,max_ns,mean_ns\n");
+        break;
+    default:
+        printf("%d cpu(s), latency in ns\n", EzThreadBase::cpu_count());
+        printf("%-28s %7s %10s %10s %10s %10s %10s %10s\n", "case", "samples",
+               "min", "p50", "p90", "p99", "max", "mean");
+        break;
+    }
+}
+
+static void print_footer(void)
+{
+    if (g_format == OUT_JSON) printf("\n  ]\n}\n");
+}
+
+/* ------------------------------------------------------------------------- */
+/*   thread creation                                                         */
+/* ------------------------------------------------------------------------- */
+
+static void empty_func(int) {}
+
+class EmptyThread : public EzThreadBase
+{
+  public:
+    ~EmptyThread() { join(); };
+    void app() {};
+};
+
+static void bench_create_join(void)
+{
+    int n = g_samples / 4, i;
+    ezint64_t *s = new ezint64_t[n];
+    ezint64_t t0;
+    EzThreadAttr attr;
+
+    for (i = 0; i < n; i++) {
+        EzThread<int> th;
+        t0 = EzMutex::nanotime();
+        th.run(&empty_func, 0);
+        th.wait();
+        s[i] = EzMutex::nanotime() - t0;
+    }
+    report("create_join.ezthread", s, n);
+
+    for (i = 0; i < n; i++) {
+        EmptyThread th;
+        t0 = EzMutex::nanotime();
+        th.run();
+        th.join();
+        s[i] = EzMutex::nanotime() - t0;
+    }
+    report("create_join.base", s, n);
+
+    attr.set_profiling(true);
+    for (i = 0; i < n; i++) {
+        EmptyThread th;
+        th.set_thread_attr(attr);
+        th.run();
+        th.join();
+        s[i] = th.thread_stats().start_ns - th.thread_stats().run_ns;
+    }
+    report("create_join.start", s, n);
+    delete [] s;
+}
+
+/* ------------------------------------------------------------------------- */
+/*   mutex                                                                   */
+/* ------------------------------------------------------------------------- */
+
+struct MutexCase {
+    EzMutex *mtx;
+    EzEvent *go;
+    ezint64_t *samples;   /* n samples for this thread */
+    int n;
+    volatile long counter;
+};
+
+static void mutex_worker(MutexCase *mc)
+{
+    ezint64_t t0;
+    mc->go->wait();
+    for (int i = 0; i < mc->n; i++) {
+        t0 = EzMutex::nanotime();
+        for (int k = 0; k < BATCH; k++) {
+            mc->mtx->lock();
+            mc->counter++;
+            mc->mtx->unlock();
+        }
+        mc->samples[i] = (EzMutex::nanotime() - t0) / BATCH;
+    }
+}
+
+static void bench_mutex(const char *mode_name, int mode)
+{
+    char name[64];
+    int n = g_samples, per = g_samples / CONTENDERS, i;
+    ezint64_t *s = new ezint64_t[n];
+    EzMutex mtx(mode);
+    EzEvent go(EZEVT_MANUAL);
+    MutexCase mc[CONTENDERS];
+
+    /* uncontended: one thread */
+    mc[0].mtx = &mtx; mc[0].go = &go; mc[0].samples = s; mc[0].n = n; mc[0].counter = 0;
+    go.set();
+    mutex_worker(&mc[0]);
+    sprintf(name, "mutex.%s.uncontended", mode_name);
+    report(name, s, n);
+
+    /* contended: CONTENDERS threads on the same mutex */
+    go.reset();
+    {
+        EzThread<MutexCase *> th[CONTENDERS];
+        for (i = 0; i < CONTENDERS; i++) {
+            mc[i].mtx = &mtx; mc[i].go = &go; mc[i].counter = 0;
+            mc[i].samples = s + i * per; mc[i].n = per;
+            th[i].run(&mutex_worker, &mc[i]);
+        }
+        go.set();
+    }   /* joined here */
+    sprintf(name, "mutex.%s.contended", mode_name);
+    report(name, s, per * CONTENDERS);
+    delete [] s;
+}
+
+/* ------------------------------------------------------------------------- */
+/*   status() polling                                                        */
+/* ------------------------------------------------------------------------- */
+
+static void wait_event(EzEvent *ev) { ev->wait(); }
+
+static void bench_status(void)
+{
+    int n = g_samples, i;
+    ezint64_t *s = new ezint64_t[n];
+    ezint64_t t0;
+    EzEvent quit(EZEVT_MANUAL);
+    EzThread<EzEvent *> target(&wait_event, &quit);
+    volatile int sink = 0;
+
+    target.wait_until_state(EZTH_RUNNING);
+    for (i = 0; i < n; i++) {
+        t0 = EzMutex::nanotime();
+        for (int k = 0; k < BATCH; k++) sink += target.status();
+        s[i] = (EzMutex::nanotime() - t0) / BATCH;
+    }
+    quit.set();
+    report("status.poll", s, n);
+    delete [] s;
+}
+
+/* ------------------------------------------------------------------------- */
+/*   sleep accuracy                                                          */
+/* ------------------------------------------------------------------------- */
+
+static void bench_sleep(void)
+{
+    int n = g_samples / 4, i;
+    ezint64_t *s = new ezint64_t[n];
+    ezint64_t t0;
+
+    for (i = 0; i < n; i++) {
+        t0 = EzMutex::nanotime();
+        EzMutex::millisleep(1);
+        s[i] = EzMutex::nanotime() - t0 - 1000000;
+    }
+    report("sleep.millisleep_1ms", s, n);
+
+    for (i = 0; i < n; i++) {
+        t0 = EzMutex::nanotime();
+        EzMutex::Wait();
+        s[i] = EzMutex::nanotime() - t0;
+    }
+    report("sleep.wait", s, n);
+
+    for (i = 0; i < n; i++) {
+        t0 = EzMutex::nanotime() + 1000000;
+        EzMutex::nanosleep_until(t0);
+        s[i] = EzMutex::nanotime() - t0;
+    }
+    report("sleep.nanosleep_until", s, n);
+    delete [] s;
+}
+
+/* ------------------------------------------------------------------------- */
+/*   timer queue                                                             */
+/* ------------------------------------------------------------------------- */
+
+struct TimerSample {
+    ezint64_t due;
+    ezint64_t late;
+    EzEvent fired;
+    TimerSample() : fired(EZEVT_AUTO) { due = late = 0; };
+};
+
+static void timer_fired(TimerSample *ts)
+{
+    ts->late = EzMutex::nanotime() - ts->due;
+    ts->fired.set();
+}
+
+static void bench_timer(void)
+{
+    int n = g_samples / 4, i;
+    ezint64_t *s = new ezint64_t[n];
+    EzTimerQueue<TimerSample *> tq;
+    TimerSample ts;
+
+    for (i = 0; i < n; i++) {
+        ts.due = EzMutex::nanotime() + 1000000;
+        tq.schedule_at(&timer_fired, &ts, ts.due);
+        ts.fired.wait();
+        s[i] = ts.late;
+    }
+    report("timer.oneshot", s, n);
+    delete [] s;
+}
+
+/* ------------------------------------------------------------------------- */
+/*   handoff between two threads                                             */
+/* ------------------------------------------------------------------------- */
+
+struct Handoff {
+    EzEvent ping, pong;              /* EZEVT_AUTO */
+    VOLATILE_ eztoken_t turn;        /* spin: 0 main's turn, 1 partner's */
+    int rounds;
+    bool spin;
+    Handoff() : ping(EZEVT_AUTO), pong(EZEVT_AUTO) { turn = 0; rounds = 0; spin = false; };
+};
+
+static void spin_until(VOLATILE_ eztoken_t *p, eztoken_t v)
+{
+    int k = 0;
+    while (EzAtomic::load(p) != v) {
+        if (++k < SPIN_LIMIT) {
+            EzAtomic::relax();
+        } else {
+            k = 0;
+            EzMutex::Wait();
+        }
+    }
+}
+
+static void partner(Handoff *h)
+{
+    for (int i = 0; i < h->rounds; i++) {
+        if (h->spin) {
+            spin_until(&h->turn, 1);
+            EzAtomic::store(&h->turn, (eztoken_t)0);
+        } else {
+            h->ping.wait();
+            h->pong.set();
+        }
+    }
+}
+
+static void bench_handoff(bool spin)
+{
+    int n = g_samples, i;
+    ezint64_t *s = new ezint64_t[n];
+    ezint64_t t0;
+    Handoff h;
+
+    h.rounds = n;
+    h.spin = spin;
+    {
+        EzThread<Handoff *> th(&partner, &h);
+        for (i = 0; i < n; i++) {
+            t0 = EzMutex::nanotime();
+            if (spin) {
+                EzAtomic::store(&h.turn, (eztoken_t)1);
+                spin_until(&h.turn, 0);
+            } else {
+                h.ping.set();
+                h.pong.wait();
+            }
+            s[i] = (EzMutex::nanotime() - t0) / 2;
+        }
+    }
+    report(spin ? "handoff.spin" : "handoff.event", s, n);
+    delete [] s;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        if (strcmp(argv[1], "json") == 0) g_format = OUT_JSON;
+        else if (strcmp(argv[1], "csv") == 0) g_format = OUT_CSV;
+    }
+    if (argc > 2 && atoi(argv[2]) >= 100) g_samples = atoi(argv[2]);
+
+    print_header();
+    bench_create_join();
+    bench_mutex("spin", EZMTX_SPIN);
+    bench_mutex("adaptive", EZMTX_ADAPTIVE);
+    bench_status();
+    bench_sleep();
+    bench_timer();
+    bench_handoff(false);
+    bench_handoff(true);
+    print_footer();
+    return 0;
+}
@@ -0,0 +1,173 @@
+/***********************************************************************
+bench_mpmc.cpp : EzMpmcQueue fan-in / fan-out throughput
+
+  N producer threads send MESSAGES integers in total to N consumer
+  threads, for N = 1, 2, 4, 8, 16, 32:
+    mpmc      : EzMpmcQueue push / pop (blocking), close() at the end
+    mutex     : std::deque guarded by an adaptive EzMutex (baseline)
+
+  usage: bench_mpmc [messages]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_mpmc.cpp -pthread
+ MinGW:         g++ -O2 -static bench_mpmc.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /EHsc /MT bench_mpmc.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define QSIZE       1024
+#define MAX_THREADS 32
+
+enum { MODE_MPMC, MODE_MUTEX };
+
+static long g_messages = 2000000L;
+
+struct Channel {
+    int mode;
+    int producers;
+    EzMpmcQueue<long> *q;
+    std::deque<long> *deq;
+    EzMutex *mtx;
+    volatile int done;              /* mutex mode: all producers finished */
+    VOLATILE_ eztoken_t next_id;    /* hands out producer ids */
+    EzMutex sum_mtx;
+    unsigned long sum;
+};
+
+/* 0 + 1 + ... + (g_messages - 1), wrapped around like the consumers' sum */
+static unsigned long expected_sum(void)
+{
+    unsigned long m = (unsigned long)g_messages;
+    return (m % 2 == 0) ? (m / 2) * (m - 1) : m * ((m - 1) / 2);
+}
+
+/* spin a little, then give the CPU away (matters when cores are scarce) */
+static inline void backoff(int *k)
+{
+    if (++*k < 1000) {
+        EzAtomic::relax();
+    } else {
+        *k = 0;
+        EzMutex::Wait();
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void producer(Channel *ch)
+{
+    long id = (long)EzAtomic::fetch_add(&ch->next_id, (eztoken_t)1);
+    long i;
+    int spin = 0;
+
+    /* producer id sends id, id + P, id + 2P, ... */
+    for (i = id; i < g_messages; i += ch->producers) {
+        if (ch->mode == MODE_MPMC) {
+            ch->q->push(i);
+        } else {
+            for (;;) {
+                bool ok;
+                ch->mtx->lock();
+                ok = (ch->deq->size() < QSIZE);
+                if (ok) ch->deq->push_back(i);
+                ch->mtx->unlock();
+                if (ok) break;
+                backoff(&spin);
+            }
+        }
+    }
+}
+
+static void consumer(Channel *ch)
+{
+    unsigned long sum = 0;
+    long v;
+    int spin = 0;
+
+    if (ch->mode == MODE_MPMC) {
+        while (ch->q->pop(v)) sum += (unsigned long)v;
+    } else {
+        for (;;) {
+            bool got = false;
+            int fin = EzAtomic::load(&ch->done);
+            ch->mtx->lock();
+            if (!ch->deq->empty()) {
+                v = ch->deq->front();
+                ch->deq->pop_front();
+                got = true;
+            }
+            ch->mtx->unlock();
+            if (got) {
+                sum += (unsigned long)v;
+            } else if (fin) {
+                break;
+            } else {
+                backoff(&spin);
+            }
+        }
+    }
+    ch->sum_mtx.lock();
+    ch->sum += sum;
+    ch->sum_mtx.unlock();
+}
+
+/* ------------------------------------------------------------------------- */
+
+static double run_case(int mode, int n, bool *ok)
+{
+    EzMpmcQueue<long> q(QSIZE);
+    std::deque<long> deq;
+    EzMutex mtx(EZMTX_ADAPTIVE);
+    EzThread<Channel *> prod[MAX_THREADS], cons[MAX_THREADS];
+    Channel ch;
+    double t0, t1;
+    int i;
+
+    ch.mode = mode;
+    ch.producers = n;
+    ch.q = &q;
+    ch.deq = &deq;
+    ch.mtx = &mtx;
+    ch.done = 0;
+    ch.next_id = 0;
+    ch.sum = 0;
+
+    t0 = bench_seconds();
+    for (i = 0; i < n; i++) cons[i].run(&consumer, &ch);
+    for (i = 0; i < n; i++) prod[i].run(&producer, &ch);
+    for (i = 0; i < n; i++) prod[i].wait();
+    if (mode == MODE_MPMC) {
+        q.close();
+    } else {
+        EzAtomic::store(&ch.done, 1);
+    }
+    for (i = 0; i < n; i++) cons[i].wait();
+    t1 = bench_seconds();
+
+    *ok = (ch.sum == expected_sum());
+    return (double)g_messages / (t1 - t0) * 1e-6;
+}
+
+int main(int argc, char *argv[])
+{
+    int n;
+    bool ok1, ok2;
+
+    if (argc > 1 && atol(argv[1]) > 0) g_messages = atol(argv[1]);
+    printf("%ld messages, queue size %d, Mmsg/s\n", g_messages, QSIZE);
+    printf(" P x C :     mpmc    mutex\n");
+    for (n = 1; n <= MAX_THREADS; n *= 2) {
+        double a = run_case(MODE_MPMC, n, &ok1);
+        double b = run_case(MODE_MUTEX, n, &ok2);
+        printf("%2d x %-2d: %8.2f %8.2f %s\n", n, n, a, b,
+               (ok1 && ok2) ? "" : "** CHECKSUM MISMATCH **");
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+/***********************************************************************
+bench_mutex.cpp : EzMutex contention benchmark
+
+  Compares EZMTX_SPIN (test-and-set + Wait()) with EZMTX_ADAPTIVE
+  (spin with backoff, then park) at 1 to 64 threads.
+  Each thread repeats lock / short critical section / unlock / short
+  private work for a fixed period of time.
+
+  usage: bench_mutex [milliseconds per case]
+
+  Compile with -DEZMTX_INSTRUMENT to print the contention statistics of
+  each case (and to see the cost of the instrumentation itself).
+
+How to compile:
+
+ GNU:           g++ -O2 bench_mutex.cpp -pthread
+ MinGW:         g++ -O2 -static bench_mutex.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_mutex.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   64
+#define INNER_WORK    20    /* loop count inside the critical section  */
+#define OUTER_WORK    100   /* loop count outside the critical section */
+
+/* ------------------------------------------------------------------------- */
+
+struct Shared {
+    EzMutex *mtx;
+    volatile int start;
+    volatile int stop;
+    volatile unsigned long counter;
+};
+
+class Worker : public EzThreadBase
+{
+  public:
+    Shared *m_sh;
+    unsigned long m_ops;
+
+    Worker() { m_sh = NULL; m_ops = 0; };
+    ~Worker() { join(); };
+
+    void app() {
+        volatile unsigned long dummy = 0;
+        unsigned long n = 0;
+        int i;
+
+        while (!m_sh->start) EzMutex::Wait();
+        while (!m_sh->stop) {
+            m_sh->mtx->lock();
+            for (i = 0; i < INNER_WORK; i++) dummy++;
+            m_sh->counter++;
+            m_sh->mtx->unlock();
+            for (i = 0; i < OUTER_WORK; i++) dummy++;
+            n++;
+        }
+        m_ops = n;
+    };
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void run_case(const char *name, int mode, int nthreads, unsigned long ms)
+{
+    EzMutex mtx(mode, name);
+    Shared sh;
+    Worker w[MAX_THREADS];
+    unsigned long total = 0, lo = (unsigned long)-1, hi = 0;
+    double t0, t1;
+    int i;
+
+    sh.mtx = &mtx;
+    sh.start = 0;
+    sh.stop = 0;
+    sh.counter = 0;
+    for (i = 0; i < nthreads; i++) {
+        w[i].m_sh = &sh;
+        w[i].run();
+    }
+
+    t0 = bench_seconds();
+    sh.start = 1;
+    EzMutex::millisleep(ms);
+    sh.stop = 1;
+    for (i = 0; i < nthreads; i++) w[i].join();
+    t1 = bench_seconds();
+
+    for (i = 0; i < nthreads; i++) {
+        total += w[i].m_ops;
+        if (w[i].m_ops < lo) lo = w[i].m_ops;
+        if (w[i].m_ops > hi) hi = w[i].m_ops;
+    }
+    printf("%-9s %3d threads : %10.3f Mops/s  min/max per thread %lu/%lu%s\n",
+           name, nthreads, (double)total / (t1 - t0) * 1e-6, lo, hi,
+           (sh.counter == total) ? "" : "  ** COUNT MISMATCH **");
+#ifdef EZMTX_INSTRUMENT
+    EzMutex::report(stdout);
+#endif
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long ms = bench_duration_ms(argc, argv, 200);
+    int n;
+
+    for (n = 1; n <= MAX_THREADS; n <<= 1) {
+        run_case("spin",     EZMTX_SPIN,     n, ms);
+        run_case("adaptive", EZMTX_ADAPTIVE, n, ms);
+    }
+    return 0;
+}
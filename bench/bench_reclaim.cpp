@@ -0,0 +1,250 @@
+/***********************************************************************
+bench_reclaim.cpp : memory reclamation, EzEpoch / EzHazardPtr
+
+  stack    : every thread pushes a new node onto a lock-free (Treiber)
+             stack, pops one and retires it.
+               leak     : popped nodes are never freed (no protection)
+               epoch    : pop in an EzEpoch region, EzEpoch::retire()
+               hazard   : pop with EzHazardPtr::protect(), retire()
+  read     : readers read a shared object again and again while one
+             writer replaces it and retires the old one.
+               mutex    : readers and writer lock an EzMutex
+               epoch    : readers in an EzEpoch region
+               hazard   : readers protect() the pointer
+  Reported: nanoseconds per operation (stack) / per read (read),
+            and the nodes freed by the end of the run.
+
+  usage: bench_reclaim [ops]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_reclaim.cpp -pthread
+ MinGW:         g++ -O2 -static bench_reclaim.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_reclaim.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   8
+
+enum { MODE_LEAK, MODE_MUTEX, MODE_EPOCH, MODE_HAZARD };
+
+struct Node {
+    long  value;
+    Node *next;
+};
+
+static long g_ops = 200000;
+static int  g_mode;
+static volatile long g_sink;
+static VOLATILE_ eztoken_t g_freed;
+
+static EzEpoch     *g_epoch;
+static EzHazardPtr *g_hazard;
+static EzMutex      g_mtx;
+
+static void free_node(void *p)
+{
+    EzAtomic::fetch_add(&g_freed, (eztoken_t)1);
+    delete static_cast<Node *>(p);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static Node * VOLATILE_ g_top;
+
+static void push(Node *n)
+{
+    Node *head = EzAtomic::load(&g_top);
+    for (;;) {
+        Node *prev;
+        n->next = head;
+        prev = EzAtomic::cas(&g_top, head, n);
+        if (prev == head) break;
+        head = prev;
+    }
+}
+
+static Node *pop()
+{
+    Node *head;
+    if (g_mode == MODE_HAZARD) {
+        for (;;) {
+            head = g_hazard->protect(0, &g_top);
+            if (head == NULL) break;
+            if (EzAtomic::cas(&g_top, head, head->next) == head) break;
+        }
+        g_hazard->clear(0);
+        return head;
+    }
+    if (g_mode == MODE_EPOCH) g_epoch->enter();
+    head = EzAtomic::load(&g_top);
+    while (head) {
+        Node *prev = EzAtomic::cas(&g_top, head, head->next);
+        if (prev == head) break;
+        head = prev;
+    }
+    if (g_mode == MODE_EPOCH) g_epoch->exit();
+    return head;
+}
+
+static void stack_worker(int id)
+{
+    long x = 0;
+    for (long i = 0; i < g_ops; i++) {
+        Node *n = new Node;
+        n->value = i + id;
+        push(n);
+        n = pop();
+        if (n == NULL) continue;
+        x += n->value;
+        if (g_mode == MODE_EPOCH)       g_epoch->retire(static_cast<void *>(n), &free_node);
+        else if (g_mode == MODE_HAZARD) g_hazard->retire(static_cast<void *>(n), &free_node);
+    }
+    g_sink = x;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static Node * VOLATILE_ g_shared;
+static VOLATILE_ eztoken_t g_readers_done;
+
+static void read_worker(int id)
+{
+    long x = 0;
+    for (long i = 0; i < g_ops; i++) {
+        Node *n;
+        switch (g_mode) {
+        case MODE_MUTEX:
+            g_mtx.lock();
+            x += g_shared->value;
+            g_mtx.unlock();
+            break;
+        case MODE_EPOCH:
+            g_epoch->enter();
+            n = EzAtomic::load(&g_shared);
+            x += n->value;
+            g_epoch->exit();
+            break;
+        default:
+            n = g_hazard->protect(0, &g_shared);
+            x += n->value;
+            break;
+        }
+    }
+    if (g_mode == MODE_HAZARD) g_hazard->clear(0);
+    EzAtomic::fetch_add(&g_readers_done, (eztoken_t)1);
+    g_sink = x + id;
+}
+
+static void write_worker(int nreaders)
+{
+    long i = 0;
+    while (EzAtomic::load(&g_readers_done) < nreaders) {
+        Node *n = new Node, *old;
+        n->value = i++;
+        if (g_mode == MODE_MUTEX) {
+            g_mtx.lock();
+            old = g_shared;
+            g_shared = n;
+            g_mtx.unlock();
+            free_node(old);
+        } else {
+            old = EzAtomic::exchange(&g_shared, n);
+            if (g_mode == MODE_EPOCH) g_epoch->retire(static_cast<void *>(old), &free_node);
+            else                      g_hazard->retire(static_cast<void *>(old), &free_node);
+        }
+        EzMutex::Wait();
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void run_stack(const char *name, int mode, int nthreads)
+{
+    EzThread<int> th[MAX_THREADS];
+    double t0, t1;
+    int i;
+
+    g_mode = mode;
+    g_freed = 0;
+    g_epoch = new EzEpoch;
+    g_hazard = new EzHazardPtr;
+    t0 = bench_seconds();
+    for (i = 0; i < nthreads; i++) th[i].run(stack_worker, i);
+    for (i = 0; i < nthreads; i++) th[i].wait();
+    t1 = bench_seconds();
+
+    printf("stack %-8s %2d threads : %8.2f ns/op   freed %3.0f%%\n", name, nthreads,
+           (t1 - t0) * 1e9 / ((double)g_ops * nthreads),
+           100.0 * (double)g_freed / ((double)g_ops * nthreads));
+    fflush(stdout);
+
+    while (g_top) {
+        Node *n = g_top;
+        g_top = n->next;
+        delete n;
+    }
+    delete g_epoch;
+    delete g_hazard;
+}
+
+static void run_read(const char *name, int mode, int nreaders)
+{
+    EzThread<int> th[MAX_THREADS];
+    EzThread<int> writer;
+    double t0, t1;
+    int i;
+
+    g_mode = mode;
+    g_freed = 0;
+    g_readers_done = 0;
+    g_epoch = new EzEpoch;
+    g_hazard = new EzHazardPtr;
+    g_shared = new Node;
+    g_shared->value = 0;
+    t0 = bench_seconds();
+    writer.run(write_worker, nreaders);
+    for (i = 0; i < nreaders; i++) th[i].run(read_worker, i);
+    for (i = 0; i < nreaders; i++) th[i].wait();
+    t1 = bench_seconds();
+    writer.wait();
+
+    printf("read  %-8s %2d readers : %8.2f ns/read  freed %ld\n", name, nreaders,
+           (t1 - t0) * 1e9 / ((double)g_ops * nreaders), (long)g_freed);
+    fflush(stdout);
+
+    delete g_shared;
+    delete g_epoch;
+    delete g_hazard;
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[] = { 1, 2, 4, 8 };
+    int ncpu = EzThreadBase::cpu_count();
+    unsigned k;
+
+    if (argc > 1) g_ops = atol(argv[1]);
+    if (g_ops < 1) g_ops = 1;
+
+    printf("asymmetric fence: %s\n", EzAsymFence::init() ? "yes" : "no");
+    for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        int n = counts[k];
+        if (n > 1 && n > ncpu) break;
+        run_stack("leak",   MODE_LEAK,   n);
+        run_stack("epoch",  MODE_EPOCH,  n);
+        run_stack("hazard", MODE_HAZARD, n);
+    }
+    for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        int n = counts[k];
+        if (n > 1 && n >= ncpu) break;
+        run_read("mutex",  MODE_MUTEX,  n);
+        run_read("epoch",  MODE_EPOCH,  n);
+        run_read("hazard", MODE_HAZARD, n);
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+/***********************************************************************
+bench_rwlock.cpp : EzRWMutex read-mostly benchmark
+
+  Threads look up a shared table and rarely update it, at read:write
+  ratios of 100:1 and 10000:1, with 1 to 16 threads:
+    mutex       : EzMutex (EZMTX_ADAPTIVE) for both readers and writers
+    rw-central  : EzRWMutex (EZRW_CENTRAL)
+    rw-striped  : EzRWMutex (EZRW_DISTRIBUTED)
+  A writer rewrites the whole table, and a reader checks that the
+  table is consistent.
+
+  usage: bench_rwlock [milliseconds per case]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_rwlock.cpp -pthread
+ MinGW:         g++ -O2 -static bench_rwlock.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_rwlock.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define MAX_THREADS   16
+#define TABLE_SIZE    16
+
+enum { MODE_MUTEX, MODE_RW_CENTRAL, MODE_RW_STRIPED };
+
+/* ------------------------------------------------------------------------- */
+
+struct Shared {
+    int mode;
+    unsigned long ratio;            /* reads per write */
+    EzMutex *mtx;
+    EzRWMutex *rw;
+    volatile int start;
+    volatile int stop;
+    volatile unsigned long table[TABLE_SIZE];   /* all entries are equal */
+    volatile int broken;
+};
+
+class Worker : public EzThreadBase
+{
+  public:
+    Shared *m_sh;
+    unsigned long m_seed;
+    unsigned long m_reads, m_writes;
+
+    Worker() { m_sh = NULL; m_seed = 1; m_reads = m_writes = 0; };
+    ~Worker() { join(); };
+
+    void read_table() {
+        unsigned long v = m_sh->table[0];
+        for (int i = 1; i < TABLE_SIZE; i++) {
+            if (m_sh->table[i] != v) m_sh->broken = 1;
+        }
+    };
+
+    void write_table() {
+        unsigned long v = m_sh->table[0] + 1;
+        for (int i = 0; i < TABLE_SIZE; i++) m_sh->table[i] = v;
+    };
+
+    void app() {
+        Shared *sh = m_sh;
+        unsigned long r = 0, w = 0;
+
+        while (!sh->start) EzMutex::Wait();
+        while (!sh->stop) {
+            m_seed = m_seed * 1103515245UL + 12345UL;
+            bool write = ((m_seed >> 8) % (sh->ratio + 1) == 0);
+            if (sh->mode == MODE_MUTEX) {
+                sh->mtx->lock();
+                if (write) write_table(); else read_table();
+                sh->mtx->unlock();
+            } else if (write) {
+                sh->rw->lock();
+                write_table();
+                sh->rw->unlock();
+            } else {
+                sh->rw->lock_shared();
+                read_table();
+                sh->rw->unlock_shared();
+            }
+            if (write) w++; else r++;
+        }
+        m_reads = r;
+        m_writes = w;
+    };
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void run_case(const char *name, int mode, unsigned long ratio,
+                     int nthreads, unsigned long ms)
+{
+    EzMutex mtx(EZMTX_ADAPTIVE);
+    EzRWMutex rw((mode == MODE_RW_STRIPED) ? EZRW_DISTRIBUTED : EZRW_CENTRAL);
+    Shared sh;
+    Worker w[MAX_THREADS];
+    unsigned long reads = 0, writes = 0;
+    double t0, t1;
+    int i;
+
+    sh.mode = mode;
+    sh.ratio = ratio;
+    sh.mtx = &mtx;
+    sh.rw = &rw;
+    sh.start = 0;
+    sh.stop = 0;
+    sh.broken = 0;
+    for (i = 0; i < TABLE_SIZE; i++) sh.table[i] = 0;
+    for (i = 0; i < nthreads; i++) {
+        w[i].m_sh = &sh;
+        w[i].m_seed = (unsigned long)i * 7919UL + 1UL;
+        w[i].run();
+    }
+
+    t0 = bench_seconds();
+    sh.start = 1;
+    EzMutex::millisleep(ms);
+    sh.stop = 1;
+    for (i = 0; i < nthreads; i++) w[i].join();
+    t1 = bench_seconds();
+
+    for (i = 0; i < nthreads; i++) {
+        reads += w[i].m_reads;
+        writes += w[i].m_writes;
+    }
+    printf("%-10s %5lu:1 %3d threads : %9.3f Mops/s  (%lu writes)%s\n",
+           name, ratio, nthreads, (double)(reads + writes) / (t1 - t0) * 1e-6,
+           writes, sh.broken ? "  ** INCONSISTENT READ **" : "");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned long ratios[2] = { 100UL, 10000UL };
+    unsigned long ms = bench_duration_ms(argc, argv, 200);
+    int n, r;
+
+    for (r = 0; r < 2; r++) {
+        for (n = 1; n <= MAX_THREADS; n <<= 1) {
+            run_case("mutex",      MODE_MUTEX,      ratios[r], n, ms);
+            run_case("rw-central", MODE_RW_CENTRAL, ratios[r], n, ms);
+            run_case("rw-striped", MODE_RW_STRIPED, ratios[r], n, ms);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+/***********************************************************************
+bench_spsc.cpp : EzSpscQueue producer/consumer throughput
+
+  One producer thread sends MESSAGES integers to one consumer thread:
+    try       : try_push / try_pop with spinning
+    batch     : push_n / pop_n in batches of BATCH items
+    blocking  : push / pop (park when full / empty)
+    mutex     : EzRing guarded by an adaptive EzMutex (baseline)
+
+  usage: bench_spsc [messages]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_spsc.cpp -pthread
+ MinGW:         g++ -O2 -static bench_spsc.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_spsc.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define QSIZE   1024
+#define BATCH   64
+
+enum { MODE_TRY, MODE_BATCH, MODE_BLOCKING, MODE_MUTEX };
+
+static long g_messages = 10000000L;
+
+struct Channel {
+    int mode;
+    EzSpscQueue<long, QSIZE> *q;
+    EzRing<long> *ring;
+    EzMutex *mtx;
+    unsigned long sum;
+};
+
+/* 0 + 1 + ... + (g_messages - 1), wrapped around like the consumer's sum */
+static unsigned long expected_sum(void)
+{
+    unsigned long m = (unsigned long)g_messages;
+    return (m % 2 == 0) ? (m / 2) * (m - 1) : m * ((m - 1) / 2);
+}
+
+/* spin a little, then give the CPU away (matters when cores are scarce) */
+static inline void backoff(int *k)
+{
+    if (++*k < 1000) {
+        EzAtomic::relax();
+    } else {
+        *k = 0;
+        EzMutex::Wait();
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void producer(Channel *ch)
+{
+    long i = 0, buf[BATCH];
+    int n, k, spin = 0;
+
+    switch (ch->mode) {
+    case MODE_TRY:
+        for (i = 0; i < g_messages; i++) {
+            while (!ch->q->try_push(i)) backoff(&spin);
+        }
+        break;
+    case MODE_BATCH:
+        while (i < g_messages) {
+            n = (g_messages - i < BATCH) ? (int)(g_messages - i) : BATCH;
+            for (k = 0; k < n; k++) buf[k] = i + k;
+            for (k = 0; k < n; ) {
+                int m = ch->q->push_n(buf + k, n - k);
+                if (m == 0) backoff(&spin);
+                k += m;
+            }
+            i += n;
+        }
+        break;
+    case MODE_BLOCKING:
+        for (i = 0; i < g_messages; i++) ch->q->push(i);
+        break;
+    case MODE_MUTEX:
+        for (i = 0; i < g_messages; ) {
+            ch->mtx->lock();
+            if (ch->ring->size() < QSIZE) {
+                ch->ring->push(i);
+                i++;
+            }
+            ch->mtx->unlock();
+            if (i % QSIZE == 0) backoff(&spin);
+        }
+        break;
+    }
+}
+
+static void consumer(Channel *ch)
+{
+    long i = 0, v, buf[BATCH];
+    unsigned long sum = 0;
+    int n, k, spin = 0;
+
+    switch (ch->mode) {
+    case MODE_TRY:
+        for (i = 0; i < g_messages; i++) {
+            while (!ch->q->try_pop(v)) backoff(&spin);
+            sum += (unsigned long)v;
+        }
+        break;
+    case MODE_BATCH:
+        while (i < g_messages) {
+            n = ch->q->pop_n(buf, BATCH);
+            if (n == 0) backoff(&spin);
+            for (k = 0; k < n; k++) sum += (unsigned long)buf[k];
+            i += n;
+        }
+        break;
+    case MODE_BLOCKING:
+        for (i = 0; i < g_messages; i++) {
+            ch->q->pop(v);
+            sum += (unsigned long)v;
+        }
+        break;
+    case MODE_MUTEX:
+        for (i = 0; i < g_messages; ) {
+            bool got;
+            ch->mtx->lock();
+            got = ch->ring->pop(v);
+            ch->mtx->unlock();
+            if (got) {
+                sum += (unsigned long)v;
+                i++;
+            } else {
+                backoff(&spin);
+            }
+        }
+        break;
+    }
+    ch->sum = sum;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void run_case(const char *name, int mode)
+{
+    EzSpscQueue<long, QSIZE> *q = new EzSpscQueue<long, QSIZE>;
+    EzRing<long> ring(QSIZE);
+    EzMutex mtx(EZMTX_ADAPTIVE);
+    Channel ch;
+    double t0, t1;
+
+    ch.mode = mode;
+    ch.q = q;
+    ch.ring = &ring;
+    ch.mtx = &mtx;
+    ch.sum = 0;
+
+    t0 = bench_seconds();
+    {
+        EzThread<Channel *> cons(&consumer, &ch);
+        EzThread<Channel *> prod(&producer, &ch);
+    }   /* both threads are joined here */
+    t1 = bench_seconds();
+
+    printf("%-9s : %8.2f Mmsg/s %s\n", name,
+           (double)g_messages / (t1 - t0) * 1e-6,
+           (ch.sum == expected_sum()) ? "" : "** CHECKSUM MISMATCH **");
+    fflush(stdout);
+    delete q;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && atol(argv[1]) > 0) g_messages = atol(argv[1]);
+    printf("%ld messages, queue size %d\n", g_messages, QSIZE);
+    run_case("try",      MODE_TRY);
+    run_case("batch",    MODE_BATCH);
+    run_case("blocking", MODE_BLOCKING);
+    run_case("mutex",    MODE_MUTEX);
+    return 0;
+}
@@ -0,0 +1,95 @@
+/***********************************************************************
+bench_status.cpp : EzThreadBase::status() polling throughput
+
+  TARGETS running threads are polled by 1 .. 8 monitor threads, each of
+  which calls status() on every target in a loop for a fixed period.
+
+  usage: bench_status [milliseconds per case]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_status.cpp -pthread
+ MinGW:         g++ -O2 -static bench_status.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_status.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define TARGETS       256
+#define MAX_MONITORS  8
+
+static volatile int g_quit = 0;
+static volatile int g_start = 0;
+static volatile int g_stop = 0;
+
+/* ------------------------------------------------------------------------- */
+
+class Target : public EzThreadBase
+{
+  public:
+    ~Target() { join(); };
+    void app() { while (!g_quit) EzMutex::millisleep(5); };
+};
+
+class Monitor : public EzThreadBase
+{
+  public:
+    Target *m_targets;
+    unsigned long m_polls;
+    unsigned long m_running;
+
+    ~Monitor() { join(); };
+    void app() {
+        unsigned long polls = 0, running = 0;
+        while (!g_start) EzMutex::Wait();
+        while (!g_stop) {
+            for (int i = 0; i < TARGETS; i++) {
+                if (m_targets[i].status() == EZTH_RUNNING) running++;
+            }
+            polls += TARGETS;
+        }
+        m_polls = polls;
+        m_running = running;
+    };
+};
+
+/* ------------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+    unsigned long ms = bench_duration_ms(argc, argv, 300);
+    Target *targets = new Target[TARGETS];
+    int i, n;
+
+    for (i = 0; i < TARGETS; i++) targets[i].run();
+    EzMutex::millisleep(100);
+
+    for (n = 1; n <= MAX_MONITORS; n <<= 1) {
+        Monitor mon[MAX_MONITORS];
+        unsigned long total = 0;
+        double t0, t1;
+
+        g_start = g_stop = 0;
+        for (i = 0; i < n; i++) {
+            mon[i].m_targets = targets;
+            mon[i].run();
+        }
+        t0 = bench_seconds();
+        g_start = 1;
+        EzMutex::millisleep(ms);
+        g_stop = 1;
+        for (i = 0; i < n; i++) mon[i].join();
+        t1 = bench_seconds();
+
+        for (i = 0; i < n; i++) total += mon[i].m_polls;
+        printf("%d monitor(s) x %d targets : %10.2f Mpolls/s\n",
+               n, TARGETS, (double)total / (t1 - t0) * 1e-6);
+        fflush(stdout);
+    }
+
+    g_quit = 1;
+    delete [] targets;
+    return 0;
+}
@@ -0,0 +1,167 @@
+/***********************************************************************
+bench_worksteal.cpp : EzWorkStealPool scaling benchmark
+
+  Recursive divide-and-conquer workloads on 1 .. 2 x cpu_count() workers:
+    fib   : naive Fibonacci, each call spawns one half and runs the other
+    qsort : parallel quick-sort of random integers
+  The speedup is relative to the 1-worker run.
+
+  usage: bench_worksteal [fib n] [sort elements]
+
+How to compile:
+
+ GNU:           g++ -O2 bench_worksteal.cpp -pthread
+ MinGW:         g++ -O2 -static bench_worksteal.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /O2 /MT bench_worksteal.cpp
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../EzThread.hpp"
+#include "bench_common.h"
+
+#define FIB_CUTOFF    20      /* below this, fib runs serially     */
+#define SORT_CUTOFF   4096    /* below this, qsort runs serially   */
+
+/* ------------------------------- fib ------------------------------------- */
+
+struct FibArg {
+    int  n;
+    long result;
+};
+
+static EzWorkStealPool<FibArg *> *g_fib_pool;
+
+static long fib_serial(int n)
+{
+    return (n < 2) ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+static void fib_task(FibArg *a)
+{
+    if (a->n < FIB_CUTOFF) {
+        a->result = fib_serial(a->n);
+        return;
+    }
+    FibArg x, y;
+    EzTaskGroup g;
+    x.n = a->n - 1;
+    y.n = a->n - 2;
+    g_fib_pool->spawn(&fib_task, &x, &g);  /* goes to the local deque */
+    fib_task(&y);                          /* run the other half here */
+    g_fib_pool->wait(g);                   /* runs other tasks meanwhile */
+    a->result = x.result + y.result;
+}
+
+/* ------------------------------ qsort ------------------------------------ */
+
+struct SortArg {        /* allocated by the spawner, deleted by the task */
+    int  *a;
+    long  lo, hi;       /* [lo, hi] */
+    EzTaskGroup *g;
+};
+
+static EzWorkStealPool<SortArg *> *g_sort_pool;
+
+static int cmp_int(const void *x, const void *y)
+{
+    int a = *(const int *)x, b = *(const int *)y;
+    return (a < b) ? -1 : (a > b);
+}
+
+static void sort_task(SortArg *s)
+{
+    int *a = s->a;
+    long lo = s->lo, hi = s->hi;
+
+    while (hi - lo >= SORT_CUTOFF) {
+        int pivot = a[lo + (hi - lo) / 2];
+        long i = lo, j = hi;
+        while (i <= j) {
+            while (a[i] < pivot) i++;
+            while (a[j] > pivot) j--;
+            if (i <= j) {
+                int t = a[i]; a[i] = a[j]; a[j] = t;
+                i++; j--;
+            }
+        }
+        /* spawn the left part, continue with the right part */
+        SortArg *left = new SortArg;
+        left->a = a; left->lo = lo; left->hi = j; left->g = s->g;
+        g_sort_pool->spawn(&sort_task, left, s->g);
+        lo = i;
+    }
+    if (hi > lo) qsort(a + lo, (size_t)(hi - lo + 1), sizeof(int), cmp_int);
+    delete s;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static double run_fib(int nthreads, int n, long *result)
+{
+    EzWorkStealPool<FibArg *> pool(nthreads);
+    FibArg root;
+    EzTaskGroup g;
+    double t0, t1;
+
+    g_fib_pool = &pool;
+    root.n = n;
+    t0 = bench_seconds();
+    pool.spawn(&fib_task, &root, &g);
+    pool.wait(g);
+    t1 = bench_seconds();
+    *result = root.result;
+    return t1 - t0;
+}
+
+static double run_sort(int nthreads, long n, int *ok)
+{
+    EzWorkStealPool<SortArg *> pool(nthreads);
+    EzTaskGroup g;
+    SortArg *root = new SortArg;
+    int *a = new int[n];
+    double t0, t1;
+    long i;
+
+    srand(12345);
+    for (i = 0; i < n; i++) a[i] = rand() ^ (rand() << 15);
+
+    g_sort_pool = &pool;
+    root->a = a; root->lo = 0; root->hi = n - 1; root->g = &g;
+    t0 = bench_seconds();
+    pool.spawn(&sort_task, root, &g);
+    pool.wait(g);
+    t1 = bench_seconds();
+
+    *ok = 1;
+    for (i = 1; i < n; i++) if (a[i - 1] > a[i]) { *ok = 0; break; }
+    delete [] a;
+    return t1 - t0;
+}
+
+int main(int argc, char *argv[])
+{
+    int  fib_n  = (argc > 1) ? atoi(argv[1]) : 36;
+    long sort_n = (argc > 2) ? atol(argv[2]) : 4000000L;
+    int  maxth  = 2 * EzThreadBase::cpu_count();
+    double base = 0.0, t;
+    long result;
+    int n, ok;
+
+    printf("cpu_count = %d\n", EzThreadBase::cpu_count());
+    for (n = 1; n <= maxth; n <<= 1) {
+        t = run_fib(n, fib_n, &result);
+        if (n == 1) base = t;
+        printf("fib(%d)   %3d workers : %8.3f sec  speedup %5.2f  (result %ld)\n",
+               fib_n, n, t, base / t, result);
+        fflush(stdout);
+    }
+    for (n = 1; n <= maxth; n <<= 1) {
+        t = run_sort(n, sort_n, &ok);
+        if (n == 1) base = t;
+        printf("qsort(%ld) %3d workers : %8.3f sec  speedup %5.2f  %s\n",
+               sort_n, n, t, base / t, ok ? "sorted" : "** NOT SORTED **");
+        fflush(stdout);
+    }
+    return 0;
+}
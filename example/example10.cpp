@@ -0,0 +1,78 @@
+/*****************************************************************************
+      example10.cpp : EzThread Example: Any Callable with Arguments (C++11)
+ ----------------------------------------------------------------------------
+    With a C++11 compiler, EzThread also runs any callable (a function,
+    a lambda or a function object) with any number of arguments.
+    (1) Instantiate EzThread<> (no TYPE is needed).
+    (2) Pass the callable and its arguments to the constructor or run().
+    The callable and the arguments are moved (lvalues are copied) into
+    the EzThread object itself, and moved into the call: no heap memory
+    is allocated. A compile error tells if they need more than
+    EZTHREAD_INPLACE_SIZE (64) bytes; define it larger before including
+    EzThread.hpp, or pass a pointer.
+
+How to compile:
+
+ GNU:           g++ -std=c++11 example10.cpp -pthread
+ MinGW:         g++ -std=c++11 -static -static-libstdc++ -static-libgcc example10.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /MT /EHsc example10.cpp
+ *****************************************************************************/
+
+#include <stdio.h>      /* printf() */
+#include "../EzThread.hpp"
+
+#ifdef EZ_HAVE_CXX11
+
+#include <memory>       /* std::unique_ptr */
+#include <string>
+
+/* ---------------------- a function with 3 arguments ----------------------- */
+void report(const char *name, int count, double ratio)
+{
+    printf("%s: %d (%.2f)\n", name, count, ratio);
+}
+
+/* ---------------------------- a function object ---------------------------- */
+struct Counter {
+    int limit;
+    void operator()(std::string label) const {
+        for (int i = 1; i <= limit; i++) printf("%s %d\n", label.c_str(), i);
+    }
+};
+
+/* ---------------------------------- main ---------------------------------- */
+int main()
+{
+    {
+        EzThread<> t(&report, "items", 42, 0.5);    /* starts at once */
+    }   /* joined at the deletion */
+
+    {
+        Counter counter = { 3 };
+        EzThread<> t;
+        t.run(counter, std::string("tick"));   /* counter is copied, the string moved */
+        t.wait();
+    }
+
+    {
+        /* a move-only argument is handed over to the thread */
+        std::unique_ptr<int> data(new int(7));
+        int result = 0;
+        EzThread<> t([&result](std::unique_ptr<int> p, int k) { result = *p * k; },
+                     std::move(data), 6);
+        t.wait();
+        printf("result = %d\n", result);
+    }
+
+    return 0;
+}
+
+#else
+
+int main()
+{
+    printf("example10 needs a C++11 compiler.\n");
+    return 0;
+}
+
+#endif
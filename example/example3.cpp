@@ -1,49 +1,40 @@
 #include <stdio.h>
-#include <time.h>
 #include "../EzThread.hpp"
 
 #ifdef __DMC__
 #  include "dmc_safe_printf.h" /* patch for Digial Mars Compiler's printf() */
 #endif
 
-#define VBOOL_t  volatile bool
-
 /*----------------------------*/
 /*     thread function #1     */
 /*----------------------------*/
-void threadfunc1(VBOOL_t *pReady) /* the memory pointed by pReady is shared with main() */
+void threadfunc1(int n)
 {
-    printf("<< Start Thread1 >>\n");
+    printf("<< Start Thread%d >>\n", n);
 
-    time_t t = clock();
-    while(*pReady == true) {
+    /* sleeps until timeout or request_stop() on this thread's object */
+    while(EzThreadBase::current_wait_stop(250) != 0) {
     /* do something... */
-        if (clock() > t+(static_cast<time_t>(CLOCKS_PER_SEC)>>2)) {
-            printf("|"); fflush(stdout);
-            t=clock();
-        }
+        printf("|"); fflush(stdout);
     }
 
-    printf("<< End Thread1 >>\n");
+    printf("<< End Thread%d >>\n", n);
 }
 
 /*----------------------------*/
 /*     thread function #2     */
 /*----------------------------*/
-void threadfunc2(VBOOL_t *pReady)
+void threadfunc2(int n)
 {
-    printf("<< Start Thread2 >>\n");
+    printf("<< Start Thread%d >>\n", n);
 
-    time_t t = clock();
-    while(*pReady == true) {
+    while(!EzThreadBase::current_stop_requested()) {  /* or poll the stop request */
+        EzMutex::millisleep(1000);
     /* do something... */
-        if (clock() > t+static_cast<time_t>(CLOCKS_PER_SEC)) {
-            printf("-"); fflush(stdout);
-            t=clock();
-        }
+        printf("-"); fflush(stdout);
     }
 
-    printf("<< End Thread2 >>\n");
+    printf("<< End Thread%d >>\n", n);
 }
 
 /*----------------------------*/
@@ -51,16 +42,17 @@ void threadfunc2(VBOOL_t *pReady)
 /*----------------------------*/
 int main(void)
 {
-    VBOOL_t ready = true;
-    EzThread<VBOOL_t *> obj1(&threadfunc1, &ready);  /* begin thread */
-    EzThread<VBOOL_t *> obj2(&threadfunc2, &ready);  /* begin thread */
+    EzThread<int> obj1(&threadfunc1, 1);  /* begin thread */
+    EzThread<int> obj2(&threadfunc2, 2);  /* begin thread */
 
     printf("==== main() : Thread has been created ====\n");
 
     getchar();  /* Enter key to stop */
 
     printf("==== main() : Give an instruction to quit ====\n");
-    ready = false;
+    obj1.request_stop();  /* wakes Thread1 at once */
+
+    if (obj1.wait_for(200) != 0) printf("Thread1 did not stop in time\n");
 
-    return 0;
+    return 0;   /* ~EzThread() requests a stop of Thread2 and waits for it */
 }
@@ -14,6 +14,7 @@ How to compile:
 ***********************************************************************/
 
 #define MAX_TRY_THREADS  1560   /* !!! For bcc32 setting over 1560 cause freeze !!! */
+#define STACK_SIZE       (64 * 1024)  /* instead of the default (8MB on Linux) */
 
 #include <stdio.h>      /* printf() */
 #include <vector>       /* std::vector */
@@ -29,11 +30,11 @@ How to compile:
 
 /* ------------------------------------------------------------------------- */
 
-static volatile int go = 0;
+static EzEvent go(EZEVT_MANUAL);  /* all the threads wait for this event */
 
 void thread_func(int n)
 {
-    while(!go) EzMutex::millisleep(10);  /* Wait for a go signal */
+    go.wait();  /* Wait for a go signal (parks without using CPU) */
     for (int i=1 ; i<=10; i++) {
         EzMutex::millisleep(500);
         printf("<< t%05d >> loop %d\n", n, i);
@@ -47,8 +48,12 @@ int main(void)
 {
     std::vector<EzThread<int> *> objs;
     EzThread<int> *p;
+    EzThreadAttr attr;
+    ezint64_t t0;
     int n;
 
+    attr.set_stack_size(STACK_SIZE);  /* small stacks allow more threads */
+
     n = 0;
     while (n < MAX_TRY_THREADS) {
         if ((p = new (std::nothrow) EzThread<int>) == NULL) {
@@ -56,6 +61,7 @@ int main(void)
             fprintf(stderr, "Reached new limitation\n");
             break;
         }
+        p->set_thread_attr(attr);
         if (p->run(&thread_func, n)) {
             /* thread creation failure */
             fprintf(stderr, "Reached _beginthreadex limitation\n");
@@ -69,7 +75,10 @@ int main(void)
 
     fprintf(stderr,"***** n=%d ******\n", n);
     EzMutex::millisleep(5000);
-    go = 1;  /* Signal for all the threads to start to count up */
+    t0 = EzMutex::nanotime();
+    go.set();  /* Signal for all the threads to start to count up */
+    fprintf(stderr,"***** go.set() took %ld us ******\n",
+            (long)((EzMutex::nanotime() - t0) / 1000));
 
     /* Delete all the instances */
     while (!objs.empty()) {
@@ -0,0 +1,71 @@
+/*****************************************************************************
+      example5.cpp : EzThreadPool Example: Reusing Worker Threads
+ ----------------------------------------------------------------------------
+    EzThreadPool<TYPE> keeps a fixed number of worker threads alive and
+    runs 'void funcname(TYPE)' jobs on them. Submitting a job costs a queue
+    push and a wakeup instead of a thread creation.
+    (1) Define a job function of type 'void funcname(TYPE)'.
+    (2) Instantiate an EzThreadPool<TYPE> object with the number of workers.
+    (3) submit() jobs, and wait_all() for them to finish.
+    (4) Optionally, give the workers EzThreadAttr::set_profiling(true) and
+        read worker_stats() after shutdown().
+
+How to compile:
+
+ GNU:           g++ example5.cpp -pthread
+ MinGW:         g++ -static -static-libstdc++ -static-libgcc example5.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /MT example5.cpp
+ Borland:       bcc32 -WM example5.cpp
+ Digital Mars:  dmc example5.cpp -D_MT=1
+ Open Watcom:   wcl386 -bm example5.cpp
+ *****************************************************************************/
+
+#include <stdio.h>      /* printf() */
+#include "../EzThread.hpp"
+
+#ifdef __DMC__
+#  include "dmc_safe_printf.h" /* patch for Digial Mars Compiler's printf() */
+#endif
+
+#define NUM_JOBS  1000
+
+static volatile long results[NUM_JOBS];
+
+/* ----------------------------- job function ------------------------------- */
+void job_func(int n)
+{
+    long sum = 0;
+    for (int i = 0 ; i <= n ; i++) sum += i;
+    results[n] = sum;
+}
+
+/* ---------------------------------- main ---------------------------------- */
+int main()
+{
+    EzThreadAttr attr;
+    attr.set_profiling(true);    /* record the life cycle of each worker */
+
+    EzThreadPool<int> pool(4, EZPLACE_NONE, attr);  /* 4 workers are started here */
+
+    printf("workers: %d\n", pool.size());
+
+    for (int round = 1 ; round <= 3 ; round++) {
+        for (int i = 0 ; i < NUM_JOBS ; i++) {
+            pool.submit(&job_func, i);
+        }
+        pool.wait_all();         /* the workers stay alive for the next round */
+
+        printf("round %d: results[%d] = %ld\n",
+               round, NUM_JOBS - 1, results[NUM_JOBS - 1]);
+    }
+
+    pool.shutdown();             /* join the workers to complete the stats */
+    for (int w = 0 ; w < pool.size() ; w++) {
+        const EzThreadStats& st = pool.worker_stats(w);
+        printf("worker %d: start latency %ld us, cpu %ld us, preempted %ld times\n",
+               w, (long)((st.start_ns - st.run_ns) / 1000),
+               (long)(st.cpu_ns / 1000), st.involuntary_switches);
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*****************************************************************************
+      example6.cpp : EzFuture Example: Getting Return Values from Threads
+ ----------------------------------------------------------------------------
+    EzThread<TYPE>::async() runs a function of type 'R funcname(TYPE)' on a
+    thread and returns an EzFuture<R> which receives the return value.
+    The results are collected as each one finishes, not in a fixed order.
+
+How to compile:
+
+ GNU:           g++ example6.cpp -pthread
+ MinGW:         g++ -static -static-libstdc++ -static-libgcc example6.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /MT example6.cpp
+ Borland:       bcc32 -WM example6.cpp
+ Digital Mars:  dmc example6.cpp -D_MT=1
+ Open Watcom:   wcl386 -bm example6.cpp
+ *****************************************************************************/
+
+#include <stdio.h>      /* printf() */
+#include "../EzThread.hpp"
+
+#ifdef __DMC__
+#  include "dmc_safe_printf.h" /* patch for Digial Mars Compiler's printf() */
+#endif
+
+#define NUM_THREADS  4
+
+/* -------------------------- thread function ------------------------------- */
+/* The return value is passed to the future.                                  */
+/* -------------------------------------------------------------------------- */
+long slow_square(int n)
+{
+    EzMutex::millisleep(300 * (NUM_THREADS - n));   /* the last one ends first */
+    return (long)n * n;
+}
+
+/* ---------------------------------- main ---------------------------------- */
+int main()
+{
+    EzThread<int>  th[NUM_THREADS];
+    EzFuture<long> fu[NUM_THREADS];
+    bool done[NUM_THREADS];
+    int  left = NUM_THREADS;
+    int  i;
+
+    for (i = 0 ; i < NUM_THREADS ; i++) {
+        fu[i] = th[i].async(&slow_square, i);
+        done[i] = false;
+    }
+
+    /* do other work here, and collect the results as they become ready */
+    while (left > 0) {
+        for (i = 0 ; i < NUM_THREADS ; i++) {
+            if (!done[i] && fu[i].wait_for(50) == 0) {
+                printf("thread %d returned %ld\n", i, fu[i].get());
+                done[i] = true;
+                left--;
+            }
+        }
+    }
+
+    return 0;   /* the threads are joined at their deletion */
+}
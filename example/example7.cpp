@@ -0,0 +1,73 @@
+/*****************************************************************************
+      example7.cpp : ez_parallel_for / ez_parallel_reduce Example
+ ----------------------------------------------------------------------------
+    ez_parallel_for() splits a loop into chunks and runs them on a shared
+    thread pool and the calling thread. ez_parallel_reduce() also combines
+    the per-thread partial results.
+    Testing a number for primality costs more for larger numbers, so the
+    prime count uses the dynamic partitioning.
+
+How to compile:
+
+ GNU:           g++ example7.cpp -pthread
+ MinGW:         g++ -static -static-libstdc++ -static-libgcc example7.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /MT example7.cpp
+ Borland:       bcc32 -WM example7.cpp
+ Digital Mars:  dmc example7.cpp -D_MT=1
+ Open Watcom:   wcl386 -bm example7.cpp
+ *****************************************************************************/
+
+#include <stdio.h>      /* printf() */
+#include "../EzThread.hpp"
+
+#ifdef __DMC__
+#  include "dmc_safe_printf.h" /* patch for Digial Mars Compiler's printf() */
+#endif
+
+#define N_ITEMS   1000000L
+#define N_PRIMES  2000000L
+
+/* ------------------------- loop body functions ---------------------------- */
+/* A function object holds the data which the loop body works on.             */
+/* -------------------------------------------------------------------------- */
+struct Square {
+    double *data;
+    void operator()(long i) const { data[i] = (double)i * (double)i; }
+};
+
+long is_prime(long n)
+{
+    if (n < 2) return 0;
+    for (long d = 2; d * d <= n; d++) {
+        if (n % d == 0) return 0;
+    }
+    return 1;
+}
+
+long add(long a, long b) { return a + b; }
+
+/* ---------------------------------- main ---------------------------------- */
+int main()
+{
+    static double data[N_ITEMS];
+    Square sq;
+    long i, bad, primes;
+
+    printf("%d thread(s) take part in a loop\n", EzParallel::concurrency());
+
+    /* data[i] = i * i : every iteration costs the same */
+    sq.data = data;
+    ez_parallel_for(0, N_ITEMS, 0, sq, EZ_PARTITION_STATIC);
+
+    bad = 0;
+    for (i = 0; i < N_ITEMS; i++) {
+        if (data[i] != (double)i * (double)i) bad++;
+    }
+    printf("ez_parallel_for   : %ld wrong item(s)\n", bad);
+
+    /* the number of primes below N_PRIMES : 0 + is_prime(0) + is_prime(1) + ... */
+    primes = ez_parallel_reduce(0, N_PRIMES, 0L, &is_prime, &add, 1000);
+    printf("ez_parallel_reduce: %ld primes below %ld\n", primes, N_PRIMES);
+
+    return 0;
+}
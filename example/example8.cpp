@@ -0,0 +1,76 @@
+/*****************************************************************************
+      example8.cpp : EzTimerQueue Example: Periodic and One-shot Timers
+ ----------------------------------------------------------------------------
+    EzTimerQueue<TYPE> runs 'void funcname(TYPE)' callbacks at given times
+    on a single thread, however many timers there are.
+    (1) Define callback functions of type 'void funcname(TYPE)'.
+    (2) Instantiate an EzTimerQueue<TYPE> object (its thread starts here).
+    (3) schedule() one-shot timers, schedule_rate() fixed-rate timers,
+        and cancel() them by id.
+    Times are in nanoseconds of the EzMutex::nanotime() clock.
+
+How to compile:
+
+ GNU:           g++ example8.cpp -pthread
+ MinGW:         g++ -static -static-libstdc++ -static-libgcc example8.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /MT example8.cpp
+ Borland:       bcc32 -WM example8.cpp
+ Digital Mars:  dmc example8.cpp -D_MT=1
+ Open Watcom:   wcl386 -bm example8.cpp
+ *****************************************************************************/
+
+#include <stdio.h>      /* printf() */
+#include "../EzThread.hpp"
+
+#ifdef __DMC__
+#  include "dmc_safe_printf.h" /* patch for Digial Mars Compiler's printf() */
+#endif
+
+#define MSEC  ((ezint64_t)1000000)   /* nanoseconds in a millisecond */
+
+struct Ticker {
+    ezint64_t start;
+    int count;
+};
+
+/* ---------------------------- timer callbacks ----------------------------- */
+void tick(Ticker *t)      /* every 100 ms */
+{
+    ezint64_t late = EzMutex::nanotime() - (t->start + (t->count + 1) * 100 * MSEC);
+    t->count++;
+    printf("tick %2d (%ld us late)\n", t->count, (long)(late / 1000));
+}
+
+void never(Ticker *t)     /* cancelled before it runs */
+{
+    (void)t;
+    printf("this is never printed\n");
+}
+
+void stop(Ticker *t)      /* one-shot after 1 second */
+{
+    (void)t;
+    printf("one-shot timer fired\n");
+}
+
+/* ---------------------------------- main ---------------------------------- */
+int main()
+{
+    EzTimerQueue<Ticker *> timers;   /* the timer thread is started here */
+    Ticker ticker;
+    long id_tick, id_never;
+
+    ticker.count = 0;
+    ticker.start = EzMutex::nanotime();
+    id_tick  = timers.schedule_rate(&tick, &ticker, 100 * MSEC, 100 * MSEC);
+    id_never = timers.schedule(&never, &ticker, 500 * MSEC);
+    timers.schedule(&stop, &ticker, 1000 * MSEC);
+
+    timers.cancel(id_never);
+    EzMutex::nanosleep_until(ticker.start + 1050 * MSEC);
+
+    timers.cancel(id_tick);  /* waits if tick() is running, then ticker is free */
+    printf("%d ticks, %d timer(s) left\n", ticker.count, timers.size());
+
+    return 0;   /* the timer thread is stopped at its deletion */
+}
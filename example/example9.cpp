@@ -0,0 +1,77 @@
+/*****************************************************************************
+      example9.cpp : EzTaskGraph Example: Tasks with Dependencies
+ ----------------------------------------------------------------------------
+    EzTaskGraph<TYPE> runs 'void funcname(TYPE)' tasks in the order given
+    by their dependencies. A task starts as soon as the tasks it depends
+    on have finished, without waiting for a whole stage.
+    (1) Define task functions of type 'void funcname(TYPE)'.
+    (2) Instantiate an EzWorkStealPool<void *> (the workers) and an
+        EzTaskGraph<TYPE> object.
+    (3) add_node() the tasks and add_edge() the dependencies.
+    (4) run() the graph, as many times as needed, and read the timings.
+
+        load(0) --+--> parse(1) -----------+--> report(4)
+                  +--> parse(2) --> sum(3)-+
+
+How to compile:
+
+ GNU:           g++ example9.cpp -pthread
+ MinGW:         g++ -static -static-libstdc++ -static-libgcc example9.cpp -DUSE_WIN_THREAD
+ Microsoft:     cl /MT example9.cpp
+ Borland:       bcc32 -WM example9.cpp
+ Digital Mars:  dmc example9.cpp -D_MT=1
+ Open Watcom:   wcl386 -bm example9.cpp
+ *****************************************************************************/
+
+#include <stdio.h>      /* printf() */
+#include "../EzThread.hpp"
+
+#ifdef __DMC__
+#  include "dmc_safe_printf.h" /* patch for Digial Mars Compiler's printf() */
+#endif
+
+static const char *g_names[] = { "load", "parse A", "parse B", "sum", "report" };
+
+/* ------------------------------ task function ----------------------------- */
+void task(int id)
+{
+    static const int ms[] = { 20, 10, 40, 30, 10 };
+    EzMutex::millisleep(ms[id]);   /* pretend to work */
+}
+
+/* ---------------------------------- main ---------------------------------- */
+int main()
+{
+    EzWorkStealPool<void *> pool(2);   /* the workers are started here */
+    EzTaskGraph<int> graph;
+    int id[5], path[5];
+    int i, n, run;
+
+    for (i = 0; i < 5; i++) id[i] = graph.add_node(&task, i);
+    graph.add_edge(id[0], id[1]);
+    graph.add_edge(id[0], id[2]);
+    graph.add_edge(id[2], id[3]);
+    graph.add_edge(id[1], id[4]);
+    graph.add_edge(id[3], id[4]);
+
+    for (run = 1; run <= 2; run++) {   /* a graph can be run again */
+        if (graph.run(pool)) {
+            printf("the graph has a cycle\n");
+            return 1;
+        }
+        printf("run %d: %ld ms\n", run, (long)(graph.elapsed_ns() / 1000000));
+    }
+
+    for (i = 0; i < 5; i++) {
+        printf("  %-8s start %3ld ms, took %3ld ms\n", g_names[i],
+               (long)(graph.node_start_ns(id[i]) / 1000000),
+               (long)(graph.node_time_ns(id[i]) / 1000000));
+    }
+
+    n = graph.critical_path(path, 5);
+    printf("critical path (%ld ms):", (long)(graph.critical_path_ns() / 1000000));
+    for (i = 0; i < n; i++) printf(" %s", g_names[path[i]]);
+    printf("\n");
+
+    return 0;   /* the workers are joined at the pool's deletion */
+}